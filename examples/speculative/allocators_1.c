@@ -118,8 +118,9 @@ struct tcp2_allocator {
 /*
  * Allocator Operations.
  *
- * The essential operations executed within the allocator system.  Here there
- * are only two: alloc and free:
+ * The essential operations executed within the allocator system.  There are
+ * two essential operations: alloc and free, and three optional ones:
+ * alloc_batch, free_batch and trim:
  */
 struct tcp2_allocator_operations {
 /*
@@ -178,6 +179,79 @@ struct tcp2_allocator_operations {
  */
   void  (*free)(const struct tcp2_allocator *allocator,
                 uint64_t type, size_t size, void *obj);
+
+/*
+ * Optional.  Allocate a number of memory regions of the same type and size in
+ * one call.  tcp2 uses this on hot paths that need many objects at once, for
+ * example buffers for a batch of datagrams read with recvmmsg.
+ *
+ * When NULL, tcp2 falls back to calling alloc once per object.
+ *
+ * Arguments:
+ * allocator: As above.
+ *
+ * type: As above.
+ *
+ * size: As above.
+ *
+ * count: The number of memory regions requested.
+ *
+ * objs : An array of at least count pointers, receiving the memory regions.
+ *
+ * Returns:
+ * The number of memory regions allocated, stored in the first entries of
+ * objs.  This may be less than count, or 0, upon failure to allocate.
+ */
+  size_t (*alloc_batch)(const struct tcp2_allocator *allocator,
+                        uint64_t type, size_t size,
+                        size_t count, void **objs);
+
+/*
+ * Optional.  Free a number of memory regions of the same type and size in one
+ * call.  tcp2 uses this on hot paths that release many objects at once, for
+ * example all of the sent packet records acknowledged by one ack frame.
+ *
+ * When NULL, tcp2 falls back to calling free once per object.
+ *
+ * Arguments:
+ * allocator: As above.
+ *
+ * type: As above.
+ *
+ * size: As above.
+ *
+ * count: The number of memory regions in objs.
+ *
+ * objs : An array of count pointers to the memory regions that are to be
+ *        returned to the allocator.
+ */
+  void   (*free_batch)(const struct tcp2_allocator *allocator,
+                       uint64_t type, size_t size,
+                       size_t count, void **objs);
+
+/*
+ * Optional.  Release memory that the allocator holds but that tcp2 is not
+ * using, such as cached objects, empty slabs or unused pool regions.  tcp2
+ * calls this on the thread that owns the allocator, when the application asks
+ * for memory to be given back, see allocators_12.c.
+ *
+ * Allocators that cache memory obtained from another allocator hand all of
+ * their idle memory back to it and then pass the request on.  Allocators that
+ * obtain memory from the system return it to the system, up to the target.
+ *
+ * When NULL, the allocator holds no idle memory.
+ *
+ * Arguments:
+ * allocator: As above.
+ *
+ * target: The number of bytes the application would like returned to the
+ *         system, or 0 for as much as possible.
+ *
+ * Returns:
+ * The number of bytes returned to the system, as far as the allocator can
+ * tell.  This may be more or less than the target.
+ */
+  size_t (*trim)(const struct tcp2_allocator *allocator, size_t target);
 };
 
 
@@ -195,35 +269,87 @@ void tcp2_allocator_free(const struct tcp2_allocator *allocator,
   allocator->operations->free(allocator, type, size, obj);
 }
 
+/*
+ * The batch helpers fall back to a loop when an allocator does not implement
+ * the batch operations, so existing allocators keep working unchanged.
+ */
+size_t tcp2_allocator_alloc_batch(const struct tcp2_allocator *allocator,
+                                  uint64_t type, size_t size,
+                                  size_t count, void **objs) {
+  if (allocator->operations->alloc_batch) {
+    return
+      allocator->operations->alloc_batch(allocator, type, size, count, objs);
+  }
+
+  size_t index;
+  for (index = 0; index < count; ++index) {
+    objs[index] = allocator->operations->alloc(allocator, type, size);
+    if (!objs[index])
+      break;
+  }
+
+  return index;
+}
+
+void tcp2_allocator_free_batch(const struct tcp2_allocator *allocator,
+                               uint64_t type, size_t size,
+                               size_t count, void **objs) {
+  if (allocator->operations->free_batch) {
+    allocator->operations->free_batch(allocator, type, size, count, objs);
+    return;
+  }
+
+  for (size_t index = 0; index < count; ++index)
+    allocator->operations->free(allocator, type, size, objs[index]);
+}
 
+size_t tcp2_allocator_trim(const struct tcp2_allocator *allocator,
+                           size_t target) {
+  if (!allocator->operations->trim)
+    return 0;
 
+  return allocator->operations->trim(allocator, target);
+}
 
 
 
 /*
- * Modified operations.  The application author may set these functions when
- * they wish to take responsibility for allocating non tcp2 structures or
- * memory regions, which are those structs or memory regions with type id
- * == 0 or > the tcp2 type limit (1048576)
+ * An example of tcp2 using the batch operations internally.  When an ack
+ * frame arrives, every sent packet record it covers is unlinked from the
+ * connection and then all of them are freed with a single call.
  */
-static struct tcp2_allocator_operations tcp2_trivial_allocator_app_operations = {
-  .alloc = NULL,
-  .free = NULL,
-};
+#define TCP2_ACK_FREE_BATCH 64
+
+static void tcp2_connection_on_ack_frame(struct tcp2_connection *connection,
+                                         const struct tcp2_ack_frame *ack) {
+  const struct tcp2_allocator *allocator =
+    connection->thread_context->allocator;
+
+  void *acked[TCP2_ACK_FREE_BATCH];
+  size_t count = 0;
+
+  struct tcp2_sent_packet *sent_packet;
+  while ((sent_packet = tcp2_connection_pop_acked(connection, ack))) {
+    tcp2_congestion_on_acked(connection, sent_packet);
+
+    acked[count++] = sent_packet;
+    if (count == TCP2_ACK_FREE_BATCH) {
+      tcp2_allocator_free_batch(allocator, TCP2_TYPE_SENT_PACKET,
+                                sizeof(struct tcp2_sent_packet),
+                                count, acked);
+      count = 0;
+    }
+  }
 
-void tcp2_set_trivial_allocator_app_operations(
-    void *(*alloc)(const struct tcp2_allocator *allocator,
-                   uint64_t type, size_t size),
-    void   (*free)(const struct tcp2_allocator *allocator,
-                   uint64_t type, size_t size, void *obj)) {
-  tcp2_trivial_allocator_app_operations.alloc = alloc;
-  tcp2_trivial_allocator_app_operations.free = free;
+  if (count > 0) {
+    tcp2_allocator_free_batch(allocator, TCP2_TYPE_SENT_PACKET,
+                              sizeof(struct tcp2_sent_packet),
+                              count, acked);
+  }
 }
 
-void tcp2_clear_trivial_allocator_app_operations(void) {
-  tcp2_trivial_allocator_app_operations.alloc = NULL;
-  tcp2_trivial_allocator_app_operations.free = NULL;
-}
+
+
 
 
 
@@ -232,57 +358,177 @@ void tcp2_clear_trivial_allocator_app_operations(void) {
  * free.
  */
 
+/*
+ * Zeroing policies.  Zeroing every known object on both alloc and free writes
+ * each object twice during its lifetime, which is wasted memory bandwidth for
+ * objects that tcp2 fully initialises itself.  Instead each type id has a
+ * policy, made of these flags:
+ * - TCP2_ZERO_ON_ALLOC: the object is zeroed before it is handed to tcp2
+ * - TCP2_ZERO_ON_FREE: the object is wiped before it is released, for objects
+ *   that hold key material.  The wipe is never optimised away.
+ */
+#define TCP2_ZERO_NONE          0
+#define TCP2_ZERO_ON_ALLOC      (1 << 0)
+#define TCP2_ZERO_ON_FREE       (1 << 1)
+
+/*
+ * The size of the zeroing policy table.  Type ids from this value onwards,
+ * which includes application type ids, are zeroed on alloc only.
+ */
+#define TCP2_ZERO_POLICY_TYPES  64
+
+/*
+ * An mmap threshold of zero leaves every request to the C library.
+ */
+#define TCP2_TRIVIAL_MMAP_NEVER 0
+
+/*
+ * Trivial allocator.
+ *
+ * Both the built in trivial allocator and the modified trivial allocators
+ * below are instances of this structure, and each carries its own settings:
+ * - the zeroing policy of every type id known to tcp2
+ * - the mmap threshold: regions of at least this size are mapped directly
+ *   from the system, which hands out pages that are already zeroed, so they
+ *   are never memset on alloc.  The C library already maps large requests
+ *   itself and recycles them through its own caches, so this is off by
+ *   default and only worth enabling where large regions are long lived.
+ *   Slabs are never mapped this way, as they must be aligned to their size.
+ *   The decision only depends on the type id and the size, so that free
+ *   always agrees with alloc.
+ *
+ * The built in trivial allocator is const, its settings are those of the
+ * type registry and never change.
+ */
+struct tcp2_trivial_allocator {
+  struct tcp2_allocator tcp2_allocator;
+
+  size_t mmap_threshold;
+  uint8_t zero_policy[TCP2_ZERO_POLICY_TYPES];
+
+  /*
+   * Only used by modified trivial allocators.
+   */
+  struct tcp2_allocator_operations app_operations;
+};
+
+/*
+ * The zeroing policy of every type id known to tcp2, taken from the type
+ * registry (allocators_8.c).  Dynamically sized regions (type id 0) are not
+ * zeroed, and neither are objects that tcp2 initialises in full or that are
+ * only used as raw memory by other allocators.
+ */
+#define TCP2_TRIVIAL_ZERO_POLICY(name, id, size, align, zero) \
+  [id] = (zero),
+
+#define TCP2_TRIVIAL_ZERO_POLICIES {                          \
+  [0] = TCP2_ZERO_NONE,                                       \
+  TCP2_TYPES(TCP2_TRIVIAL_ZERO_POLICY)                        \
+}
+
+static inline int tcp2_trivial_zero_policy(
+    const struct tcp2_trivial_allocator *trivial_allocator, uint64_t type) {
+  if (type < TCP2_ZERO_POLICY_TYPES)
+    return trivial_allocator->zero_policy[type];
+
+  return TCP2_ZERO_ON_ALLOC;
+}
+
+static inline int tcp2_trivial_maps(
+    const struct tcp2_trivial_allocator *trivial_allocator,
+    uint64_t type, size_t size) {
+  return (type != TCP2_TYPE_SLAB) &&
+         (trivial_allocator->mmap_threshold != TCP2_TRIVIAL_MMAP_NEVER) &&
+         (size >= trivial_allocator->mmap_threshold);
+}
+
 /*
  * The definitions of the trivial alloc and free functions.
  */
 static void *tcp2_trivial_alloc(const struct tcp2_allocator *allocator,
                                 uint64_t type, size_t size) {
-  if ((tcp2_trivial_allocator_app_operations.alloc != NULL) &&
-      (type == 0) || (type > 1048576)) {
-    return
-      tcp2_trivial_allocator_app_operations.alloc(allocator, type, size);
+  const struct tcp2_trivial_allocator *trivial_allocator =
+    (const struct tcp2_trivial_allocator *)allocator;
+  int zero_policy = tcp2_trivial_zero_policy(trivial_allocator, type);
+  void *obj;
+
+  if (tcp2_trivial_maps(trivial_allocator, type, size)) {
+    obj = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return (obj == MAP_FAILED) ? NULL : obj;
   }
 
-  void *obj = malloc(size);
-  if (!obj)
-    return NULL;
+  /*
+   * Slabs must be aligned to their size, see allocators_2.c
+   */
+  if (type == TCP2_TYPE_SLAB) {
+    obj = aligned_alloc(TCP2_SLAB_SIZE, size);
+    if (obj && (zero_policy & TCP2_ZERO_ON_ALLOC))
+      memset(obj, 0, size);
 
-  if (type != 0)
-    memset(obj, 0, size);
+    return obj;
+  }
 
-  return obj;
+  /*
+   * calloc knows when its memory comes fresh from the system and skips the
+   * memset in that case.
+   */
+  if (zero_policy & TCP2_ZERO_ON_ALLOC)
+    return calloc(1, size);
+
+  return malloc(size);
 }
 
 static void tcp2_trivial_free(const struct tcp2_allocator *allocator,
-                              unt64_t type, size_t size, void *obj) {
-  if ((tcp2_trivial_allocator_app_operations.alloc != NULL) &&
-      (type == 0) || (type > 1048576)) {
-    tcp2_trivial_allocator_app_operations.free(
-      allocator, type, size, obj);
+                              uint64_t type, size_t size, void *obj) {
+  const struct tcp2_trivial_allocator *trivial_allocator =
+    (const struct tcp2_trivial_allocator *)allocator;
 
+  if (tcp2_trivial_zero_policy(trivial_allocator, type) & TCP2_ZERO_ON_FREE)
+    tcp2_secure_zero(obj, size);
+
+  if (tcp2_trivial_maps(trivial_allocator, type, size)) {
+    munmap(obj, size);
     return;
   }
 
-  if (type != 0)
-    memset(obj, 0, size);
-
   free(obj);
 }
 
 
 
+/*
+ * The C library keeps freed memory for reuse.  Ask it to give back what it
+ * can, it does not report how much that was.
+ */
+static size_t tcp2_trivial_trim(const struct tcp2_allocator *allocator,
+                                size_t target) {
+  malloc_trim(0);
+
+  return 0;
+}
+
+
+
 /*
  * The global operations structure to hold references to trivial alloc and free.
  */
 static struct tcp2_allocator_operations tcp2_trivial_allocator_operations = {
   .alloc = tcp2_trivial_alloc,
   .free = tcp2_trivial_free,
+  .trim = tcp2_trivial_trim,
 };
 
-static struct tcp2_allocator tcp2_trivial_allocator = {
-  .operations = &tcp2_trivial_allocator_operations,
+static const struct tcp2_trivial_allocator tcp2_trivial_allocator = {
+  .tcp2_allocator.operations = &tcp2_trivial_allocator_operations,
+  .mmap_threshold = TCP2_TRIVIAL_MMAP_NEVER,
+  .zero_policy = TCP2_TRIVIAL_ZERO_POLICIES,
 };
 
+#undef TCP2_TRIVIAL_ZERO_POLICIES
+#undef TCP2_TRIVIAL_ZERO_POLICY
+
 
 
 /*
@@ -292,7 +538,162 @@ static struct tcp2_allocator tcp2_trivial_allocator = {
  * functions.
  */
 const struct tcp2_allocator *tcp2_get_trivial_allocator(void) {
-  return &tcp2_trivial_allocator;
+  return &tcp2_trivial_allocator.tcp2_allocator;
+}
+
+
+
+
+
+
+/*
+ * Modified trivial allocators.  The application author may supply alloc and
+ * free functions when they wish to take responsibility for allocating non
+ * tcp2 structures or memory regions, which are those structs or memory
+ * regions with type id == 0 or >= the tcp2 type limit (1048576).  All other
+ * type ids are still served by the trivial allocator.
+ *
+ * The routing is decided once, when the modified allocator is created, and
+ * is held by the allocator instance rather than in global state:
+ * - the instance carries its own copy of the application operations, both of
+ *   which are known to be set
+ * - its operations structure points at routing functions that make a single
+ *   comparison per call, while the built in trivial allocator keeps the
+ *   plain functions with no routing at all
+ * Several modified allocators, for example one per thread, may coexist.
+ */
+#define TCP2_TYPE_LIMIT         1048576
+
+/*
+ * True for type id 0 and for type ids of the application.  Type id 0 wraps
+ * around to the largest value, so both cases are a single comparison.
+ */
+static inline int tcp2_trivial_routes_to_app(uint64_t type) {
+  return (type - 1) >= (TCP2_TYPE_LIMIT - 1);
+}
+
+static void *tcp2_trivial_routed_alloc(const struct tcp2_allocator *allocator,
+                                       uint64_t type, size_t size) {
+  const struct tcp2_trivial_allocator *trivial_allocator =
+    (const struct tcp2_trivial_allocator *)allocator;
+
+  if (tcp2_trivial_routes_to_app(type))
+    return trivial_allocator->app_operations.alloc(allocator, type, size);
+
+  return tcp2_trivial_alloc(allocator, type, size);
+}
+
+static void tcp2_trivial_routed_free(const struct tcp2_allocator *allocator,
+                                     uint64_t type, size_t size, void *obj) {
+  const struct tcp2_trivial_allocator *trivial_allocator =
+    (const struct tcp2_trivial_allocator *)allocator;
+
+  if (tcp2_trivial_routes_to_app(type)) {
+    trivial_allocator->app_operations.free(allocator, type, size, obj);
+    return;
+  }
+
+  tcp2_trivial_free(allocator, type, size, obj);
+}
+
+static struct tcp2_allocator_operations
+tcp2_trivial_routed_allocator_operations = {
+  .alloc = tcp2_trivial_routed_alloc,
+  .free = tcp2_trivial_routed_free,
+  .trim = tcp2_trivial_trim,
+};
+
+/*
+ * Serve a request of type id 0 or of an application type id with the
+ * settings of a modified trivial allocator, for its application functions to
+ * fall back to.  The allocator is the one passed to those functions.
+ */
+void *tcp2_trivial_allocator_fallback_alloc(
+    const struct tcp2_allocator *allocator, uint64_t type, size_t size) {
+  return tcp2_trivial_alloc(allocator, type, size);
+}
+
+void tcp2_trivial_allocator_fallback_free(
+    const struct tcp2_allocator *allocator,
+    uint64_t type, size_t size, void *obj) {
+  tcp2_trivial_free(allocator, type, size, obj);
+}
+
+
+
+/*
+ * Create a modified trivial allocator.
+ *
+ * Arguments:
+ * alloc, free: the application functions for type id 0 and application type
+ *              ids.  Both must be given, the allocator that is passed to them
+ *              is the modified allocator itself.
+ *
+ * Returns:
+ * A new allocator, or NULL if either function is missing or upon failure.
+ * It starts with the settings of the built in trivial allocator.
+ */
+struct tcp2_trivial_allocator *tcp2_create_trivial_allocator(
+    void *(*alloc)(const struct tcp2_allocator *allocator,
+                   uint64_t type, size_t size),
+    void   (*free)(const struct tcp2_allocator *allocator,
+                   uint64_t type, size_t size, void *obj)) {
+  if ((alloc == NULL) || (free == NULL))
+    return NULL;
+
+  struct tcp2_trivial_allocator *trivial_allocator =
+    tcp2_trivial_alloc(&tcp2_trivial_allocator.tcp2_allocator, 0,
+                       sizeof(struct tcp2_trivial_allocator));
+  if (!trivial_allocator)
+    return NULL;
+
+  trivial_allocator->tcp2_allocator.operations =
+    &tcp2_trivial_routed_allocator_operations;
+  trivial_allocator->mmap_threshold = tcp2_trivial_allocator.mmap_threshold;
+  memcpy(trivial_allocator->zero_policy, tcp2_trivial_allocator.zero_policy,
+         sizeof(trivial_allocator->zero_policy));
+  trivial_allocator->app_operations = (struct tcp2_allocator_operations){
+    .alloc = alloc,
+    .free = free,
+  };
+
+  return trivial_allocator;
+}
+
+/*
+ * Change the zeroing policy of a type id for one modified trivial allocator.
+ * An application may add zeroing, for example to assist debugging, but
+ * removing TCP2_ZERO_ON_ALLOC from a type that tcp2 relies on being zeroed is
+ * not supported.
+ *
+ * Returns:
+ * 0 on success, -1 if the type id is outside of the policy table.
+ */
+int tcp2_trivial_allocator_set_zero_policy(
+    struct tcp2_trivial_allocator *trivial_allocator,
+    uint64_t type, int policy) {
+  if (type >= TCP2_ZERO_POLICY_TYPES)
+    return -1;
+
+  trivial_allocator->zero_policy[type] = (uint8_t)policy;
+
+  return 0;
+}
+
+/*
+ * Map regions of at least 'threshold' bytes directly from the system, or
+ * none with TCP2_TRIVIAL_MMAP_NEVER.  Must be set before the allocator is
+ * first used, as free relies on it being the same as it was on alloc.
+ */
+void tcp2_trivial_allocator_set_mmap_threshold(
+    struct tcp2_trivial_allocator *trivial_allocator, size_t threshold) {
+  trivial_allocator->mmap_threshold = threshold;
+}
+
+void tcp2_destroy_trivial_allocator(
+    struct tcp2_trivial_allocator *trivial_allocator) {
+  tcp2_trivial_free(&tcp2_trivial_allocator.tcp2_allocator, 0,
+                    sizeof(struct tcp2_trivial_allocator), trivial_allocator);
 }
 
 
@@ -302,7 +703,10 @@ const struct tcp2_allocator *tcp2_get_trivial_allocator(void) {
 
 /*
  * This is an example of an application modifying the trivial allocator to
- * enact some small changes to its behaviour.
+ * enact some small changes to its behaviour.  Only type id 0 and application
+ * type ids reach these functions, the remaining dynamically sized regions
+ * are handed back to the trivial allocator, with the settings of the
+ * modified allocator.
  */
 static void *app_modified_alloc(const struct tcp2_allocator *allocator,
                                 uint64_t type, size_t size) {
@@ -312,33 +716,46 @@ static void *app_modified_alloc(const struct tcp2_allocator *allocator,
   if (type == APP_TYPE2)
     return app_alloc_type2();
 
-  return tcp2_trivial_alloc(allocator, type, size);
+  return tcp2_trivial_allocator_fallback_alloc(allocator, type, size);
 }
 
 static void app_modified_free(const struct tcp2_allocator *allocator,
-                              unt64_t type, size_t size, void *obj) {
+                              uint64_t type, size_t size, void *obj) {
   if (type == APP_TYPE1)
-    return app_free_type1();
+    return app_free_type1(obj);
   else
   if (type == APP_TYPE2)
-    return app_free_type2();
+    return app_free_type2(obj);
 
-  return tcp2_trivial_alloc(allocator, type, size);
+  tcp2_trivial_allocator_fallback_free(allocator, type, size, obj);
 }
 
 
 
 /*
- * Now use the tcp2 trivial allocator interfaces to set the modified alloc and
- * free.
+ * Now use the tcp2 trivial allocator interfaces to create an allocator with
+ * the modified alloc and free.  The application hands it to tcp2 like any
+ * other allocator, see app_get_modified_allocator() below.
  */
 int main(int argc, char** argc) {
-  tcp2_set_trivial_allocator_app_operations(
-    &app_modified_alloc, &app_modified_free);
+  struct tcp2_trivial_allocator *app_modified_allocator =
+    tcp2_create_trivial_allocator(&app_modified_alloc, &app_modified_free);
+  if (!app_modified_allocator)
+    return 1;
+
+  /*
+   * This application keeps large tcp2 regions for long, so it has them mapped
+   * directly rather than held in the caches of the C library.  They are of
+   * type id 0, and are mapped by the fallback of app_modified_alloc.
+   */
+  tcp2_trivial_allocator_set_mmap_threshold(app_modified_allocator,
+                                            256 * 1024);
+
+  app_store_modified_allocator(&app_modified_allocator->tcp2_allocator);
 
   int retval = app_run();
 
-  tcp2_clear_trivial_allocator_app_operations();
+  tcp2_destroy_trivial_allocator(app_modified_allocator);
 
   return retval;
 }
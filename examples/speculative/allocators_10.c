@@ -0,0 +1,591 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+/*
+ * This case study builds on the previous allocator case studies and
+ * demonstrates an allocator that keeps the memory of a thread on the NUMA
+ * node that the thread runs on.
+ *
+ * On systems with more than one socket, memory attached to a remote node is
+ * slower to reach than memory attached to the local node.  Linux places a
+ * page on the node of the thread that first touches it, but memory recycled
+ * by a general purpose allocator is often first touched by a different
+ * thread, and memory for slabs and pools is reserved long before it is used.
+ * Connection state that ends up on the remote node costs a large share of
+ * throughput.
+ *
+ * The NUMA allocator discovers the node of the calling thread when it is
+ * created, typically alongside the thread context, and maps all of the memory
+ * it serves with a memory policy preferring that node:
+ * - Slabs (allocators_2.c) are carved from 2 MiB extents mapped for the node
+ * - Other page sized requests, such as arena chunks (allocators_5.c), are
+ *   carved from extents as well, and recycled on per size free lists
+ * - Very large requests are mapped individually
+ * - Packet buffer pools (allocators_9.c) are given the node, and apply the
+ *   same policy to every region they commit
+ *
+ * Requests smaller than a page are passed to the backing allocator.  In the
+ * allocator stack of a thread the slab allocator sits above the NUMA
+ * allocator, so every small fixed size object is still served from node
+ * local slabs.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - Threads are pinned to CPUs of one node by the application, which is what
+ *   an application that cares about NUMA placement does anyway.  A thread
+ *   that migrates to another node keeps allocating from its original node.
+ * - The policy is MPOL_PREFERRED rather than MPOL_BIND: when the local node
+ *   runs out of memory, remote memory is better than failing.
+ * - Extents are never unmapped while the allocator lives.  A trim returns
+ *   the pages of free slabs and free page runs to the system instead, all
+ *   but the first page of each, which holds the free list link.  Every
+ *   extent is recorded on a list, allocated from the backing allocator, and
+ *   all of them are unmapped when the allocator is destroyed.
+ * - The depot of allocators_3.c is shared by all threads regardless of node.
+ *   A NUMA aware system context would keep one depot per node, each backed by
+ *   a NUMA allocator of that node.
+ * - A NUMA allocator is not thread safe, one is created per thread.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * Extents are the unit in which the NUMA allocator maps memory for its node.
+ */
+#define TCP2_NUMA_EXTENT_SIZE       ((size_t)2 * 1024 * 1024)
+
+#define TCP2_NUMA_PAGE_SIZE         4096
+
+/*
+ * Requests of up to this many pages are carved from extents, larger requests
+ * are mapped individually.
+ */
+#define TCP2_NUMA_MAX_CARVED_PAGES  16
+
+/*
+ * Nodes are represented by a single word node mask.
+ */
+#define TCP2_NUMA_MAX_NODES         64
+
+
+
+/*
+ * A stream of carved memory, the unused remainder of its current extent.
+ */
+struct tcp2_numa_carver {
+  char *next;
+  char *end;
+};
+
+/*
+ * The record of an extent.  Kept outside of the extent, as slabs fill their
+ * extents exactly.
+ */
+struct tcp2_numa_extent {
+  char *base;
+  struct tcp2_numa_extent *next;
+};
+
+/*
+ * NUMA allocator.
+ *
+ * Slabs are carved from their own extents, so that slab alignment never
+ * leaves gaps in the extents used for other requests.
+ */
+struct tcp2_numa_allocator {
+  struct tcp2_allocator tcp2_allocator;
+
+  const struct tcp2_allocator *backing;
+
+  int node;
+
+  struct tcp2_numa_carver slab_carver;
+  struct tcp2_numa_carver page_carver;
+
+  void *free_slabs;
+  void *free_pages[TCP2_NUMA_MAX_CARVED_PAGES + 1];
+
+  /*
+   * Free slabs and page runs whose pages have been returned to the system by
+   * a trim.  They are reused after the ones above, as touching them faults
+   * their pages in again.
+   */
+  void *released_slabs;
+  void *released_pages[TCP2_NUMA_MAX_CARVED_PAGES + 1];
+
+  struct tcp2_numa_extent *extents;
+};
+
+
+
+/*
+ * Discover the node of the calling thread.
+ *
+ * Returns:
+ * The node, or -1 if it cannot be determined.
+ */
+static int tcp2_numa_current_node(void) {
+  unsigned cpu;
+  unsigned node;
+
+  if (getcpu(&cpu, &node) != 0)
+    return -1;
+
+  return (int)node;
+}
+
+/*
+ * Apply the node preference of a NUMA allocator to a mapping.  Must be done
+ * before the mapping is first touched.
+ */
+int tcp2_numa_bind(int node, void *addr, size_t len) {
+  if ((node < 0) || (node >= TCP2_NUMA_MAX_NODES))
+    return -1;
+
+  unsigned long nodemask = 1UL << node;
+
+  /*
+   * maxnode counts one more than the number of bits the kernel reads.
+   */
+  return (int)mbind(addr, len, MPOL_PREFERRED,
+                    &nodemask, TCP2_NUMA_MAX_NODES + 1, 0);
+}
+
+/*
+ * Map memory for the node of the allocator, aligned to 'alignment', which is
+ * a power of two of at least a page.
+ */
+static void *tcp2_numa_map(const struct tcp2_numa_allocator *numa_allocator,
+                           size_t size, size_t alignment) {
+  size_t mapped_size = size + alignment - TCP2_NUMA_PAGE_SIZE;
+
+  char *mapped = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapped == MAP_FAILED)
+    return NULL;
+
+  char *start = (char *)(((uintptr_t)mapped + alignment - 1) &
+                         ~(uintptr_t)(alignment - 1));
+  if (start > mapped)
+    munmap(mapped, (size_t)(start - mapped));
+  if (mapped + mapped_size > start + size)
+    munmap(start + size, (size_t)(mapped + mapped_size - (start + size)));
+
+  tcp2_numa_bind(numa_allocator->node, start, size);
+
+  return start;
+}
+
+/*
+ * Carve from a stream, starting a new extent when the current one runs out.
+ * The remainder of a previous extent is left unused, which is at most one
+ * request worth of memory.
+ */
+static void *tcp2_numa_carve(struct tcp2_numa_allocator *numa_allocator,
+                             struct tcp2_numa_carver *carver, size_t size) {
+  if ((size_t)(carver->end - carver->next) < size) {
+    struct tcp2_numa_extent *record =
+      tcp2_allocator_alloc(numa_allocator->backing,
+                           0, sizeof(struct tcp2_numa_extent));
+    if (!record)
+      return NULL;
+
+    char *extent = tcp2_numa_map(numa_allocator, TCP2_NUMA_EXTENT_SIZE,
+                                 TCP2_NUMA_EXTENT_SIZE);
+    if (!extent) {
+      tcp2_allocator_free(numa_allocator->backing,
+                          0, sizeof(struct tcp2_numa_extent), record);
+      return NULL;
+    }
+
+    record->base = extent;
+    record->next = numa_allocator->extents;
+    numa_allocator->extents = record;
+
+    /*
+     * Transparent huge pages for the extent, as it is huge page aligned.
+     */
+    madvise(extent, TCP2_NUMA_EXTENT_SIZE, MADV_HUGEPAGE);
+
+    carver->next = extent;
+    carver->end = extent + TCP2_NUMA_EXTENT_SIZE;
+  }
+
+  void *obj = carver->next;
+  carver->next += size;
+
+  return obj;
+}
+
+static inline size_t tcp2_numa_pages(size_t size) {
+  return (size + TCP2_NUMA_PAGE_SIZE - 1) / TCP2_NUMA_PAGE_SIZE;
+}
+
+static inline void *tcp2_numa_pop(void **list) {
+  void *obj = *list;
+  if (obj)
+    *list = *(void **)obj;
+
+  return obj;
+}
+
+static inline void tcp2_numa_push(void **list, void *obj) {
+  *(void **)obj = *list;
+  *list = obj;
+}
+
+
+
+/*
+ * The definitions of the NUMA alloc and free functions.
+ *
+ * Which path serves a request depends only on its type id and size, so free
+ * always takes the same path as alloc did.  Memory from extents is recycled
+ * without being zeroed, so it is zeroed according to the registry policy
+ * (allocators_8.c); fresh mappings are zeroed by the system.
+ */
+static void *tcp2_numa_alloc(const struct tcp2_allocator *allocator,
+                             uint64_t type, size_t size) {
+  struct tcp2_numa_allocator *numa_allocator =
+    (struct tcp2_numa_allocator *)allocator;
+  void *obj;
+
+  if (type == TCP2_TYPE_SLAB) {
+    obj = tcp2_numa_pop(&numa_allocator->free_slabs);
+    if (!obj)
+      obj = tcp2_numa_pop(&numa_allocator->released_slabs);
+    if (!obj)
+      obj = tcp2_numa_carve(numa_allocator, &numa_allocator->slab_carver,
+                            TCP2_SLAB_SIZE);
+
+    return obj;
+  }
+
+  if (size < TCP2_NUMA_PAGE_SIZE)
+    return tcp2_allocator_alloc(numa_allocator->backing, type, size);
+
+  size_t pages = tcp2_numa_pages(size);
+  if (pages > TCP2_NUMA_MAX_CARVED_PAGES) {
+    return tcp2_numa_map(numa_allocator, pages * TCP2_NUMA_PAGE_SIZE,
+                         TCP2_NUMA_PAGE_SIZE);
+  }
+
+  obj = tcp2_numa_pop(&numa_allocator->free_pages[pages]);
+  if (!obj)
+    obj = tcp2_numa_pop(&numa_allocator->released_pages[pages]);
+  if (obj) {
+    if (tcp2_type_zero_policy(type) & TCP2_ZERO_ON_ALLOC)
+      memset(obj, 0, size);
+
+    return obj;
+  }
+
+  return tcp2_numa_carve(numa_allocator, &numa_allocator->page_carver,
+                         pages * TCP2_NUMA_PAGE_SIZE);
+}
+
+static void tcp2_numa_free(const struct tcp2_allocator *allocator,
+                           uint64_t type, size_t size, void *obj) {
+  struct tcp2_numa_allocator *numa_allocator =
+    (struct tcp2_numa_allocator *)allocator;
+
+  if (tcp2_type_zero_policy(type) & TCP2_ZERO_ON_FREE)
+    tcp2_secure_zero(obj, size);
+
+  if (type == TCP2_TYPE_SLAB) {
+    tcp2_numa_push(&numa_allocator->free_slabs, obj);
+    return;
+  }
+
+  if (size < TCP2_NUMA_PAGE_SIZE) {
+    tcp2_allocator_free(numa_allocator->backing, type, size, obj);
+    return;
+  }
+
+  size_t pages = tcp2_numa_pages(size);
+  if (pages > TCP2_NUMA_MAX_CARVED_PAGES) {
+    munmap(obj, pages * TCP2_NUMA_PAGE_SIZE);
+    return;
+  }
+
+  tcp2_numa_push(&numa_allocator->free_pages[pages], obj);
+}
+
+/*
+ * Return the pages of one free list to the system, moving its entries to the
+ * matching released list.
+ */
+static size_t tcp2_numa_release_list(void **free_list, void **released_list,
+                                     size_t run_size, size_t target,
+                                     size_t released) {
+  void *obj;
+
+  while (((target == 0) || (released < target)) &&
+         (obj = tcp2_numa_pop(free_list))) {
+    madvise((char *)obj + TCP2_NUMA_PAGE_SIZE,
+            run_size - TCP2_NUMA_PAGE_SIZE, MADV_DONTNEED);
+    tcp2_numa_push(released_list, obj);
+
+    released += run_size - TCP2_NUMA_PAGE_SIZE;
+  }
+
+  return released;
+}
+
+/*
+ * Slabs first, as they are the largest runs, then page runs from the largest
+ * down.  Single pages cannot be released, their only page holds the link.
+ */
+static size_t tcp2_numa_trim(const struct tcp2_allocator *allocator,
+                             size_t target) {
+  struct tcp2_numa_allocator *numa_allocator =
+    (struct tcp2_numa_allocator *)allocator;
+
+  size_t released =
+    tcp2_numa_release_list(&numa_allocator->free_slabs,
+                           &numa_allocator->released_slabs,
+                           TCP2_SLAB_SIZE, target, 0);
+
+  for (size_t pages = TCP2_NUMA_MAX_CARVED_PAGES; pages > 1; --pages) {
+    released =
+      tcp2_numa_release_list(&numa_allocator->free_pages[pages],
+                             &numa_allocator->released_pages[pages],
+                             pages * TCP2_NUMA_PAGE_SIZE, target, released);
+  }
+
+  if ((target != 0) && (released >= target))
+    return released;
+
+  return released + tcp2_allocator_trim(numa_allocator->backing,
+                                        target ? target - released : 0);
+}
+
+
+
+/*
+ * The global operations structure to hold references to NUMA alloc and free.
+ */
+static struct tcp2_allocator_operations tcp2_numa_allocator_operations = {
+  .alloc = tcp2_numa_alloc,
+  .free = tcp2_numa_free,
+  .trim = tcp2_numa_trim,
+};
+
+
+
+/*
+ * Create a NUMA allocator for the node of the calling thread.
+ *
+ * Arguments:
+ * backing: the allocator for requests smaller than a page
+ *
+ * Returns:
+ * A new NUMA allocator, or NULL upon failure, including when the node of the
+ * calling thread cannot be determined.  Callers fall back to their regular
+ * allocator stack in that case.
+ */
+struct tcp2_numa_allocator *tcp2_create_numa_allocator(
+    const struct tcp2_allocator *backing) {
+  int node = tcp2_numa_current_node();
+  if ((node < 0) || (node >= TCP2_NUMA_MAX_NODES))
+    return NULL;
+
+  struct tcp2_numa_allocator *numa_allocator =
+    tcp2_allocator_alloc(backing, 0, sizeof(struct tcp2_numa_allocator));
+  if (!numa_allocator)
+    return NULL;
+
+  memset(numa_allocator, 0, sizeof(struct tcp2_numa_allocator));
+
+  numa_allocator->tcp2_allocator.operations = &tcp2_numa_allocator_operations;
+  numa_allocator->backing = backing;
+  numa_allocator->node = node;
+
+  return numa_allocator;
+}
+
+int tcp2_numa_allocator_get_node(
+    const struct tcp2_numa_allocator *numa_allocator) {
+  return numa_allocator->node;
+}
+
+/*
+ * NUMA allocator destructor.  Every extent is unmapped regardless of whether
+ * memory carved from it is still in use, so all users of the NUMA allocator
+ * must be gone by now.  Very large requests are mapped individually and are
+ * unmapped when they are freed, as usual.
+ */
+void tcp2_destroy_numa_allocator(struct tcp2_numa_allocator *numa_allocator) {
+  struct tcp2_numa_extent *record;
+
+  while ((record = numa_allocator->extents)) {
+    numa_allocator->extents = record->next;
+
+    munmap(record->base, TCP2_NUMA_EXTENT_SIZE);
+    tcp2_allocator_free(numa_allocator->backing,
+                        0, sizeof(struct tcp2_numa_extent), record);
+  }
+
+  tcp2_allocator_free(numa_allocator->backing,
+                      0, sizeof(struct tcp2_numa_allocator), numa_allocator);
+}
+
+
+
+
+
+
+/*
+ * The following shows tcp2 building a node local allocator stack for a new
+ * thread context: the NUMA allocator at the bottom, slabs above it for every
+ * fixed size type, and a packet buffer pool given the same node on top.  If
+ * any part of the stack cannot be created, the parts created so far are
+ * destroyed and the thread context uses its regular allocator.
+ */
+struct tcp2_numa_thread_allocators {
+  struct tcp2_numa_allocator *numa_allocator;
+  struct tcp2_slab_allocator *slab_allocator;
+  struct tcp2_pool_allocator *pool_allocator;
+};
+
+/*
+ * Destroy whatever part of the stack exists, top down.
+ */
+static void tcp2_destroy_numa_thread_allocators(
+    struct tcp2_numa_thread_allocators *allocators) {
+  if (allocators->pool_allocator)
+    tcp2_destroy_pool_allocator(allocators->pool_allocator);
+  if (allocators->slab_allocator)
+    tcp2_destroy_slab_allocator(allocators->slab_allocator);
+  if (allocators->numa_allocator)
+    tcp2_destroy_numa_allocator(allocators->numa_allocator);
+
+  *allocators = (struct tcp2_numa_thread_allocators){ NULL, NULL, NULL };
+}
+
+struct tcp2_thread_context *tcp2_create_numa_thread_context(
+    struct tcp2_system_context *tcp2_system_context,
+    struct tcp2_numa_thread_allocators *allocators) {
+  *allocators = (struct tcp2_numa_thread_allocators){ NULL, NULL, NULL };
+
+  allocators->numa_allocator =
+    tcp2_create_numa_allocator(tcp2_get_trivial_allocator());
+  if (!allocators->numa_allocator)
+    return tcp2_create_thread_context(tcp2_system_context, NULL);
+
+  allocators->slab_allocator =
+    tcp2_create_slab_allocator(&allocators->numa_allocator->tcp2_allocator);
+  if (!allocators->slab_allocator) {
+    tcp2_destroy_numa_thread_allocators(allocators);
+    return tcp2_create_thread_context(tcp2_system_context, NULL);
+  }
+
+  tcp2_slab_allocator_register_tcp2_types(allocators->slab_allocator);
+
+  allocators->pool_allocator =
+    tcp2_create_pool_allocator(&allocators->slab_allocator->tcp2_allocator,
+                               0);
+  if (!allocators->pool_allocator) {
+    tcp2_destroy_numa_thread_allocators(allocators);
+    return tcp2_create_thread_context(tcp2_system_context, NULL);
+  }
+
+  tcp2_pool_allocator_set_numa_node(
+    allocators->pool_allocator,
+    tcp2_numa_allocator_get_node(allocators->numa_allocator));
+
+  struct tcp2_thread_context *tcp2_thread_context =
+    tcp2_create_thread_context(tcp2_system_context,
+                               &allocators->pool_allocator->tcp2_allocator);
+  if (!tcp2_thread_context)
+    tcp2_destroy_numa_thread_allocators(allocators);
+
+  return tcp2_thread_context;
+}
+
+/*
+ * Thread context destructor, for a thread context created with
+ * tcp2_create_numa_thread_context.  The stack goes after the thread context,
+ * which allocated from it.
+ */
+void tcp2_destroy_numa_thread_context(
+    struct tcp2_thread_context *tcp2_thread_context,
+    struct tcp2_numa_thread_allocators *allocators) {
+  tcp2_destroy_thread_context(tcp2_thread_context);
+
+  tcp2_destroy_numa_thread_allocators(allocators);
+}
+
+
+
+/*
+ * The application pins each thread to a node before it creates its thread
+ * context.
+ */
+void app_on_thread_start() {
+  app_pin_thread_to_next_node();
+
+  struct tcp2_numa_thread_allocators *allocators =
+    app_get_thread_local_allocators();
+
+  struct tcp2_thread_context *tcp2_thread_context =
+    tcp2_create_numa_thread_context(tcp2_system_context, allocators);
+  if (!tcp2_thread_context) {
+    app_on_thread_start_failed();
+    return;
+  }
+
+  app_store_tcp2_thread_context(tcp2_thread_context);
+
+  app_execute_thread_loop();
+
+  tcp2_destroy_numa_thread_context(tcp2_thread_context, allocators);
+}
@@ -0,0 +1,898 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+/*
+ * This case study builds on the previous allocator case studies and
+ * demonstrates how allocators are compared with each other: by recording the
+ * allocation stream of a real workload and replaying it against any tcp2
+ * allocator.
+ *
+ * Microbenchmarks that allocate and free objects of one size in a loop favour
+ * whatever allocator keeps the hottest free list, and say nothing about the
+ * mix of type ids, sizes and lifetimes that tcp2 produces under real traffic.
+ * The trivial allocator of allocators_1.c, the slabs, magazines and pools of
+ * the later case studies and an application's own allocator such as
+ * app_custom_allocator should be judged on that mix instead.
+ *
+ * There are two parts:
+ * - The recording allocator wraps the allocator stack of a thread and writes
+ *   every alloc and free, with its type id and size, to a trace file.  It is
+ *   enabled in a production or staging process for a while, then removed.
+ * - The replay harness loads a trace, runs it against a set of allocators at
+ *   several thread counts and reports, for each combination:
+ *   - the mean cost of an operation in nanoseconds
+ *   - the resident set size of the process at the peak of live memory
+ *   - fragmentation: the growth of the resident set size over the live bytes
+ *     the trace holds at its peak
+ *
+ * The harness is a standalone program, main() below, linked against tcp2 and
+ * whichever application allocators are to be compared.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - Traces record object addresses, which are only meaningful within the
+ *   recorded process.  Loading a trace replaces them with dense object
+ *   indices, so that replay only needs an array lookup per free and no hash
+ *   table distorts the timings.
+ * - Each recorded thread is replayed on its own replay thread, with its own
+ *   allocator instance, as allocators are per thread.  Higher thread counts
+ *   replay the recorded threads several times over, side by side.
+ * - Frees made on a thread other than the allocating one are replayed on the
+ *   allocating thread, at the point in time they were recorded.  Replay
+ *   threads never wait for each other, which keeps the timings free of
+ *   synchronisation, at the cost of not measuring remote frees.  The remote
+ *   free wrapper of allocators_4.c is measured with its own benchmarks.
+ * - The recording allocator keeps its block of records without locking, so
+ *   it must only ever be called on its own thread.  Frees made on other
+ *   threads, such as of output buffers released by I/O threads, reach it
+ *   through the remote free allocator of allocators_4.c, which wraps it.
+ *   Those frees are recorded when the owning thread drains them, which is
+ *   also where the owning thread's allocator sees them.
+ * - The resident set size is process wide.  Replay threads meet at a barrier
+ *   at the peak of live memory, where it is sampled once.  Sampling is not
+ *   part of the timed operations.
+ * ----END DISCUSSION----
+ */
+
+
+
+#define TCP2_TRACE_MAGIC            0x5452434132504354ULL /* "TCP2ACRT" */
+#define TCP2_TRACE_VERSION          1
+
+/*
+ * Records are written in blocks, one write per block, so that the blocks of
+ * concurrently recording threads never interleave within a block.
+ */
+#define TCP2_TRACE_BLOCK_RECORDS    1024
+
+#define TCP2_TRACE_ALLOC            1
+#define TCP2_TRACE_FREE             2
+
+#define TCP2_REPLAY_MAX_THREADS     64
+
+
+
+/*
+ * One traced operation.
+ *
+ * object: the address of the object while recording, the dense index of the
+ *         object once the trace is loaded
+ * nanoseconds: the time of the operation since the recording started
+ */
+struct tcp2_trace_record {
+  uint32_t op;
+  uint32_t thread;
+  uint64_t type;
+  uint64_t size;
+  uint64_t object;
+  uint64_t nanoseconds;
+};
+
+struct tcp2_trace_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t record_size;
+};
+
+/*
+ * The shared state of a recording: the trace file, and the source of thread
+ * numbers and timestamps.
+ */
+struct tcp2_trace_recorder {
+  int fd;
+  _Atomic uint32_t next_thread;
+  struct timespec started;
+};
+
+/*
+ * Recording allocator, one per thread, wrapping the allocator stack of the
+ * thread.  Not thread safe, it must sit below a remote free allocator.
+ */
+struct tcp2_recording_allocator {
+  struct tcp2_allocator tcp2_allocator;
+
+  const struct tcp2_allocator *backing;
+
+  struct tcp2_trace_recorder *recorder;
+  uint32_t thread;
+
+  size_t record_count;
+  struct tcp2_trace_record records[TCP2_TRACE_BLOCK_RECORDS];
+};
+
+
+
+static inline uint64_t tcp2_trace_elapsed(const struct timespec *since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (uint64_t)(now.tv_sec - since->tv_sec) * 1000000000ULL +
+         (uint64_t)now.tv_nsec - (uint64_t)since->tv_nsec;
+}
+
+static void tcp2_recording_allocator_flush(
+    struct tcp2_recording_allocator *recording_allocator) {
+  if (recording_allocator->record_count == 0)
+    return;
+
+  /*
+   * Recording is a diagnostic mode, a failed write loses the block rather
+   * than failing the allocation.
+   */
+  write(recording_allocator->recorder->fd, recording_allocator->records,
+        recording_allocator->record_count * sizeof(struct tcp2_trace_record));
+
+  recording_allocator->record_count = 0;
+}
+
+static void tcp2_recording_allocator_record(
+    struct tcp2_recording_allocator *recording_allocator,
+    uint32_t op, uint64_t type, size_t size, void *obj) {
+  struct tcp2_trace_record *record =
+    &recording_allocator->records[recording_allocator->record_count++];
+
+  record->op = op;
+  record->thread = recording_allocator->thread;
+  record->type = type;
+  record->size = size;
+  record->object = (uint64_t)(uintptr_t)obj;
+  record->nanoseconds =
+    tcp2_trace_elapsed(&recording_allocator->recorder->started);
+
+  if (recording_allocator->record_count == TCP2_TRACE_BLOCK_RECORDS)
+    tcp2_recording_allocator_flush(recording_allocator);
+}
+
+
+
+/*
+ * The definitions of the recording alloc and free functions.  Failed
+ * allocations are not recorded, as they have no effect to replay.
+ */
+static void *tcp2_recording_alloc(const struct tcp2_allocator *allocator,
+                                  uint64_t type, size_t size) {
+  struct tcp2_recording_allocator *recording_allocator =
+    (struct tcp2_recording_allocator *)allocator;
+
+  void *obj = tcp2_allocator_alloc(recording_allocator->backing, type, size);
+  if (obj) {
+    tcp2_recording_allocator_record(recording_allocator, TCP2_TRACE_ALLOC,
+                                    type, size, obj);
+  }
+
+  return obj;
+}
+
+static void tcp2_recording_free(const struct tcp2_allocator *allocator,
+                                uint64_t type, size_t size, void *obj) {
+  struct tcp2_recording_allocator *recording_allocator =
+    (struct tcp2_recording_allocator *)allocator;
+
+  tcp2_recording_allocator_record(recording_allocator, TCP2_TRACE_FREE,
+                                  type, size, obj);
+
+  tcp2_allocator_free(recording_allocator->backing, type, size, obj);
+}
+
+
+
+static size_t tcp2_recording_trim(const struct tcp2_allocator *allocator,
+                                  size_t target) {
+  const struct tcp2_recording_allocator *recording_allocator =
+    (const struct tcp2_recording_allocator *)allocator;
+
+  return tcp2_allocator_trim(recording_allocator->backing, target);
+}
+
+
+
+/*
+ * The global operations structure to hold references to recording alloc and
+ * free.  Batches are left to the helper loops, so that every object is
+ * recorded individually.
+ */
+static struct tcp2_allocator_operations tcp2_recording_allocator_operations = {
+  .alloc = tcp2_recording_alloc,
+  .free = tcp2_recording_free,
+  .trim = tcp2_recording_trim,
+};
+
+
+
+/*
+ * Start a recording to a trace file, which is created or truncated.
+ *
+ * Returns:
+ * A new recorder, or NULL upon failure.
+ */
+struct tcp2_trace_recorder *tcp2_create_trace_recorder(const char *path) {
+  struct tcp2_trace_recorder *recorder =
+    malloc(sizeof(struct tcp2_trace_recorder));
+  if (!recorder)
+    return NULL;
+
+  recorder->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+  if (recorder->fd < 0) {
+    free(recorder);
+    return NULL;
+  }
+
+  struct tcp2_trace_header header = {
+    .magic = TCP2_TRACE_MAGIC,
+    .version = TCP2_TRACE_VERSION,
+    .record_size = sizeof(struct tcp2_trace_record),
+  };
+
+  if (write(recorder->fd, &header, sizeof(header)) != sizeof(header)) {
+    close(recorder->fd);
+    free(recorder);
+    return NULL;
+  }
+
+  atomic_init(&recorder->next_thread, 0);
+  clock_gettime(CLOCK_MONOTONIC, &recorder->started);
+
+  return recorder;
+}
+
+/*
+ * Stop a recording.  All recording allocators must have been destroyed.
+ */
+void tcp2_destroy_trace_recorder(struct tcp2_trace_recorder *recorder) {
+  close(recorder->fd);
+  free(recorder);
+}
+
+/*
+ * Create a recording allocator for the calling thread.
+ *
+ * Arguments:
+ * backing: the allocator stack that is recorded
+ *
+ * Returns:
+ * A new recording allocator, or NULL upon failure.
+ */
+struct tcp2_recording_allocator *tcp2_create_recording_allocator(
+    struct tcp2_trace_recorder *recorder,
+    const struct tcp2_allocator *backing) {
+  struct tcp2_recording_allocator *recording_allocator =
+    tcp2_allocator_alloc(backing, 0, sizeof(struct tcp2_recording_allocator));
+  if (!recording_allocator)
+    return NULL;
+
+  recording_allocator->tcp2_allocator.operations =
+    &tcp2_recording_allocator_operations;
+  recording_allocator->backing = backing;
+  recording_allocator->recorder = recorder;
+  recording_allocator->thread =
+    atomic_fetch_add_explicit(&recorder->next_thread, 1,
+                              memory_order_relaxed);
+  recording_allocator->record_count = 0;
+
+  return recording_allocator;
+}
+
+void tcp2_destroy_recording_allocator(
+    struct tcp2_recording_allocator *recording_allocator) {
+  const struct tcp2_allocator *backing = recording_allocator->backing;
+
+  tcp2_recording_allocator_flush(recording_allocator);
+
+  tcp2_allocator_free(backing, 0, sizeof(struct tcp2_recording_allocator),
+                      recording_allocator);
+}
+
+
+
+
+
+
+/*
+ * A loaded trace, with the records of each recorded thread in order and
+ * object addresses replaced with dense indices.
+ *
+ * peak_index: per thread, the number of records up to and including the
+ *             point where the live bytes of the whole trace peak
+ */
+struct tcp2_trace {
+  uint32_t thread_count;
+  uint64_t object_count;
+
+  struct tcp2_trace_thread {
+    struct tcp2_trace_record *records;
+    size_t record_count;
+    size_t peak_index;
+  } *threads;
+
+  uint64_t peak_live_bytes;
+};
+
+void tcp2_destroy_trace(struct tcp2_trace *trace) {
+  for (uint32_t thread = 0; thread < trace->thread_count; ++thread)
+    free(trace->threads[thread].records);
+
+  free(trace->threads);
+  free(trace);
+}
+
+/*
+ * Load a trace file.
+ *
+ * Records of different threads are ordered by their timestamps, and objects
+ * are numbered in allocation order.  An address that is freed and allocated
+ * again becomes a new object.  Frees of objects allocated before the
+ * recording started are dropped, objects still live at its end stay allocated
+ * until the replayed allocator is destroyed.
+ *
+ * Returns:
+ * A new trace, or NULL upon failure or if the trace holds no replayable
+ * records.
+ */
+struct tcp2_trace *tcp2_load_trace(const char *path) {
+  struct tcp2_trace_record *records;
+  size_t record_count;
+
+  if (tcp2_trace_read_records(path, TCP2_TRACE_MAGIC, TCP2_TRACE_VERSION,
+                              &records, &record_count) != 0)
+    return NULL;
+
+  tcp2_trace_sort_by_time(records, record_count);
+
+  struct tcp2_trace *trace = calloc(1, sizeof(struct tcp2_trace));
+  struct tcp2_trace_address_map *address_map =
+    tcp2_trace_create_address_map(record_count);
+
+  /*
+   * The allocating thread of every object, so that frees can be moved to it.
+   * There are never more objects than records.
+   */
+  uint32_t *object_threads = malloc(record_count * sizeof(uint32_t));
+
+  if (!trace || !address_map || !object_threads) {
+    free(object_threads);
+    if (address_map)
+      tcp2_trace_destroy_address_map(address_map);
+    free(trace);
+    free(records);
+    return NULL;
+  }
+
+  uint64_t live_bytes = 0;
+  size_t peak_record = 0;
+  size_t kept = 0;
+
+  for (size_t index = 0; index < record_count; ++index) {
+    struct tcp2_trace_record *record = &records[index];
+
+    if (record->op == TCP2_TRACE_ALLOC) {
+      tcp2_trace_address_map_insert(address_map, record->object,
+                                    trace->object_count);
+      object_threads[trace->object_count] = record->thread;
+      record->object = trace->object_count++;
+      live_bytes += record->size;
+    }
+    else
+    if (tcp2_trace_address_map_remove(address_map, record->object,
+                                      &record->object)) {
+      record->thread = object_threads[record->object];
+      live_bytes -= record->size;
+    }
+    else {
+      continue;
+    }
+
+    records[kept++] = *record;
+
+    if (live_bytes > trace->peak_live_bytes) {
+      trace->peak_live_bytes = live_bytes;
+      peak_record = kept;
+    }
+
+    if (record->thread >= trace->thread_count)
+      trace->thread_count = record->thread + 1;
+  }
+
+  free(object_threads);
+  tcp2_trace_destroy_address_map(address_map);
+
+  /*
+   * A trace without a single replayable record has nothing to compare
+   * allocators on.
+   */
+  if (trace->thread_count == 0) {
+    free(trace);
+    free(records);
+    return NULL;
+  }
+
+  /*
+   * Split the records per thread, and translate the global peak into a
+   * position within each thread.
+   */
+  trace->threads = calloc(trace->thread_count,
+                          sizeof(struct tcp2_trace_thread));
+  if (!trace->threads) {
+    free(trace);
+    free(records);
+    return NULL;
+  }
+
+  for (size_t index = 0; index < kept; ++index)
+    trace->threads[records[index].thread].record_count++;
+
+  for (uint32_t thread = 0; thread < trace->thread_count; ++thread) {
+    /*
+     * A recorded thread may have no replayable records left, its records
+     * stay NULL then.
+     */
+    if (trace->threads[thread].record_count > 0) {
+      trace->threads[thread].records =
+        malloc(trace->threads[thread].record_count *
+               sizeof(struct tcp2_trace_record));
+      if (!trace->threads[thread].records) {
+        tcp2_destroy_trace(trace);
+        free(records);
+        return NULL;
+      }
+    }
+    trace->threads[thread].record_count = 0;
+  }
+
+  for (size_t index = 0; index < kept; ++index) {
+    struct tcp2_trace_thread *thread = &trace->threads[records[index].thread];
+
+    thread->records[thread->record_count++] = records[index];
+    if (index < peak_record)
+      thread->peak_index = thread->record_count;
+  }
+
+  free(records);
+
+  return trace;
+}
+
+
+
+/*
+ * An allocator to replay against.  A fresh instance is created for each
+ * replay thread, on that thread, and create returns NULL upon failure.
+ */
+struct tcp2_replay_subject {
+  const char *name;
+
+  const struct tcp2_allocator *(*create)(void *user_data);
+  void (*destroy)(const struct tcp2_allocator *allocator, void *user_data);
+
+  void *user_data;
+};
+
+struct tcp2_replay_result {
+  uint64_t ops;
+  uint64_t nanoseconds;
+  double ns_per_op;
+
+  /*
+   * The resident set size at the peak, and its growth from before the
+   * replay started.
+   */
+  size_t peak_rss;
+  size_t rss_growth;
+
+  /*
+   * The live bytes of all replay threads at the peak.
+   */
+  uint64_t peak_live_bytes;
+
+  /*
+   * rss_growth / peak_live_bytes: 1.0 is a perfect fit, 2.0 means the
+   * allocator holds as much memory again as the live objects need.
+   */
+  double fragmentation;
+};
+
+/*
+ * The state shared by the replay threads of one run, and the state of each
+ * replay thread.
+ */
+struct tcp2_replay_run {
+  const struct tcp2_trace *trace;
+  const struct tcp2_replay_subject *subject;
+
+  struct tcp2_barrier peak_barrier;
+  struct tcp2_barrier resume_barrier;
+};
+
+struct tcp2_replay_thread {
+  struct tcp2_replay_run *run;
+  unsigned index;
+  uint64_t nanoseconds;
+  uint64_t ops;
+  int failed;
+};
+
+/*
+ * Replay one stretch of the records of a recorded thread.  Returns the time
+ * taken in nanoseconds.
+ */
+static uint64_t tcp2_replay_records(const struct tcp2_allocator *allocator,
+                                    void **objects,
+                                    const struct tcp2_trace_record *records,
+                                    size_t begin, size_t end) {
+  struct timespec started;
+  clock_gettime(CLOCK_MONOTONIC, &started);
+
+  for (size_t index = begin; index < end; ++index) {
+    const struct tcp2_trace_record *record = &records[index];
+
+    if (record->op == TCP2_TRACE_ALLOC) {
+      objects[record->object] =
+        tcp2_allocator_alloc(allocator, record->type, record->size);
+    }
+    else {
+      tcp2_allocator_free(allocator, record->type, record->size,
+                          objects[record->object]);
+    }
+  }
+
+  return tcp2_trace_elapsed(&started);
+}
+
+static void *tcp2_replay_thread_main(void *arg) {
+  struct tcp2_replay_thread *replay_thread = arg;
+  struct tcp2_replay_run *run = replay_thread->run;
+  const struct tcp2_trace *trace = run->trace;
+
+  /*
+   * Replay threads take the recorded threads in turn, so a thread count of
+   * twice the recorded one replays every recorded thread twice.
+   */
+  const struct tcp2_trace_thread *recorded =
+    &trace->threads[replay_thread->index % trace->thread_count];
+
+  void **objects = calloc(trace->object_count, sizeof(void *));
+
+  const struct tcp2_allocator *allocator = objects ?
+    run->subject->create(run->subject->user_data) : NULL;
+
+  /*
+   * A thread that cannot replay still meets the others at the peak, so that
+   * they are not left waiting, and fails the run.
+   */
+  if (!allocator) {
+    replay_thread->failed = 1;
+
+    tcp2_barrier_wait(&run->peak_barrier);
+    tcp2_barrier_wait(&run->resume_barrier);
+
+    free(objects);
+    return NULL;
+  }
+
+  replay_thread->nanoseconds =
+    tcp2_replay_records(allocator, objects, recorded->records,
+                        0, recorded->peak_index);
+
+  tcp2_barrier_wait(&run->peak_barrier);
+  tcp2_barrier_wait(&run->resume_barrier);
+
+  replay_thread->nanoseconds +=
+    tcp2_replay_records(allocator, objects, recorded->records,
+                        recorded->peak_index, recorded->record_count);
+  replay_thread->ops = recorded->record_count;
+
+  run->subject->destroy(allocator, run->subject->user_data);
+
+  free(objects);
+
+  return NULL;
+}
+
+/*
+ * Resident set size of the process, from /proc/self/statm.
+ */
+static size_t tcp2_replay_rss(void) {
+  unsigned long pages = 0;
+
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm) {
+    fscanf(statm, "%*lu %lu", &pages);
+    fclose(statm);
+  }
+
+  return (size_t)pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Replay a trace against an allocator.
+ *
+ * Arguments:
+ * thread_count: the number of replay threads, a multiple of the number of
+ *               recorded threads, at most TCP2_REPLAY_MAX_THREADS
+ *
+ * Returns:
+ * 0 on success, -1 on failure.
+ */
+int tcp2_replay_trace(const struct tcp2_trace *trace,
+                      const struct tcp2_replay_subject *subject,
+                      unsigned thread_count,
+                      struct tcp2_replay_result *result) {
+  if ((thread_count == 0) || (thread_count > TCP2_REPLAY_MAX_THREADS) ||
+      (thread_count % trace->thread_count != 0))
+    return -1;
+
+  struct tcp2_replay_run run = {
+    .trace = trace,
+    .subject = subject,
+  };
+  struct tcp2_replay_thread threads[TCP2_REPLAY_MAX_THREADS];
+  pthread_t handles[TCP2_REPLAY_MAX_THREADS];
+
+  /*
+   * The replay threads and this thread meet at the peak, once to sample the
+   * resident set size and once to let the replay threads resume.
+   */
+  tcp2_barrier_init(&run.peak_barrier, thread_count + 1);
+  tcp2_barrier_init(&run.resume_barrier, thread_count + 1);
+
+  size_t rss_before = tcp2_replay_rss();
+
+  for (unsigned index = 0; index < thread_count; ++index) {
+    threads[index] = (struct tcp2_replay_thread){
+      .run = &run,
+      .index = index,
+    };
+    pthread_create(&handles[index], NULL, tcp2_replay_thread_main,
+                   &threads[index]);
+  }
+
+  tcp2_barrier_wait(&run.peak_barrier);
+  result->peak_rss = tcp2_replay_rss();
+  tcp2_barrier_wait(&run.resume_barrier);
+
+  result->ops = 0;
+  result->nanoseconds = 0;
+
+  int failed = 0;
+
+  for (unsigned index = 0; index < thread_count; ++index) {
+    pthread_join(handles[index], NULL);
+
+    result->ops += threads[index].ops;
+    result->nanoseconds += threads[index].nanoseconds;
+    failed |= threads[index].failed;
+  }
+
+  tcp2_barrier_destroy(&run.peak_barrier);
+  tcp2_barrier_destroy(&run.resume_barrier);
+
+  if (failed)
+    return -1;
+
+  /*
+   * ns/op is the cost per operation as seen by one thread, so contention
+   * shows as a growing figure with the thread count.
+   */
+  result->ns_per_op = result->ops ?
+    (double)result->nanoseconds / (double)result->ops : 0;
+
+  result->rss_growth =
+    result->peak_rss > rss_before ? result->peak_rss - rss_before : 0;
+  result->peak_live_bytes =
+    trace->peak_live_bytes * (thread_count / trace->thread_count);
+  result->fragmentation = result->peak_live_bytes ?
+    (double)result->rss_growth / (double)result->peak_live_bytes : 0;
+
+  return 0;
+}
+
+
+
+
+
+
+/*
+ * The following shows the application recording a trace.  When the
+ * application is started with a trace path, each thread wraps its allocator
+ * stack in a recording allocator.
+ */
+void app_on_thread_start() {
+  struct tcp2_system_context *tcp2_system_context =
+    app_retrieve_tcp2_system_context();
+
+  const struct tcp2_allocator *allocator = tcp2_get_trivial_allocator();
+
+  struct tcp2_trace_recorder *recorder = app_get_trace_recorder();
+  struct tcp2_recording_allocator *recording_allocator = NULL;
+
+  if (recorder) {
+    recording_allocator =
+      tcp2_create_recording_allocator(recorder, allocator);
+    if (recording_allocator)
+      allocator = &recording_allocator->tcp2_allocator;
+  }
+
+  struct tcp2_thread_context *tcp2_thread_context =
+    tcp2_create_thread_context(tcp2_system_context, allocator);
+
+  /*
+   * Output buffers are freed on I/O threads, and the recording allocator
+   * must only be called on this thread.  Without the remote free allocator
+   * to route those frees back, the thread runs unrecorded.
+   */
+  if (recording_allocator &&
+      tcp2_thread_context_enable_remote_free(tcp2_thread_context) != 0) {
+    tcp2_destroy_thread_context(tcp2_thread_context);
+    tcp2_destroy_recording_allocator(recording_allocator);
+    recording_allocator = NULL;
+
+    tcp2_thread_context =
+      tcp2_create_thread_context(tcp2_system_context,
+                                 tcp2_get_trivial_allocator());
+  }
+
+  app_store_tcp2_thread_context(tcp2_thread_context);
+
+  app_execute_thread_loop();
+
+  tcp2_destroy_thread_context(tcp2_thread_context);
+
+  if (recording_allocator)
+    tcp2_destroy_recording_allocator(recording_allocator);
+}
+
+
+
+/*
+ * And the replay harness, comparing allocators on a trace at a range of
+ * thread counts:
+ *
+ *   tcp2_alloc_replay <trace file>
+ *
+ *   allocator             threads       ns/op    peak rss   frag
+ *   trivial                     4       41.20    183.4MiB   1.31
+ *   ...
+ */
+static const struct tcp2_allocator *replay_create_trivial(void *user_data) {
+  return tcp2_get_trivial_allocator();
+}
+
+static void replay_destroy_trivial(const struct tcp2_allocator *allocator,
+                                   void *user_data) {
+}
+
+static const struct tcp2_allocator *replay_create_slab(void *user_data) {
+  struct tcp2_slab_allocator *tcp2_slab_allocator =
+    tcp2_create_slab_allocator(tcp2_get_trivial_allocator());
+  if (!tcp2_slab_allocator)
+    return NULL;
+
+  tcp2_slab_allocator_register_tcp2_types(tcp2_slab_allocator);
+
+  return &tcp2_slab_allocator->tcp2_allocator;
+}
+
+static void replay_destroy_slab(const struct tcp2_allocator *allocator,
+                                void *user_data) {
+  tcp2_destroy_slab_allocator((struct tcp2_slab_allocator *)allocator);
+}
+
+static const struct tcp2_allocator *replay_create_custom(void *user_data) {
+  return &app_create_custom_allocator()->tcp2_allocator;
+}
+
+static void replay_destroy_custom(const struct tcp2_allocator *allocator,
+                                  void *user_data) {
+  app_destroy_custom_allocator((struct app_custom_allocator *)allocator);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+    return 1;
+  }
+
+  struct tcp2_trace *trace = tcp2_load_trace(argv[1]);
+  if (!trace) {
+    fprintf(stderr, "%s: cannot load trace\n", argv[1]);
+    return 1;
+  }
+
+  const struct tcp2_replay_subject subjects[] = {
+    { "trivial", replay_create_trivial, replay_destroy_trivial, NULL },
+    { "slab", replay_create_slab, replay_destroy_slab, NULL },
+    { "app_custom", replay_create_custom, replay_destroy_custom, NULL },
+  };
+
+  printf("%-20s %8s %11s %11s %6s\n",
+         "allocator", "threads", "ns/op", "peak rss", "frag");
+
+  for (size_t subject = 0;
+       subject < sizeof(subjects) / sizeof(subjects[0]);
+       ++subject) {
+    for (unsigned thread_count = trace->thread_count;
+         thread_count <= TCP2_REPLAY_MAX_THREADS;
+         thread_count *= 2) {
+      struct tcp2_replay_result result;
+
+      if (tcp2_replay_trace(trace, &subjects[subject], thread_count,
+                            &result) != 0)
+        continue;
+
+      printf("%-20s %8u %11.2f %8.1fMiB %6.2f\n",
+             subjects[subject].name, thread_count, result.ns_per_op,
+             (double)result.peak_rss / (1024 * 1024),
+             result.fragmentation);
+    }
+  }
+
+  tcp2_destroy_trace(trace);
+
+  return 0;
+}
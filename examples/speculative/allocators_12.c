@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+/*
+ * This case study builds on the previous allocator case studies and
+ * demonstrates how memory cached by the allocators is given back to the
+ * system once it is no longer needed.
+ *
+ * Every caching allocator in the earlier case studies keeps what it has
+ * grown to: magazines stay loaded, the depot keeps full magazines, slab
+ * caches keep their empty slabs, pools keep their committed regions and the
+ * NUMA allocator keeps its extents.  After a traffic peak that memory sits
+ * idle until the next peak, which for a daily pattern means many hours.
+ *
+ * Two pieces fix that:
+ * - The optional trim operation of tcp2_allocator_operations (allocators_1.c)
+ *   which each allocator implements for its own caches.  Caching allocators
+ *   hand their idle memory to the allocator beneath them and pass the request
+ *   on, allocators that obtain memory from the system return it.
+ * - A system context API to request a trim of every thread context.  As
+ *   allocators belong to their thread, the request is posted and each thread
+ *   acts on it at the start of its next tcp2_process call, in the same place
+ *   as the remote free queue is drained (allocators_4.c).  The depot, which
+ *   is shared and locked, is trimmed right away by the requesting thread.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - The target is a hint.  It is split evenly across the thread contexts
+ *   that exist when the request is made, as idle memory is usually spread
+ *   evenly too.  A target of 0 releases everything that is idle.
+ * - Allocators can only report what they return to the system themselves.
+ *   The trivial allocator passes memory to the C library, which does not say
+ *   how much of it reaches the system, so the reported totals are a lower
+ *   bound and the resident set size remains the measure of success.
+ * - A thread without traffic or timers does not call tcp2_process and so
+ *   never acts on a request.  Applications that want such threads trimmed
+ *   wake them, or call tcp2_thread_context_trim from those threads directly.
+ * - Checking for a request costs one relaxed load of a read mostly system
+ *   context field per tcp2_process call.
+ * - A trim is followed by refills as traffic returns.  It is meant for quiet
+ *   periods, not for every timer tick.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * The system context keeps the trim request: a generation that is bumped by
+ * every request, and the share of the target of each thread context.
+ */
+struct tcp2_system_context {
+  /*
+   * Other global state, see allocators_3.c.
+   */
+
+  struct tcp2_depot *depot;
+
+  _Atomic uint32_t thread_context_count;
+
+  _Atomic uint64_t trim_generation;
+  _Atomic size_t trim_share;
+
+  /*
+   * Bytes returned to the system by thread context trims so far.
+   */
+  _Atomic uint64_t trim_released;
+};
+
+/*
+ * The thread context, as shown in allocators_4.c, with the generation of the
+ * last trim request it acted on.
+ */
+struct tcp2_thread_context {
+  struct tcp2_system_context *system_context;
+
+  const struct tcp2_allocator *allocator;
+
+  struct tcp2_magazine_allocator *magazine_allocator;
+
+  struct tcp2_remote_free_allocator *remote_free_allocator;
+
+  uint64_t trim_generation;
+};
+
+
+
+/*
+ * Trim the allocator of a thread context.  Must be called on the thread of the
+ * thread context.
+ *
+ * Arguments:
+ * target: the number of bytes to return to the system, 0 for everything idle
+ *
+ * Returns:
+ * The number of bytes returned to the system, as far as the allocators can
+ * tell.
+ */
+size_t tcp2_thread_context_trim(
+    struct tcp2_thread_context *tcp2_thread_context, size_t target) {
+  if (tcp2_thread_context->remote_free_allocator) {
+    tcp2_remote_free_allocator_drain(
+      tcp2_thread_context->remote_free_allocator);
+  }
+
+  return tcp2_allocator_trim(tcp2_thread_context->allocator, target);
+}
+
+/*
+ * Request every thread context of a system context to trim its allocator.
+ * May be called from any thread.
+ *
+ * Arguments:
+ * target: the number of bytes to return to the system, 0 for everything idle
+ *
+ * Returns:
+ * The number of bytes returned to the system by trimming the depot, which
+ * happens before this function returns.  What the thread contexts return is
+ * added to tcp2_system_context_get_trim_released as they act on the request.
+ */
+size_t tcp2_system_context_trim(
+    struct tcp2_system_context *tcp2_system_context, size_t target) {
+  size_t released = tcp2_depot_trim(tcp2_system_context->depot, target);
+
+  if ((target != 0) && (released >= target))
+    return released;
+
+  uint32_t count =
+    atomic_load_explicit(&tcp2_system_context->thread_context_count,
+                         memory_order_relaxed);
+
+  size_t share = 0;
+  if ((target != 0) && (count != 0)) {
+    share = (target - released + count - 1) / count;
+  }
+
+  /*
+   * The release ordering publishes the share together with the generation.
+   */
+  atomic_store_explicit(&tcp2_system_context->trim_share, share,
+                        memory_order_relaxed);
+  atomic_fetch_add_explicit(&tcp2_system_context->trim_generation, 1,
+                            memory_order_release);
+
+  return released;
+}
+
+uint64_t tcp2_system_context_get_trim_released(
+    struct tcp2_system_context *tcp2_system_context) {
+  return atomic_load_explicit(&tcp2_system_context->trim_released,
+                              memory_order_relaxed);
+}
+
+
+
+/*
+ * Thread contexts count themselves in the system context, and start out with
+ * the current generation so that requests made before they existed are not
+ * acted on.
+ */
+struct tcp2_thread_context *tcp2_create_thread_context(
+    struct tcp2_system_context *tcp2_system_context,
+    const struct tcp2_allocator *allocator) {
+  /*
+   * Allocator set up as in allocators_3.c.
+   */
+
+  tcp2_thread_context->trim_generation =
+    atomic_load_explicit(&tcp2_system_context->trim_generation,
+                         memory_order_acquire);
+
+  atomic_fetch_add_explicit(&tcp2_system_context->thread_context_count, 1,
+                            memory_order_relaxed);
+
+  return tcp2_thread_context;
+}
+
+void tcp2_destroy_thread_context(
+    struct tcp2_thread_context *tcp2_thread_context) {
+  atomic_fetch_sub_explicit(
+    &tcp2_thread_context->system_context->thread_context_count, 1,
+    memory_order_relaxed);
+
+  /*
+   * Allocator torn down as in allocators_3.c.
+   */
+}
+
+/*
+ * The beginning of tcp2_process, as in allocators_4.c, now also acting on
+ * trim requests.
+ */
+void tcp2_process(struct tcp2_context *tcp2_context,
+                  struct tcp2_events *tcp2_events) {
+  struct tcp2_thread_context *tcp2_thread_context =
+    tcp2_context->thread_context;
+  struct tcp2_system_context *tcp2_system_context =
+    tcp2_thread_context->system_context;
+
+  if (tcp2_thread_context->remote_free_allocator) {
+    tcp2_remote_free_allocator_drain(
+      tcp2_thread_context->remote_free_allocator);
+  }
+
+  if (atomic_load_explicit(&tcp2_system_context->trim_generation,
+                           memory_order_relaxed) !=
+      tcp2_thread_context->trim_generation) {
+    tcp2_thread_context->trim_generation =
+      atomic_load_explicit(&tcp2_system_context->trim_generation,
+                           memory_order_acquire);
+
+    /*
+     * Through tcp2_thread_context_trim, so that whatever a thread context
+     * holds on top of its allocator, such as the buffer pool of
+     * buffers_1.c, is released as well.
+     */
+    size_t released =
+      tcp2_thread_context_trim(tcp2_thread_context,
+                               atomic_load_explicit(
+                                 &tcp2_system_context->trim_share,
+                                 memory_order_relaxed));
+
+    atomic_fetch_add_explicit(&tcp2_system_context->trim_released, released,
+                              memory_order_relaxed);
+  }
+
+  /*
+   * Process events.
+   */
+}
+
+
+
+
+
+
+/*
+ * Finally, the application side.  Once traffic has dropped below a low water
+ * mark for a while, the application asks tcp2 to give back most of what it
+ * holds, and logs how much the next report interval shows was returned.
+ */
+void app_on_load_timer(struct app_context *app_context) {
+  struct tcp2_system_context *tcp2_system_context =
+    app_retrieve_tcp2_system_context();
+
+  if (app_get_load(app_context) > APP_LOW_WATER_LOAD) {
+    app_context->quiet_intervals = 0;
+    return;
+  }
+
+  if (++app_context->quiet_intervals != APP_QUIET_INTERVALS_BEFORE_TRIM)
+    return;
+
+  uint64_t before = tcp2_system_context_get_trim_released(tcp2_system_context);
+
+  size_t released = tcp2_system_context_trim(tcp2_system_context, 0);
+
+  app_log_info("tcp2 trim: %zu bytes from the depot, %llu bytes from threads "
+               "since the previous trim",
+               released,
+               (unsigned long long)(before - app_context->trim_released));
+
+  app_context->trim_released = before;
+
+  /*
+   * Idle worker threads have nothing to process, wake them so the request
+   * is acted on now rather than at their next timer.
+   */
+  app_wake_worker_threads(app_context);
+}
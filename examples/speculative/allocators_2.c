@@ -0,0 +1,628 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+
+/*
+ * This case study builds on allocators_1.c and demonstrates a slab allocator
+ * that is shipped with tcp2 and that makes use of the unique type ids passed
+ * to the alloc and free operations.
+ *
+ * tcp2 will allocate and free a small number of known data types at a very
+ * high rate: connections, streams, sent packet records, ack ranges and timer
+ * nodes.  Passing every one of these through malloc makes the system allocator
+ * one of the most expensive parts of connection churn, even though the size
+ * of every one of these objects is known in advance.
+ *
+ * The slab allocator keeps one cache per registered type id.  Each cache holds
+ * a number of fixed size slabs, which are carved into equally sized objects.
+ * Allocating an object is then a matter of popping it from the free list of a
+ * slab, and freeing it pushes it back.  Slab memory itself, and any request
+ * for a type id that has not been registered, is passed on to a backing
+ * allocator, which by default is the trivial allocator.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - A slab allocator is not thread safe.  Like the application custom
+ *   allocator in allocators_1.c, one is expected to be created per thread and
+ *   supplied to tcp2_create_thread_context.  All objects allocated through it
+ *   are expected to be freed on the same thread.  Sharing and returning
+ *   objects between threads are topics for other case studies.
+ * - Slabs are TCP2_SLAB_SIZE bytes and are aligned to TCP2_SLAB_SIZE, which
+ *   allows the slab owning an object to be found by masking the address of the
+ *   object, without any per object header.  To make this possible, backing
+ *   allocators are required to return TCP2_SLAB_SIZE aligned memory when asked
+ *   for the type id TCP2_TYPE_SLAB.  The trivial allocator does this using
+ *   aligned_alloc.
+ * - Alloc and free operations receive a const allocator, yet a slab allocator
+ *   needs to modify its caches.  The const is cast away here, the allocator
+ *   structure is owned by the thread using it.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * Type ids, such as TCP2_TYPE_SLAB, are defined in the type registry, see
+ * allocators_8.c.
+ */
+
+/*
+ * Size and alignment of a single slab.
+ */
+#define TCP2_SLAB_SIZE          (64 * 1024)
+
+/*
+ * Type ids at or above this value are never cached by the slab allocator,
+ * they are passed on to the backing allocator.
+ */
+#define TCP2_SLAB_MAX_TYPES     64
+
+/*
+ * The number of completely empty slabs that a cache may keep around before
+ * returning them to the backing allocator.  Keeping a few empty slabs avoids
+ * allocating and freeing a slab whenever a single object bounces across a
+ * slab boundary.
+ */
+#define TCP2_SLAB_MAX_EMPTY     2
+
+/*
+ * All objects are aligned to at least this, and to the alignment of their
+ * type where that is larger.
+ */
+#define TCP2_SLAB_ALIGN         16
+
+
+
+struct tcp2_slab;
+
+/*
+ * Slab cache.
+ *
+ * One cache exists per registered type id.  Its slabs are kept in one of
+ * three lists, depending on how many of their objects are in use:
+ * - partial: some objects are in use, allocations are served from here first
+ * - full: all objects are in use
+ * - empty: no objects are in use, kept for reuse up to TCP2_SLAB_MAX_EMPTY
+ *
+ * A cache with an object_size of zero is not registered.
+ */
+struct tcp2_slab_cache {
+  uint64_t type;
+  size_t object_size;
+  size_t first_object_offset;
+  uint32_t objects_per_slab;
+
+  struct tcp2_slab *partial;
+  struct tcp2_slab *full;
+  struct tcp2_slab *empty;
+  uint32_t empty_count;
+};
+
+/*
+ * Slab.
+ *
+ * The slab header lives at the start of every slab, objects follow it from
+ * first_object_offset onwards.  Objects are carved lazily: 'carved' counts
+ * how many objects have ever been handed out of the slab, so that creating a
+ * slab does not touch every one of its pages.  Freed objects are kept on the
+ * free list, which is threaded through the objects themselves.
+ */
+struct tcp2_slab {
+  struct tcp2_slab_cache *cache;
+  struct tcp2_slab *prev;
+  struct tcp2_slab *next;
+  void *free_list;
+  uint32_t in_use;
+  uint32_t carved;
+};
+
+/*
+ * Slab allocator.
+ *
+ * As described in allocators_1.c, the tcp2 allocator is the first member so
+ * that the slab allocator can be supplied anywhere a tcp2 allocator is
+ * expected.
+ */
+struct tcp2_slab_allocator {
+  struct tcp2_allocator tcp2_allocator;
+
+  const struct tcp2_allocator *backing;
+
+  struct tcp2_slab_cache caches[TCP2_SLAB_MAX_TYPES];
+};
+
+
+
+/*
+ * Doubly linked list helpers for the slab lists of a cache.
+ */
+static void tcp2_slab_list_push(struct tcp2_slab **list,
+                                struct tcp2_slab *slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list)
+    (*list)->prev = slab;
+  *list = slab;
+}
+
+static void tcp2_slab_list_remove(struct tcp2_slab **list,
+                                  struct tcp2_slab *slab) {
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+
+  if (slab->next)
+    slab->next->prev = slab->prev;
+
+  slab->prev = NULL;
+  slab->next = NULL;
+}
+
+
+
+/*
+ * Create and destroy single slabs, using the backing allocator.
+ */
+static struct tcp2_slab *tcp2_slab_create(
+    struct tcp2_slab_allocator *slab_allocator,
+    struct tcp2_slab_cache *cache) {
+  struct tcp2_slab *slab =
+    tcp2_allocator_alloc(slab_allocator->backing,
+                         TCP2_TYPE_SLAB, TCP2_SLAB_SIZE);
+  if (!slab)
+    return NULL;
+
+  slab->cache = cache;
+  slab->prev = NULL;
+  slab->next = NULL;
+  slab->free_list = NULL;
+  slab->in_use = 0;
+  slab->carved = 0;
+
+  return slab;
+}
+
+static void tcp2_slab_destroy(struct tcp2_slab_allocator *slab_allocator,
+                              struct tcp2_slab *slab) {
+  tcp2_allocator_free(slab_allocator->backing,
+                      TCP2_TYPE_SLAB, TCP2_SLAB_SIZE, slab);
+}
+
+static void tcp2_slab_destroy_list(struct tcp2_slab_allocator *slab_allocator,
+                                   struct tcp2_slab *list) {
+  while (list) {
+    struct tcp2_slab *next = list->next;
+    tcp2_slab_destroy(slab_allocator, list);
+    list = next;
+  }
+}
+
+
+
+/*
+ * Take one object from, and return one object to, a slab cache.  These are
+ * shared by the single object and the batch operations.
+ */
+static void *tcp2_slab_cache_alloc(struct tcp2_slab_allocator *slab_allocator,
+                                   struct tcp2_slab_cache *cache) {
+  struct tcp2_slab *slab = cache->partial;
+  if (!slab) {
+    slab = cache->empty;
+    if (slab) {
+      tcp2_slab_list_remove(&cache->empty, slab);
+      cache->empty_count--;
+    }
+    else {
+      slab = tcp2_slab_create(slab_allocator, cache);
+      if (!slab)
+        return NULL;
+    }
+
+    tcp2_slab_list_push(&cache->partial, slab);
+  }
+
+  void *obj;
+  if (slab->free_list) {
+    obj = slab->free_list;
+    slab->free_list = *(void **)obj;
+  }
+  else {
+    obj = (char *)slab + cache->first_object_offset +
+          (size_t)slab->carved * cache->object_size;
+    slab->carved++;
+  }
+
+  slab->in_use++;
+  if (slab->in_use == cache->objects_per_slab) {
+    tcp2_slab_list_remove(&cache->partial, slab);
+    tcp2_slab_list_push(&cache->full, slab);
+  }
+
+  return obj;
+}
+
+static void tcp2_slab_cache_free(struct tcp2_slab_allocator *slab_allocator,
+                                 struct tcp2_slab_cache *cache, void *obj) {
+  /*
+   * Slabs are aligned to their size, so the owning slab is found by masking.
+   */
+  struct tcp2_slab *slab =
+    (struct tcp2_slab *)((uintptr_t)obj & ~(uintptr_t)(TCP2_SLAB_SIZE - 1));
+
+  if (slab->in_use == cache->objects_per_slab) {
+    tcp2_slab_list_remove(&cache->full, slab);
+    tcp2_slab_list_push(&cache->partial, slab);
+  }
+
+  *(void **)obj = slab->free_list;
+  slab->free_list = obj;
+  slab->in_use--;
+
+  if (slab->in_use == 0) {
+    tcp2_slab_list_remove(&cache->partial, slab);
+
+    if (cache->empty_count < TCP2_SLAB_MAX_EMPTY) {
+      tcp2_slab_list_push(&cache->empty, slab);
+      cache->empty_count++;
+    }
+    else {
+      tcp2_slab_destroy(slab_allocator, slab);
+    }
+  }
+}
+
+
+
+/*
+ * The definitions of the slab alloc and free functions.
+ *
+ * A request is served from a slab cache only when the type id has been
+ * registered and the requested size fits the objects of that cache.
+ * Unregistered caches have an object_size of zero, so a single comparison
+ * covers both cases, as well as type id 0.
+ */
+static void *tcp2_slab_alloc(const struct tcp2_allocator *allocator,
+                             uint64_t type, size_t size) {
+  struct tcp2_slab_allocator *slab_allocator =
+    (struct tcp2_slab_allocator *)allocator;
+
+  if ((type >= TCP2_SLAB_MAX_TYPES) ||
+      (slab_allocator->caches[type].object_size < size)) {
+    return tcp2_allocator_alloc(slab_allocator->backing, type, size);
+  }
+
+  void *obj = tcp2_slab_cache_alloc(slab_allocator,
+                                    &slab_allocator->caches[type]);
+  if (!obj)
+    return NULL;
+
+  /*
+   * Keep the same contract as the trivial allocator, see allocators_8.c.
+   */
+  if (tcp2_type_zero_policy(type) & TCP2_ZERO_ON_ALLOC)
+    memset(obj, 0, size);
+
+  return obj;
+}
+
+static void tcp2_slab_free(const struct tcp2_allocator *allocator,
+                           uint64_t type, size_t size, void *obj) {
+  struct tcp2_slab_allocator *slab_allocator =
+    (struct tcp2_slab_allocator *)allocator;
+
+  if ((type >= TCP2_SLAB_MAX_TYPES) ||
+      (slab_allocator->caches[type].object_size < size)) {
+    tcp2_allocator_free(slab_allocator->backing, type, size, obj);
+    return;
+  }
+
+  /*
+   * Objects are recycled to other users of the type, so secrets are wiped
+   * here.  Uncached requests are zeroed by the backing allocator.
+   */
+  if (tcp2_type_zero_policy(type) & TCP2_ZERO_ON_FREE)
+    tcp2_secure_zero(obj, size);
+
+  tcp2_slab_cache_free(slab_allocator, &slab_allocator->caches[type], obj);
+}
+
+/*
+ * The batch operations check the type id once for the whole batch.
+ */
+static size_t tcp2_slab_alloc_batch(const struct tcp2_allocator *allocator,
+                                    uint64_t type, size_t size,
+                                    size_t count, void **objs) {
+  struct tcp2_slab_allocator *slab_allocator =
+    (struct tcp2_slab_allocator *)allocator;
+
+  if ((type >= TCP2_SLAB_MAX_TYPES) ||
+      (slab_allocator->caches[type].object_size < size)) {
+    return tcp2_allocator_alloc_batch(slab_allocator->backing,
+                                      type, size, count, objs);
+  }
+
+  struct tcp2_slab_cache *cache = &slab_allocator->caches[type];
+  int zero = tcp2_type_zero_policy(type) & TCP2_ZERO_ON_ALLOC;
+
+  size_t index;
+  for (index = 0; index < count; ++index) {
+    objs[index] = tcp2_slab_cache_alloc(slab_allocator, cache);
+    if (!objs[index])
+      break;
+
+    if (zero)
+      memset(objs[index], 0, size);
+  }
+
+  return index;
+}
+
+static void tcp2_slab_free_batch(const struct tcp2_allocator *allocator,
+                                 uint64_t type, size_t size,
+                                 size_t count, void **objs) {
+  struct tcp2_slab_allocator *slab_allocator =
+    (struct tcp2_slab_allocator *)allocator;
+
+  if ((type >= TCP2_SLAB_MAX_TYPES) ||
+      (slab_allocator->caches[type].object_size < size)) {
+    tcp2_allocator_free_batch(slab_allocator->backing,
+                              type, size, count, objs);
+    return;
+  }
+
+  struct tcp2_slab_cache *cache = &slab_allocator->caches[type];
+  int zero = tcp2_type_zero_policy(type) & TCP2_ZERO_ON_FREE;
+
+  for (size_t index = 0; index < count; ++index) {
+    if (zero)
+      tcp2_secure_zero(objs[index], size);
+
+    tcp2_slab_cache_free(slab_allocator, cache, objs[index]);
+  }
+}
+
+/*
+ * Return the empty slabs kept by every cache to the backing allocator, then
+ * pass the request on.  Partial slabs stay, as do the empty slabs of caches
+ * that refill right after a trim, which is the price of a trim.
+ */
+static size_t tcp2_slab_trim(const struct tcp2_allocator *allocator,
+                             size_t target) {
+  struct tcp2_slab_allocator *slab_allocator =
+    (struct tcp2_slab_allocator *)allocator;
+
+  for (uint64_t type = 0; type < TCP2_SLAB_MAX_TYPES; ++type) {
+    struct tcp2_slab_cache *cache = &slab_allocator->caches[type];
+
+    tcp2_slab_destroy_list(slab_allocator, cache->empty);
+    cache->empty = NULL;
+    cache->empty_count = 0;
+  }
+
+  return tcp2_allocator_trim(slab_allocator->backing, target);
+}
+
+
+
+/*
+ * The global operations structure to hold references to slab alloc and free.
+ */
+static struct tcp2_allocator_operations tcp2_slab_allocator_operations = {
+  .alloc = tcp2_slab_alloc,
+  .free = tcp2_slab_free,
+  .alloc_batch = tcp2_slab_alloc_batch,
+  .free_batch = tcp2_slab_free_batch,
+  .trim = tcp2_slab_trim,
+};
+
+
+
+/*
+ * Create a slab allocator.  As with the custom allocator in allocators_1.c,
+ * multiple slab allocators may exist, typically one per thread.
+ *
+ * Arguments:
+ * backing: the allocator used for slab memory and for all requests that the
+ *          slab allocator does not serve itself.  It must honour the
+ *          alignment requirement of TCP2_TYPE_SLAB.
+ *
+ * Returns:
+ * A new slab allocator without any registered types, or NULL upon failure.
+ */
+struct tcp2_slab_allocator *tcp2_create_slab_allocator(
+    const struct tcp2_allocator *backing) {
+  struct tcp2_slab_allocator *slab_allocator =
+    tcp2_allocator_alloc(backing, 0, sizeof(struct tcp2_slab_allocator));
+  if (!slab_allocator)
+    return NULL;
+
+  memset(slab_allocator, 0, sizeof(struct tcp2_slab_allocator));
+
+  slab_allocator->tcp2_allocator.operations = &tcp2_slab_allocator_operations;
+  slab_allocator->backing = backing;
+
+  return slab_allocator;
+}
+
+/*
+ * Register a type id with a slab allocator, creating its slab cache.
+ *
+ * Arguments:
+ * slab_allocator: the slab allocator
+ *
+ * type: the type id, greater than zero and below TCP2_SLAB_MAX_TYPES
+ *
+ * size: the size of every object of this type
+ *
+ * align: the alignment of every object of this type, a power of two, or 0
+ *        for TCP2_SLAB_ALIGN
+ *
+ * Returns:
+ * 0 on success, -1 if the type id cannot be cached, either because it is out
+ * of range, already registered, because its alignment is not a power of two
+ * or because its objects are too large to be carved from a slab without
+ * excessive waste.  Objects of a type that could
+ * not be registered are still allocated, by the backing allocator.
+ */
+int tcp2_slab_allocator_register_type(
+    struct tcp2_slab_allocator *slab_allocator,
+    uint64_t type, size_t size, size_t align) {
+  if ((type == 0) || (type >= TCP2_SLAB_MAX_TYPES))
+    return -1;
+
+  if (align < TCP2_SLAB_ALIGN)
+    align = TCP2_SLAB_ALIGN;
+
+  if ((align & (align - 1)) || (align >= TCP2_SLAB_SIZE))
+    return -1;
+
+  struct tcp2_slab_cache *cache = &slab_allocator->caches[type];
+  if (cache->object_size != 0)
+    return -1;
+
+  /*
+   * Slabs are aligned to their size, so objects at multiples of the
+   * alignment from the slab are aligned in memory.
+   */
+  size_t object_size = (size + align - 1) & ~(align - 1);
+  if (object_size < sizeof(void *))
+    object_size = sizeof(void *);
+
+  size_t first_object_offset =
+    (sizeof(struct tcp2_slab) + align - 1) & ~(align - 1);
+
+  /*
+   * Require at least eight objects per slab, anything larger is better served
+   * by the backing allocator.
+   */
+  size_t objects_per_slab =
+    (TCP2_SLAB_SIZE - first_object_offset) / object_size;
+  if (objects_per_slab < 8)
+    return -1;
+
+  cache->type = type;
+  cache->object_size = object_size;
+  cache->first_object_offset = first_object_offset;
+  cache->objects_per_slab = (uint32_t)objects_per_slab;
+
+  return 0;
+}
+
+/*
+ * Register every fixed size type of the type registry (allocators_8.c).  Types
+ * too large to be carved from a slab are skipped and left to the backing
+ * allocator.
+ *
+ * Returns:
+ * The number of types registered.
+ */
+int tcp2_slab_allocator_register_tcp2_types(
+    struct tcp2_slab_allocator *slab_allocator) {
+  int registered = 0;
+
+  for (uint64_t type = 1; type < TCP2_TYPE_REGISTRY_SIZE; ++type) {
+    const struct tcp2_type_info *info = tcp2_type_get_info(type);
+    if (info->size == 0)
+      continue;
+
+    if (tcp2_slab_allocator_register_type(slab_allocator, type,
+                                          info->size, info->align) == 0)
+      registered++;
+  }
+
+  return registered;
+}
+
+/*
+ * Slab allocator destructor.  All slabs are returned to the backing allocator
+ * regardless of whether objects are still in use, so all users of the slab
+ * allocator must be gone by now.
+ */
+void tcp2_destroy_slab_allocator(struct tcp2_slab_allocator *slab_allocator) {
+  for (uint64_t type = 0; type < TCP2_SLAB_MAX_TYPES; ++type) {
+    struct tcp2_slab_cache *cache = &slab_allocator->caches[type];
+
+    tcp2_slab_destroy_list(slab_allocator, cache->partial);
+    tcp2_slab_destroy_list(slab_allocator, cache->full);
+    tcp2_slab_destroy_list(slab_allocator, cache->empty);
+  }
+
+  tcp2_allocator_free(slab_allocator->backing,
+                      0, sizeof(struct tcp2_slab_allocator), slab_allocator);
+}
+
+
+
+
+
+
+/*
+ * Finally, a demonstration of a thread using a slab allocator, backed by the
+ * trivial allocator.
+ */
+void app_on_thread_start() {
+  struct tcp2_slab_allocator *tcp2_slab_allocator =
+    tcp2_create_slab_allocator(tcp2_get_trivial_allocator());
+
+  tcp2_slab_allocator_register_tcp2_types(tcp2_slab_allocator);
+
+  struct tcp2_thread_context *tcp2_thread_context =
+    tcp2_create_thread_context(tcp2_system_context,
+                               &tcp2_slab_allocator->tcp2_allocator);
+
+  app_store_tcp2_thread_context(tcp2_thread_context);
+
+  app_execute_thread_loop();
+
+  tcp2_destroy_thread_context(tcp2_thread_context);
+
+  tcp2_destroy_slab_allocator(tcp2_slab_allocator);
+}
@@ -0,0 +1,870 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+
+/*
+ * This case study builds on allocators_1.c and allocators_2.c and demonstrates
+ * a per-thread caching layer that can be placed in front of any tcp2
+ * allocator.
+ *
+ * init_1.c proposes that a tcp2_thread_context holds pre-allocated memory
+ * blocks that can be retrieved and returned without locking.  The layer shown
+ * here follows the magazine and depot design described by Bonwick and Adams
+ * for the Solaris kernel memory allocator:
+ * - A magazine is a small array of pointers to free objects of one type id,
+ *   the pointers are called rounds
+ * - Every thread holds two magazines per type id: 'loaded' and 'previous'.
+ *   Objects are allocated by popping rounds off the loaded magazine and freed
+ *   by pushing rounds onto it.  When the loaded magazine runs empty or full,
+ *   it is swapped with the previous magazine
+ * - Only when both magazines are empty (on alloc) or both are full (on free)
+ *   does the thread visit the depot, a structure shared by all threads that
+ *   holds lists of full and empty magazines, and this is the only place where
+ *   a lock is taken
+ * - The depot, and nothing else, calls the allocator that it wraps
+ *
+ * With two magazines, a thread can always perform at least a magazine worth
+ * of allocations or frees before visiting the depot, regardless of how the
+ * two are interleaved.  Most alloc and free pairs on the packet path will
+ * therefore only touch thread local memory.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - The wrapped (backing) allocator is only ever called with the depot lock
+ *   held, so it needs not be thread safe.  A single slab allocator from
+ *   allocators_2.c can back the depot shared by all threads.
+ * - Type ids are registered with the depot before any magazine allocators are
+ *   created from it, so that the per-thread caches can be set up once.  Type
+ *   id 0, dynamically sized memory and unregistered type ids are passed
+ *   straight through to the backing allocator, under the depot lock.
+ * - Objects are freed on the same thread that allocated them or on any other
+ *   thread using the same depot; a round does not remember which thread it
+ *   came from.  Keeping memory local to a thread when it is freed elsewhere
+ *   is the topic of another case study.
+ * - The magazine size is fixed here.  Bonwick's design grows the magazine
+ *   size of a type when its depot lock is contended, which is a possible
+ *   later refinement.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * Type ids, such as TCP2_TYPE_MAGAZINE, are defined in the type registry, see
+ * allocators_8.c.
+ */
+
+/*
+ * The number of rounds in a magazine.
+ */
+#define TCP2_MAGAZINE_ROUNDS        32
+
+/*
+ * Type ids at or above this value are never cached in magazines.
+ */
+#define TCP2_DEPOT_MAX_TYPES        64
+
+
+
+/*
+ * Magazine.
+ *
+ * The next member is only used while the magazine sits in one of the depot
+ * lists.
+ */
+struct tcp2_magazine {
+  struct tcp2_magazine *next;
+  uint32_t rounds;
+  void *objs[TCP2_MAGAZINE_ROUNDS];
+};
+
+/*
+ * The depot lists of a single type id.  A type id with an object_size of zero
+ * is not registered.
+ */
+struct tcp2_depot_type {
+  size_t object_size;
+
+  struct tcp2_magazine *full;
+  struct tcp2_magazine *empty;
+};
+
+/*
+ * Depot.
+ *
+ * Shared between all threads.  Every member is protected by the lock.
+ */
+struct tcp2_depot {
+  const struct tcp2_allocator *backing;
+
+  struct tcp2_mutex lock;
+
+  struct tcp2_depot_type types[TCP2_DEPOT_MAX_TYPES];
+};
+
+/*
+ * The magazines a thread holds for a single type id.  The object size is
+ * copied from the depot so that the fast path does not touch shared memory.
+ */
+struct tcp2_magazine_cache {
+  size_t object_size;
+
+  struct tcp2_magazine *loaded;
+  struct tcp2_magazine *previous;
+};
+
+/*
+ * Magazine allocator.
+ *
+ * The per-thread half of the magazine layer.  One is created per thread, from
+ * the depot shared by all threads, and used as the allocator of that thread.
+ */
+struct tcp2_magazine_allocator {
+  struct tcp2_allocator tcp2_allocator;
+
+  struct tcp2_depot *depot;
+
+  struct tcp2_magazine_cache caches[TCP2_DEPOT_MAX_TYPES];
+};
+
+
+
+/*
+ * Depot helpers, all of these must be called with the depot lock held.
+ */
+static struct tcp2_magazine *tcp2_depot_pop(struct tcp2_magazine **list) {
+  struct tcp2_magazine *magazine = *list;
+  if (magazine)
+    *list = magazine->next;
+
+  return magazine;
+}
+
+static void tcp2_depot_push(struct tcp2_magazine **list,
+                            struct tcp2_magazine *magazine) {
+  magazine->next = *list;
+  *list = magazine;
+}
+
+static struct tcp2_magazine *tcp2_depot_new_magazine(
+    struct tcp2_depot *depot) {
+  struct tcp2_magazine *magazine =
+    tcp2_allocator_alloc(depot->backing,
+                         TCP2_TYPE_MAGAZINE, sizeof(struct tcp2_magazine));
+  if (!magazine)
+    return NULL;
+
+  magazine->next = NULL;
+  magazine->rounds = 0;
+
+  return magazine;
+}
+
+/*
+ * Return every round of a magazine to the backing allocator, then the
+ * magazine itself.
+ */
+static void tcp2_depot_destroy_magazine(struct tcp2_depot *depot,
+                                        uint64_t type,
+                                        struct tcp2_magazine *magazine) {
+  size_t object_size = depot->types[type].object_size;
+
+  while (magazine->rounds > 0) {
+    tcp2_allocator_free(depot->backing, type, object_size,
+                        magazine->objs[--magazine->rounds]);
+  }
+
+  tcp2_allocator_free(depot->backing,
+                      TCP2_TYPE_MAGAZINE, sizeof(struct tcp2_magazine),
+                      magazine);
+}
+
+
+
+/*
+ * The slow paths, taken when both magazines of a thread are exhausted.
+ */
+static void *tcp2_magazine_alloc_slow(
+    struct tcp2_magazine_allocator *magazine_allocator,
+    struct tcp2_magazine_cache *cache,
+    uint64_t type, size_t size) {
+  struct tcp2_depot *depot = magazine_allocator->depot;
+  void *obj;
+
+  tcp2_mutex_lock(&depot->lock);
+
+  struct tcp2_magazine *full = tcp2_depot_pop(&depot->types[type].full);
+  if (full) {
+    /*
+     * Both magazines are empty: give the previous one back to the depot and
+     * load the full one.
+     */
+    tcp2_depot_push(&depot->types[type].empty, cache->previous);
+    cache->previous = cache->loaded;
+    cache->loaded = full;
+
+    obj = full->objs[--full->rounds];
+  }
+  else {
+    obj = tcp2_allocator_alloc(depot->backing, type, cache->object_size);
+  }
+
+  tcp2_mutex_unlock(&depot->lock);
+
+  return obj;
+}
+
+static void tcp2_magazine_free_slow(
+    struct tcp2_magazine_allocator *magazine_allocator,
+    struct tcp2_magazine_cache *cache,
+    uint64_t type, size_t size, void *obj) {
+  struct tcp2_depot *depot = magazine_allocator->depot;
+
+  tcp2_mutex_lock(&depot->lock);
+
+  struct tcp2_magazine *empty = tcp2_depot_pop(&depot->types[type].empty);
+  if (!empty)
+    empty = tcp2_depot_new_magazine(depot);
+
+  if (empty) {
+    /*
+     * Both magazines are full: give the previous one to the depot and load
+     * the empty one.
+     */
+    tcp2_depot_push(&depot->types[type].full, cache->previous);
+    cache->previous = cache->loaded;
+    cache->loaded = empty;
+
+    empty->objs[empty->rounds++] = obj;
+  }
+  else {
+    tcp2_allocator_free(depot->backing, type, cache->object_size, obj);
+  }
+
+  tcp2_mutex_unlock(&depot->lock);
+}
+
+/*
+ * Requests that are not cached in magazines pass straight through.
+ */
+static void *tcp2_magazine_alloc_uncached(struct tcp2_depot *depot,
+                                          uint64_t type, size_t size) {
+  tcp2_mutex_lock(&depot->lock);
+  void *obj = tcp2_allocator_alloc(depot->backing, type, size);
+  tcp2_mutex_unlock(&depot->lock);
+
+  return obj;
+}
+
+static void tcp2_magazine_free_uncached(struct tcp2_depot *depot,
+                                        uint64_t type, size_t size,
+                                        void *obj) {
+  tcp2_mutex_lock(&depot->lock);
+  tcp2_allocator_free(depot->backing, type, size, obj);
+  tcp2_mutex_unlock(&depot->lock);
+}
+
+
+
+/*
+ * The definitions of the magazine alloc and free functions.
+ *
+ * As in allocators_2.c, unregistered type ids have an object_size of zero,
+ * so a single comparison decides whether a request is cached.
+ */
+static void *tcp2_magazine_alloc(const struct tcp2_allocator *allocator,
+                                 uint64_t type, size_t size) {
+  struct tcp2_magazine_allocator *magazine_allocator =
+    (struct tcp2_magazine_allocator *)allocator;
+
+  if ((type >= TCP2_DEPOT_MAX_TYPES) ||
+      (magazine_allocator->caches[type].object_size < size)) {
+    return tcp2_magazine_alloc_uncached(magazine_allocator->depot,
+                                        type, size);
+  }
+
+  struct tcp2_magazine_cache *cache = &magazine_allocator->caches[type];
+  void *obj;
+
+  if (cache->loaded->rounds > 0) {
+    obj = cache->loaded->objs[--cache->loaded->rounds];
+  }
+  else
+  if (cache->previous->rounds > 0) {
+    struct tcp2_magazine *swap = cache->loaded;
+    cache->loaded = cache->previous;
+    cache->previous = swap;
+
+    obj = cache->loaded->objs[--cache->loaded->rounds];
+  }
+  else {
+    obj = tcp2_magazine_alloc_slow(magazine_allocator, cache, type, size);
+    if (!obj)
+      return NULL;
+  }
+
+  /*
+   * Rounds are recycled as they were freed, so keep the same contract as the
+   * trivial allocator, see allocators_8.c.
+   */
+  if (tcp2_type_zero_policy(type) & TCP2_ZERO_ON_ALLOC)
+    memset(obj, 0, size);
+
+  return obj;
+}
+
+static void tcp2_magazine_free(const struct tcp2_allocator *allocator,
+                               uint64_t type, size_t size, void *obj) {
+  struct tcp2_magazine_allocator *magazine_allocator =
+    (struct tcp2_magazine_allocator *)allocator;
+
+  if ((type >= TCP2_DEPOT_MAX_TYPES) ||
+      (magazine_allocator->caches[type].object_size < size)) {
+    tcp2_magazine_free_uncached(magazine_allocator->depot, type, size, obj);
+    return;
+  }
+
+  struct tcp2_magazine_cache *cache = &magazine_allocator->caches[type];
+
+  /*
+   * Rounds are recycled to other users of the type, so secrets are wiped
+   * here.  Uncached requests are zeroed by the backing allocator.
+   */
+  if (tcp2_type_zero_policy(type) & TCP2_ZERO_ON_FREE)
+    tcp2_secure_zero(obj, size);
+
+  if (cache->loaded->rounds < TCP2_MAGAZINE_ROUNDS) {
+    cache->loaded->objs[cache->loaded->rounds++] = obj;
+    return;
+  }
+
+  if (cache->previous->rounds == 0) {
+    struct tcp2_magazine *swap = cache->loaded;
+    cache->loaded = cache->previous;
+    cache->previous = swap;
+
+    cache->loaded->objs[cache->loaded->rounds++] = obj;
+    return;
+  }
+
+  tcp2_magazine_free_slow(magazine_allocator, cache, type, size, obj);
+}
+
+/*
+ * The batch operations move runs of rounds between the caller and the loaded
+ * magazine with a single copy.  Uncached requests take the depot lock once
+ * for the whole batch.
+ */
+static size_t tcp2_magazine_alloc_batch(const struct tcp2_allocator *allocator,
+                                        uint64_t type, size_t size,
+                                        size_t count, void **objs) {
+  struct tcp2_magazine_allocator *magazine_allocator =
+    (struct tcp2_magazine_allocator *)allocator;
+  struct tcp2_depot *depot = magazine_allocator->depot;
+
+  if ((type >= TCP2_DEPOT_MAX_TYPES) ||
+      (magazine_allocator->caches[type].object_size < size)) {
+    tcp2_mutex_lock(&depot->lock);
+    count = tcp2_allocator_alloc_batch(depot->backing,
+                                       type, size, count, objs);
+    tcp2_mutex_unlock(&depot->lock);
+
+    return count;
+  }
+
+  struct tcp2_magazine_cache *cache = &magazine_allocator->caches[type];
+  size_t done = 0;
+
+  while (done < count) {
+    if (cache->loaded->rounds == 0) {
+      if (cache->previous->rounds > 0) {
+        struct tcp2_magazine *swap = cache->loaded;
+        cache->loaded = cache->previous;
+        cache->previous = swap;
+      }
+      else {
+        /*
+         * Loads a full magazine from the depot when one is available.
+         */
+        void *obj =
+          tcp2_magazine_alloc_slow(magazine_allocator, cache, type, size);
+        if (!obj)
+          break;
+
+        objs[done++] = obj;
+        continue;
+      }
+    }
+
+    struct tcp2_magazine *loaded = cache->loaded;
+
+    size_t take = count - done;
+    if (take > loaded->rounds)
+      take = loaded->rounds;
+
+    loaded->rounds -= take;
+    memcpy(&objs[done], &loaded->objs[loaded->rounds], take * sizeof(void *));
+    done += take;
+  }
+
+  if (tcp2_type_zero_policy(type) & TCP2_ZERO_ON_ALLOC) {
+    for (size_t index = 0; index < done; ++index)
+      memset(objs[index], 0, size);
+  }
+
+  return done;
+}
+
+static void tcp2_magazine_free_batch(const struct tcp2_allocator *allocator,
+                                     uint64_t type, size_t size,
+                                     size_t count, void **objs) {
+  struct tcp2_magazine_allocator *magazine_allocator =
+    (struct tcp2_magazine_allocator *)allocator;
+  struct tcp2_depot *depot = magazine_allocator->depot;
+
+  if ((type >= TCP2_DEPOT_MAX_TYPES) ||
+      (magazine_allocator->caches[type].object_size < size)) {
+    tcp2_mutex_lock(&depot->lock);
+    tcp2_allocator_free_batch(depot->backing, type, size, count, objs);
+    tcp2_mutex_unlock(&depot->lock);
+
+    return;
+  }
+
+  struct tcp2_magazine_cache *cache = &magazine_allocator->caches[type];
+  size_t done = 0;
+
+  if (tcp2_type_zero_policy(type) & TCP2_ZERO_ON_FREE) {
+    for (size_t index = 0; index < count; ++index)
+      tcp2_secure_zero(objs[index], size);
+  }
+
+  while (done < count) {
+    if (cache->loaded->rounds == TCP2_MAGAZINE_ROUNDS) {
+      if (cache->previous->rounds == 0) {
+        struct tcp2_magazine *swap = cache->loaded;
+        cache->loaded = cache->previous;
+        cache->previous = swap;
+      }
+      else {
+        /*
+         * Loads an empty magazine from the depot when one is available.
+         */
+        tcp2_magazine_free_slow(magazine_allocator, cache,
+                                type, size, objs[done++]);
+        continue;
+      }
+    }
+
+    struct tcp2_magazine *loaded = cache->loaded;
+
+    size_t give = count - done;
+    if (give > TCP2_MAGAZINE_ROUNDS - loaded->rounds)
+      give = TCP2_MAGAZINE_ROUNDS - loaded->rounds;
+
+    memcpy(&loaded->objs[loaded->rounds], &objs[done], give * sizeof(void *));
+    loaded->rounds += give;
+    done += give;
+  }
+}
+
+/*
+ * Release every magazine held by the depot, with their rounds, then trim the
+ * backing allocator.  Only the magazines loaded by threads remain.
+ *
+ * Returns:
+ * The number of bytes the backing allocator returned to the system.
+ */
+size_t tcp2_depot_trim(struct tcp2_depot *depot, size_t target) {
+  tcp2_mutex_lock(&depot->lock);
+
+  for (uint64_t type = 0; type < TCP2_DEPOT_MAX_TYPES; ++type) {
+    struct tcp2_magazine *magazine;
+
+    while ((magazine = tcp2_depot_pop(&depot->types[type].full)))
+      tcp2_depot_destroy_magazine(depot, type, magazine);
+
+    while ((magazine = tcp2_depot_pop(&depot->types[type].empty)))
+      tcp2_depot_destroy_magazine(depot, type, magazine);
+  }
+
+  size_t released = tcp2_allocator_trim(depot->backing, target);
+
+  tcp2_mutex_unlock(&depot->lock);
+
+  return released;
+}
+
+/*
+ * Empty the magazines of the calling thread into the backing allocator, keeping
+ * the magazines themselves, then trim the depot.
+ */
+static size_t tcp2_magazine_trim(const struct tcp2_allocator *allocator,
+                                 size_t target) {
+  struct tcp2_magazine_allocator *magazine_allocator =
+    (struct tcp2_magazine_allocator *)allocator;
+  struct tcp2_depot *depot = magazine_allocator->depot;
+
+  tcp2_mutex_lock(&depot->lock);
+
+  for (uint64_t type = 1; type < TCP2_DEPOT_MAX_TYPES; ++type) {
+    struct tcp2_magazine_cache *cache = &magazine_allocator->caches[type];
+    if (cache->object_size == 0)
+      continue;
+
+    struct tcp2_magazine *magazines[2] = { cache->loaded, cache->previous };
+    for (int index = 0; index < 2; ++index) {
+      while (magazines[index]->rounds > 0) {
+        tcp2_allocator_free(depot->backing, type, cache->object_size,
+                            magazines[index]->objs[--magazines[index]->rounds]);
+      }
+    }
+  }
+
+  tcp2_mutex_unlock(&depot->lock);
+
+  return tcp2_depot_trim(depot, target);
+}
+
+/*
+ * The global operations structure to hold references to magazine alloc and
+ * free.
+ */
+static struct tcp2_allocator_operations tcp2_magazine_allocator_operations = {
+  .alloc = tcp2_magazine_alloc,
+  .free = tcp2_magazine_free,
+  .alloc_batch = tcp2_magazine_alloc_batch,
+  .free_batch = tcp2_magazine_free_batch,
+  .trim = tcp2_magazine_trim,
+};
+
+
+
+/*
+ * Create a depot.  Typically a single depot is created per system context.
+ *
+ * Arguments:
+ * backing: the allocator wrapped by the depot.  It is only called with the
+ *          depot lock held.
+ *
+ * Returns:
+ * A new depot without any registered types, or NULL upon failure.
+ */
+struct tcp2_depot *tcp2_create_depot(const struct tcp2_allocator *backing) {
+  struct tcp2_depot *depot =
+    tcp2_allocator_alloc(backing, 0, sizeof(struct tcp2_depot));
+  if (!depot)
+    return NULL;
+
+  memset(depot, 0, sizeof(struct tcp2_depot));
+
+  depot->backing = backing;
+  tcp2_mutex_init(&depot->lock);
+
+  return depot;
+}
+
+/*
+ * Register a type id with a depot, so that its objects are cached in
+ * magazines.
+ *
+ * Returns:
+ * 0 on success, -1 if the type id is out of range or already registered.
+ */
+int tcp2_depot_register_type(struct tcp2_depot *depot,
+                             uint64_t type, size_t size) {
+  if ((type == 0) || (type >= TCP2_DEPOT_MAX_TYPES) ||
+      (depot->types[type].object_size != 0)) {
+    return -1;
+  }
+
+  depot->types[type].object_size = size;
+
+  return 0;
+}
+
+/*
+ * Depot destructor.  All magazine allocators created from the depot must have
+ * been destroyed already.
+ */
+void tcp2_destroy_depot(struct tcp2_depot *depot) {
+  for (uint64_t type = 0; type < TCP2_DEPOT_MAX_TYPES; ++type) {
+    struct tcp2_magazine *magazine;
+
+    while ((magazine = tcp2_depot_pop(&depot->types[type].full)))
+      tcp2_depot_destroy_magazine(depot, type, magazine);
+
+    while ((magazine = tcp2_depot_pop(&depot->types[type].empty)))
+      tcp2_depot_destroy_magazine(depot, type, magazine);
+  }
+
+  tcp2_mutex_destroy(&depot->lock);
+
+  tcp2_allocator_free(depot->backing, 0, sizeof(struct tcp2_depot), depot);
+}
+
+
+
+/*
+ * Create a magazine allocator for the calling thread.  Two empty magazines
+ * are set up for every type id registered with the depot.
+ */
+struct tcp2_magazine_allocator *tcp2_create_magazine_allocator(
+    struct tcp2_depot *depot) {
+  struct tcp2_magazine_allocator *magazine_allocator =
+    tcp2_magazine_alloc_uncached(depot, 0,
+                                 sizeof(struct tcp2_magazine_allocator));
+  if (!magazine_allocator)
+    return NULL;
+
+  memset(magazine_allocator, 0, sizeof(struct tcp2_magazine_allocator));
+
+  magazine_allocator->tcp2_allocator.operations =
+    &tcp2_magazine_allocator_operations;
+  magazine_allocator->depot = depot;
+
+  tcp2_mutex_lock(&depot->lock);
+
+  for (uint64_t type = 1; type < TCP2_DEPOT_MAX_TYPES; ++type) {
+    if (depot->types[type].object_size == 0)
+      continue;
+
+    struct tcp2_magazine_cache *cache = &magazine_allocator->caches[type];
+
+    cache->loaded = tcp2_depot_pop(&depot->types[type].empty);
+    if (!cache->loaded)
+      cache->loaded = tcp2_depot_new_magazine(depot);
+
+    cache->previous = tcp2_depot_pop(&depot->types[type].empty);
+    if (!cache->previous)
+      cache->previous = tcp2_depot_new_magazine(depot);
+
+    /*
+     * A type without its two magazines is simply not cached by this thread.
+     */
+    if (cache->loaded && cache->previous) {
+      cache->object_size = depot->types[type].object_size;
+    }
+    else {
+      if (cache->loaded)
+        tcp2_depot_push(&depot->types[type].empty, cache->loaded);
+      if (cache->previous)
+        tcp2_depot_push(&depot->types[type].empty, cache->previous);
+      cache->loaded = NULL;
+      cache->previous = NULL;
+    }
+  }
+
+  tcp2_mutex_unlock(&depot->lock);
+
+  return magazine_allocator;
+}
+
+/*
+ * Magazine allocator destructor, called when a thread exits.  Full magazines
+ * are handed to the depot for other threads to use, any partially filled
+ * magazine has its rounds returned to the backing allocator.
+ */
+void tcp2_destroy_magazine_allocator(
+    struct tcp2_magazine_allocator *magazine_allocator) {
+  struct tcp2_depot *depot = magazine_allocator->depot;
+
+  tcp2_mutex_lock(&depot->lock);
+
+  for (uint64_t type = 1; type < TCP2_DEPOT_MAX_TYPES; ++type) {
+    struct tcp2_magazine_cache *cache = &magazine_allocator->caches[type];
+    if (cache->object_size == 0)
+      continue;
+
+    struct tcp2_magazine *magazines[2] = { cache->loaded, cache->previous };
+    for (int index = 0; index < 2; ++index) {
+      if (magazines[index]->rounds == TCP2_MAGAZINE_ROUNDS)
+        tcp2_depot_push(&depot->types[type].full, magazines[index]);
+      else
+        tcp2_depot_destroy_magazine(depot, type, magazines[index]);
+    }
+  }
+
+  tcp2_allocator_free(depot->backing,
+                      0, sizeof(struct tcp2_magazine_allocator),
+                      magazine_allocator);
+
+  tcp2_mutex_unlock(&depot->lock);
+}
+
+
+
+
+
+
+/*
+ * The following shows how the magazine layer becomes the allocation state of
+ * a tcp2 thread context.  The system context owns a depot, and when no
+ * allocator is provided by the application, every thread context creates its
+ * own magazine allocator from that depot.
+ */
+struct tcp2_system_context {
+  /*
+   * Other global state, such as the master registry of connection ids.
+   */
+
+  struct tcp2_depot *depot;
+};
+
+struct tcp2_thread_context {
+  struct tcp2_system_context *system_context;
+
+  /*
+   * The allocator used for everything allocated by this thread.
+   */
+  const struct tcp2_allocator *allocator;
+
+  /*
+   * Set when the allocator above was created by tcp2 itself.
+   */
+  struct tcp2_magazine_allocator *magazine_allocator;
+
+  /*
+   * Other thread local state, such as connections.
+   */
+};
+
+struct tcp2_thread_context *tcp2_create_thread_context(
+    struct tcp2_system_context *tcp2_system_context,
+    const struct tcp2_allocator *allocator) {
+  struct tcp2_magazine_allocator *magazine_allocator = NULL;
+
+  if (!allocator) {
+    magazine_allocator =
+      tcp2_create_magazine_allocator(tcp2_system_context->depot);
+    if (!magazine_allocator)
+      return NULL;
+
+    allocator = &magazine_allocator->tcp2_allocator;
+  }
+
+  struct tcp2_thread_context *tcp2_thread_context =
+    tcp2_allocator_alloc(allocator, TCP2_TYPE_THREAD_CONTEXT,
+                         sizeof(struct tcp2_thread_context));
+  if (!tcp2_thread_context) {
+    if (magazine_allocator)
+      tcp2_destroy_magazine_allocator(magazine_allocator);
+    return NULL;
+  }
+
+  tcp2_thread_context->system_context = tcp2_system_context;
+  tcp2_thread_context->allocator = allocator;
+  tcp2_thread_context->magazine_allocator = magazine_allocator;
+
+  return tcp2_thread_context;
+}
+
+void tcp2_destroy_thread_context(
+    struct tcp2_thread_context *tcp2_thread_context) {
+  struct tcp2_magazine_allocator *magazine_allocator =
+    tcp2_thread_context->magazine_allocator;
+
+  tcp2_allocator_free(tcp2_thread_context->allocator,
+                      TCP2_TYPE_THREAD_CONTEXT,
+                      sizeof(struct tcp2_thread_context),
+                      tcp2_thread_context);
+
+  if (magazine_allocator)
+    tcp2_destroy_magazine_allocator(magazine_allocator);
+}
+
+
+
+/*
+ * The system context sets up its depot on creation, backed by a slab
+ * allocator (allocators_2.c) so that magazine refills are served from slabs,
+ * which in turn are served by the trivial allocator.
+ */
+struct tcp2_system_context *tcp2_create_system_context() {
+  struct tcp2_system_context *tcp2_system_context =
+    tcp2_allocator_alloc(tcp2_get_trivial_allocator(),
+                         0, sizeof(struct tcp2_system_context));
+  if (!tcp2_system_context)
+    return NULL;
+
+  struct tcp2_slab_allocator *tcp2_slab_allocator =
+    tcp2_create_slab_allocator(tcp2_get_trivial_allocator());
+  if (!tcp2_slab_allocator) {
+    tcp2_allocator_free(tcp2_get_trivial_allocator(),
+                        0, sizeof(struct tcp2_system_context),
+                        tcp2_system_context);
+    return NULL;
+  }
+
+  tcp2_slab_allocator_register_tcp2_types(tcp2_slab_allocator);
+
+  tcp2_system_context->depot =
+    tcp2_create_depot(&tcp2_slab_allocator->tcp2_allocator);
+  if (!tcp2_system_context->depot) {
+    tcp2_destroy_slab_allocator(tcp2_slab_allocator);
+    tcp2_allocator_free(tcp2_get_trivial_allocator(),
+                        0, sizeof(struct tcp2_system_context),
+                        tcp2_system_context);
+    return NULL;
+  }
+
+  /*
+   * Every fixed size type of the type registry (allocators_8.c) is cached.
+   */
+  for (uint64_t type = 1; type < TCP2_TYPE_REGISTRY_SIZE; ++type) {
+    size_t size = tcp2_type_get_info(type)->size;
+    if ((size != 0) && (type != TCP2_TYPE_MAGAZINE) &&
+        (type != TCP2_TYPE_SLAB)) {
+      tcp2_depot_register_type(tcp2_system_context->depot, type, size);
+    }
+  }
+
+  return tcp2_system_context;
+}
@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+
+/*
+ * This case study builds on allocators_1.c and allocators_3.c and demonstrates
+ * how memory can be returned to the thread that allocated it, when it is
+ * freed on a different thread.
+ *
+ * The thread context design of init_1.c assumes that once a connection is
+ * associated with a thread, everything belonging to that connection is
+ * handled on that thread.  One important exception exists: output buffers.
+ * A buffer produced by tcp2_process is handed to app_network_write_udp, and
+ * many applications send from dedicated I/O threads, so the buffer is
+ * released on a thread that did not allocate it.
+ *
+ * Freeing such memory directly into the allocator of the I/O thread, or into
+ * a shared depot, slowly migrates memory away from the thread that uses it,
+ * and on multi-socket systems away from the NUMA node it was allocated on.
+ * Freeing it directly into the allocator of the owning thread would require
+ * that allocator to be locked.
+ *
+ * The remote free allocator shown here wraps the allocator of a thread
+ * context.  Frees made on the owning thread go straight to the wrapped
+ * allocator.  Frees made on any other thread push the object onto a lock-free
+ * multiple producer, single consumer return queue owned by the allocating
+ * thread context.  The owning thread drains its return queue at the start of
+ * every tcp2_process call, freeing the objects locally.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - As with every tcp2 allocator, an object is freed through the same
+ *   allocator that allocated it.  tcp2 objects that may be released on other
+ *   threads, such as tcp2_buffer, record the allocator they were allocated
+ *   from.  The allocator passed to free therefore identifies the owning
+ *   thread, and no per object header is needed.
+ * - The calling thread is identified by a thread local pointer to the remote
+ *   free allocator created on that thread.  A thread owns at most one remote
+ *   free allocator, just as it owns at most one thread context.
+ * - While an object sits in a return queue, its own memory holds the queue
+ *   link, its type id and its size.  Requests smaller than that are rounded
+ *   up when they are passed to the wrapped allocator.
+ * - The return queue is a stack that the owner takes in one atomic exchange.
+ *   Producers only ever push and the consumer only ever takes the whole
+ *   stack, so there is no ABA problem.  Ordering of returned objects does not
+ *   matter.
+ * - A freeing thread writes one cache line of the owner, the queue head,
+ *   which is kept on its own line away from the members used by the owner.
+ * - A thread context must not be destroyed while memory it allocated is still
+ *   held by other threads.  The return queue goes away with the remote free
+ *   allocator, so a free still in flight on another thread at that point
+ *   would push onto freed memory.  Before a worker thread destroys its
+ *   thread context, the application makes sure that its I/O threads have
+ *   destroyed every buffer the worker handed them, after which nothing can
+ *   be freed into the queue any more.
+ * ----END DISCUSSION----
+ */
+
+
+
+#define TCP2_CACHE_LINE_SIZE    64
+
+
+
+/*
+ * The layout of an object while it sits in a return queue.
+ */
+struct tcp2_remote_free_node {
+  struct tcp2_remote_free_node *next;
+  uint64_t type;
+  size_t size;
+};
+
+/*
+ * Remote free allocator.
+ *
+ * The return queue head is padded to a cache line of its own, as it is the
+ * only member written by other threads.  Padding is used rather than an
+ * alignment attribute because allocators only guarantee malloc alignment.
+ */
+struct tcp2_remote_free_allocator {
+  struct tcp2_allocator tcp2_allocator;
+
+  const struct tcp2_allocator *backing;
+
+  char padding_before[TCP2_CACHE_LINE_SIZE];
+
+  _Atomic(struct tcp2_remote_free_node *) return_queue;
+
+  char padding_after[TCP2_CACHE_LINE_SIZE];
+};
+
+/*
+ * The remote free allocator owned by the calling thread, if any.
+ */
+static _Thread_local const struct tcp2_remote_free_allocator
+  *tcp2_remote_free_current = NULL;
+
+
+
+/*
+ * The size actually requested from, and returned to, the wrapped allocator.
+ */
+static inline size_t tcp2_remote_free_size(size_t size) {
+  if (size < sizeof(struct tcp2_remote_free_node))
+    return sizeof(struct tcp2_remote_free_node);
+
+  return size;
+}
+
+
+
+/*
+ * The definitions of the remote free alloc and free functions.
+ *
+ * Allocations always happen on the owning thread.
+ */
+static void *tcp2_remote_free_alloc(const struct tcp2_allocator *allocator,
+                                    uint64_t type, size_t size) {
+  const struct tcp2_remote_free_allocator *remote_free_allocator =
+    (const struct tcp2_remote_free_allocator *)allocator;
+
+  return tcp2_allocator_alloc(remote_free_allocator->backing,
+                              type, tcp2_remote_free_size(size));
+}
+
+static void tcp2_remote_free_free(const struct tcp2_allocator *allocator,
+                                  uint64_t type, size_t size, void *obj) {
+  struct tcp2_remote_free_allocator *remote_free_allocator =
+    (struct tcp2_remote_free_allocator *)allocator;
+
+  if (remote_free_allocator == tcp2_remote_free_current) {
+    tcp2_allocator_free(remote_free_allocator->backing,
+                        type, tcp2_remote_free_size(size), obj);
+    return;
+  }
+
+  /*
+   * Freed on another thread: push onto the return queue of the owner.  The
+   * release ordering publishes the node contents to the owner.
+   */
+  struct tcp2_remote_free_node *node = obj;
+  node->type = type;
+  node->size = size;
+
+  struct tcp2_remote_free_node *head =
+    atomic_load_explicit(&remote_free_allocator->return_queue,
+                         memory_order_relaxed);
+  do {
+    node->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(
+             &remote_free_allocator->return_queue, &head, node,
+             memory_order_release, memory_order_relaxed));
+}
+
+/*
+ * Objects on the return queue are not idle memory of this allocator, they are
+ * drained at the start of tcp2_process, which runs before any trim requested
+ * through the thread context (allocators_12.c).
+ */
+static size_t tcp2_remote_free_trim(const struct tcp2_allocator *allocator,
+                                    size_t target) {
+  const struct tcp2_remote_free_allocator *remote_free_allocator =
+    (const struct tcp2_remote_free_allocator *)allocator;
+
+  return tcp2_allocator_trim(remote_free_allocator->backing, target);
+}
+
+
+
+/*
+ * The global operations structure to hold references to remote free alloc and
+ * free.
+ */
+static struct tcp2_allocator_operations
+  tcp2_remote_free_allocator_operations = {
+  .alloc = tcp2_remote_free_alloc,
+  .free = tcp2_remote_free_free,
+  .trim = tcp2_remote_free_trim,
+};
+
+
+
+/*
+ * Create a remote free allocator.  Must be called on the thread that will own
+ * it, which is the thread that will allocate through it.
+ *
+ * Arguments:
+ * backing: the allocator of the owning thread.  It is only ever called from
+ *          the owning thread.
+ *
+ * Returns:
+ * A new remote free allocator, or NULL upon failure or if the calling thread
+ * already owns one.
+ */
+struct tcp2_remote_free_allocator *tcp2_create_remote_free_allocator(
+    const struct tcp2_allocator *backing) {
+  if (tcp2_remote_free_current)
+    return NULL;
+
+  struct tcp2_remote_free_allocator *remote_free_allocator =
+    tcp2_allocator_alloc(backing,
+                         0, sizeof(struct tcp2_remote_free_allocator));
+  if (!remote_free_allocator)
+    return NULL;
+
+  remote_free_allocator->tcp2_allocator.operations =
+    &tcp2_remote_free_allocator_operations;
+  remote_free_allocator->backing = backing;
+  atomic_init(&remote_free_allocator->return_queue, NULL);
+
+  tcp2_remote_free_current = remote_free_allocator;
+
+  return remote_free_allocator;
+}
+
+/*
+ * Free everything that other threads have returned so far.  Called by the
+ * owning thread only.
+ *
+ * Returns:
+ * The number of objects freed.
+ */
+size_t tcp2_remote_free_allocator_drain(
+    struct tcp2_remote_free_allocator *remote_free_allocator) {
+  /*
+   * Avoid writing the queue head, and taking its cache line away from the
+   * other threads, when nothing has been returned.
+   */
+  if (!atomic_load_explicit(&remote_free_allocator->return_queue,
+                            memory_order_relaxed)) {
+    return 0;
+  }
+
+  struct tcp2_remote_free_node *node =
+    atomic_exchange_explicit(&remote_free_allocator->return_queue, NULL,
+                             memory_order_acquire);
+
+  size_t count = 0;
+  while (node) {
+    struct tcp2_remote_free_node *next = node->next;
+
+    tcp2_allocator_free(remote_free_allocator->backing,
+                        node->type, tcp2_remote_free_size(node->size), node);
+
+    node = next;
+    count++;
+  }
+
+  return count;
+}
+
+/*
+ * Remote free allocator destructor, called on the owning thread.  Anything
+ * returned up to this point is drained first.
+ */
+void tcp2_destroy_remote_free_allocator(
+    struct tcp2_remote_free_allocator *remote_free_allocator) {
+  tcp2_remote_free_allocator_drain(remote_free_allocator);
+
+  if (tcp2_remote_free_current == remote_free_allocator)
+    tcp2_remote_free_current = NULL;
+
+  tcp2_allocator_free(remote_free_allocator->backing,
+                      0, sizeof(struct tcp2_remote_free_allocator),
+                      remote_free_allocator);
+}
+
+
+
+
+
+
+/*
+ * The following shows how the remote free allocator is attached to a thread
+ * context as an allocator mode, and how tcp2_process drains it.  The thread
+ * context is the one shown in allocators_3.c, with one new member:
+ */
+struct tcp2_thread_context {
+  struct tcp2_system_context *system_context;
+
+  const struct tcp2_allocator *allocator;
+
+  struct tcp2_magazine_allocator *magazine_allocator;
+
+  /*
+   * Set when remote free has been enabled, it then wraps the allocator above.
+   */
+  struct tcp2_remote_free_allocator *remote_free_allocator;
+};
+
+/*
+ * Enable remote free for a thread context.  Must be called on the thread that
+ * created the thread context, before anything is allocated through it.
+ *
+ * Returns:
+ * 0 on success, -1 on failure in which case the thread context continues to
+ * use its allocator directly.
+ */
+int tcp2_thread_context_enable_remote_free(
+    struct tcp2_thread_context *tcp2_thread_context) {
+  if (tcp2_thread_context->remote_free_allocator)
+    return 0;
+
+  struct tcp2_remote_free_allocator *remote_free_allocator =
+    tcp2_create_remote_free_allocator(tcp2_thread_context->allocator);
+  if (!remote_free_allocator)
+    return -1;
+
+  tcp2_thread_context->remote_free_allocator = remote_free_allocator;
+  tcp2_thread_context->allocator = &remote_free_allocator->tcp2_allocator;
+
+  return 0;
+}
+
+/*
+ * The beginning of tcp2_process.  Memory returned by other threads since the
+ * last call is freed before any new work is done, so that it can be reused
+ * straight away.
+ */
+void tcp2_process(struct tcp2_context *tcp2_context,
+                  struct tcp2_events *tcp2_events) {
+  struct tcp2_thread_context *tcp2_thread_context =
+    tcp2_context->thread_context;
+
+  if (tcp2_thread_context->remote_free_allocator) {
+    tcp2_remote_free_allocator_drain(
+      tcp2_thread_context->remote_free_allocator);
+  }
+
+  /*
+   * Process events.
+   */
+}
+
+/*
+ * The part of the thread context destructor that deals with remote free.
+ * Called on the owning thread, once no other thread can free into the
+ * context any more, see the DISCUSSION above.  The remote free allocator
+ * drains whatever was returned up to this point, and the calling thread no
+ * longer owns one afterwards, so that a new thread context may enable
+ * remote free on it again.
+ */
+void tcp2_destroy_thread_context(
+    struct tcp2_thread_context *tcp2_thread_context) {
+  struct tcp2_remote_free_allocator *remote_free_allocator =
+    tcp2_thread_context->remote_free_allocator;
+
+  if (remote_free_allocator) {
+    tcp2_thread_context->allocator = remote_free_allocator->backing;
+    tcp2_thread_context->remote_free_allocator = NULL;
+
+    tcp2_destroy_remote_free_allocator(remote_free_allocator);
+  }
+
+  /*
+   * Allocator torn down as in allocators_3.c.
+   */
+}
+
+
+
+
+
+
+/*
+ * Finally, the application side.  Worker threads enable remote free, and the
+ * I/O thread destroys buffers once they have been sent.  tcp2_destroy_buffer
+ * frees through the allocator recorded in the buffer, which is the remote
+ * free allocator of the worker thread.
+ */
+void app_on_thread_start() {
+  struct tcp2_thread_context *tcp2_thread_context =
+    tcp2_create_thread_context(tcp2_system_context, NULL);
+  if (!tcp2_thread_context) {
+    app_on_thread_start_failed();
+    return;
+  }
+
+  /*
+   * Without remote free, the I/O threads could not destroy the buffers of
+   * this thread.
+   */
+  if (tcp2_thread_context_enable_remote_free(tcp2_thread_context) != 0) {
+    tcp2_destroy_thread_context(tcp2_thread_context);
+    app_on_thread_start_failed();
+    return;
+  }
+
+  app_store_tcp2_thread_context(tcp2_thread_context);
+
+  app_execute_thread_loop();
+
+  /*
+   * Wait until the I/O threads have sent and destroyed every buffer this
+   * thread handed them, so that no free is in flight when the thread context
+   * goes away.
+   */
+  app_io_threads_flush();
+
+  tcp2_destroy_thread_context(tcp2_thread_context);
+}
+
+void app_io_thread_on_udp_written(struct app_io_context *app_io_context,
+                                  struct tcp2_buffer *buffer) {
+  tcp2_destroy_buffer(buffer);
+}
@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+
+/*
+ * This case study builds on allocators_1.c and demonstrates an arena
+ * allocator that is attached to a single connection.
+ *
+ * A large part of the state of a connection lives exactly as long as the
+ * connection does: handshake state, transport parameters, the stream table
+ * and crypto contexts.  With the allocator interface of allocators_1.c each
+ * of these objects is freed individually when the connection closes, and on
+ * short lived connections these close time frees become a significant share
+ * of the work done for the connection.
+ *
+ * An arena serves allocations by bumping a pointer through contiguous chunks
+ * of memory.  Individual frees do nothing.  When the connection closes, the
+ * whole arena is released in one operation, one free per chunk, regardless of
+ * how many objects were allocated from it.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - Only types that are known to live as long as their connection are
+ *   allocated from the arena.  Objects that come and go during the life of a
+ *   connection, such as sent packet records, ack ranges and timer nodes,
+ *   continue to use the allocator of the thread context, otherwise a long
+ *   lived connection would grow its arena without bound.
+ * - Objects that are replaced during the life of a connection, for example a
+ *   stream table that is grown, leave their old memory in the arena until the
+ *   connection closes.  Growth is expected to be rare and bounded by limits
+ *   negotiated in the transport parameters.
+ * - Crypto contexts hold key material, and freeing them individually does
+ *   nothing, so a connection arena wipes all of its chunks when it is
+ *   destroyed.  Wiping a few contiguous chunks is cheaper than wiping many
+ *   scattered objects.
+ * - An arena belongs to a connection, and a connection belongs to a thread,
+ *   so an arena is not thread safe.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * Type ids, such as TCP2_TYPE_ARENA_CHUNK, are defined in the type registry,
+ * see allocators_8.c.
+ */
+
+/*
+ * Default size of an arena chunk.  A connection that completes a handshake
+ * is expected to fit its fixed lifetime state in one or two chunks.
+ */
+#define TCP2_ARENA_CHUNK_SIZE               (16 * 1024)
+
+/*
+ * All objects are aligned to this.
+ */
+#define TCP2_ARENA_ALIGN                    16
+
+/*
+ * Flags for tcp2_create_arena.
+ */
+#define TCP2_ARENA_WIPE_ON_DESTROY          (1 << 0)
+
+
+
+/*
+ * Arena chunk.
+ *
+ * The chunk header is followed by the memory handed out by the arena.  The
+ * first chunk of an arena also holds the arena structure itself.
+ */
+struct tcp2_arena_chunk {
+  struct tcp2_arena_chunk *next;
+  size_t size;
+  size_t used;
+};
+
+/*
+ * Arena.
+ */
+struct tcp2_arena {
+  struct tcp2_allocator tcp2_allocator;
+
+  const struct tcp2_allocator *backing;
+
+  /*
+   * The chunk allocations are currently served from is always first.
+   */
+  struct tcp2_arena_chunk *chunks;
+
+  size_t chunk_size;
+
+  int flags;
+};
+
+
+
+static inline size_t tcp2_arena_round(size_t size) {
+  return (size + TCP2_ARENA_ALIGN - 1) & ~(size_t)(TCP2_ARENA_ALIGN - 1);
+}
+
+/*
+ * Allocate a new chunk able to hold at least 'size' bytes.  Chunks are zeroed
+ * once here, so that objects handed out of them need not be zeroed one by
+ * one.  Arena memory is never reused before the arena is destroyed, so the
+ * contract of the trivial allocator, that known types are zeroed, holds.
+ */
+static struct tcp2_arena_chunk *tcp2_arena_chunk_create(
+    const struct tcp2_allocator *backing,
+    size_t chunk_size, size_t size) {
+  size_t header_size = tcp2_arena_round(sizeof(struct tcp2_arena_chunk));
+
+  if (size > chunk_size - header_size)
+    chunk_size = header_size + size;
+
+  struct tcp2_arena_chunk *chunk =
+    tcp2_allocator_alloc(backing, TCP2_TYPE_ARENA_CHUNK, chunk_size);
+  if (!chunk)
+    return NULL;
+
+  memset(chunk, 0, chunk_size);
+
+  chunk->next = NULL;
+  chunk->size = chunk_size;
+  chunk->used = header_size;
+
+  return chunk;
+}
+
+
+
+/*
+ * The definitions of the arena alloc and free functions.
+ */
+static void *tcp2_arena_alloc(const struct tcp2_allocator *allocator,
+                              uint64_t type, size_t size) {
+  struct tcp2_arena *arena = (struct tcp2_arena *)allocator;
+
+  size = tcp2_arena_round(size);
+
+  struct tcp2_arena_chunk *chunk = arena->chunks;
+  if (chunk->size - chunk->used < size) {
+    struct tcp2_arena_chunk *new_chunk =
+      tcp2_arena_chunk_create(arena->backing, arena->chunk_size, size);
+    if (!new_chunk)
+      return NULL;
+
+    if (new_chunk->size > arena->chunk_size) {
+      /*
+       * An oversized chunk holds a single object, keep allocating from the
+       * current chunk afterwards.
+       */
+      new_chunk->next = chunk->next;
+      chunk->next = new_chunk;
+    }
+    else {
+      new_chunk->next = chunk;
+      arena->chunks = new_chunk;
+    }
+
+    chunk = new_chunk;
+  }
+
+  void *obj = (char *)chunk + chunk->used;
+  chunk->used += size;
+
+  return obj;
+}
+
+/*
+ * Memory is reclaimed when the arena is destroyed.
+ */
+static void tcp2_arena_free(const struct tcp2_allocator *allocator,
+                            uint64_t type, size_t size, void *obj) {
+}
+
+
+
+/*
+ * The global operations structure to hold references to arena alloc and free.
+ */
+static struct tcp2_allocator_operations tcp2_arena_allocator_operations = {
+  .alloc = tcp2_arena_alloc,
+  .free = tcp2_arena_free,
+};
+
+
+
+/*
+ * Create an arena.
+ *
+ * Arguments:
+ * backing: the allocator chunks are allocated from, typically the allocator
+ *          of the thread context
+ *
+ * chunk_size: the size of regular chunks, 0 for TCP2_ARENA_CHUNK_SIZE
+ *
+ * flags: TCP2_ARENA_WIPE_ON_DESTROY or 0
+ *
+ * Returns:
+ * A new arena, or NULL upon failure.  The arena is stored in its own first
+ * chunk, so creating an arena costs a single allocation.
+ */
+struct tcp2_arena *tcp2_create_arena(const struct tcp2_allocator *backing,
+                                     size_t chunk_size, int flags) {
+  if (chunk_size == 0)
+    chunk_size = TCP2_ARENA_CHUNK_SIZE;
+
+  size_t arena_size = tcp2_arena_round(sizeof(struct tcp2_arena));
+
+  struct tcp2_arena_chunk *chunk =
+    tcp2_arena_chunk_create(backing, chunk_size, arena_size);
+  if (!chunk)
+    return NULL;
+
+  struct tcp2_arena *arena = (struct tcp2_arena *)((char *)chunk + chunk->used);
+  chunk->used += arena_size;
+
+  arena->tcp2_allocator.operations = &tcp2_arena_allocator_operations;
+  arena->backing = backing;
+  arena->chunks = chunk;
+  arena->chunk_size = chunk_size;
+  arena->flags = flags;
+
+  return arena;
+}
+
+/*
+ * Arena destructor, releasing every object allocated from the arena in one
+ * operation.  The arena itself lives in one of its chunks, so nothing may
+ * refer to it once its chunks are released.
+ */
+void tcp2_destroy_arena(struct tcp2_arena *arena) {
+  const struct tcp2_allocator *backing = arena->backing;
+  int wipe = arena->flags & TCP2_ARENA_WIPE_ON_DESTROY;
+
+  struct tcp2_arena_chunk *chunk = arena->chunks;
+  while (chunk) {
+    struct tcp2_arena_chunk *next = chunk->next;
+    size_t size = chunk->size;
+
+    if (wipe)
+      tcp2_secure_zero(chunk, size);
+
+    tcp2_allocator_free(backing, TCP2_TYPE_ARENA_CHUNK, size, chunk);
+
+    chunk = next;
+  }
+}
+
+
+
+
+
+
+/*
+ * The following shows how tcp2 attaches an arena to each connection, and how
+ * the allocator for a given object of a connection is chosen.
+ */
+
+/*
+ * The set of type ids that live as long as their connection.
+ */
+#define TCP2_CONNECTION_LIFETIME_TYPES \
+  ((UINT64_C(1) << TCP2_TYPE_CONNECTION) | \
+   (UINT64_C(1) << TCP2_TYPE_HANDSHAKE_STATE) | \
+   (UINT64_C(1) << TCP2_TYPE_TRANSPORT_PARAMETERS) | \
+   (UINT64_C(1) << TCP2_TYPE_STREAM_TABLE) | \
+   (UINT64_C(1) << TCP2_TYPE_CRYPTO_CONTEXT))
+
+struct tcp2_connection {
+  struct tcp2_thread_context *thread_context;
+
+  struct tcp2_arena *arena;
+
+  struct tcp2_handshake_state *handshake_state;
+  struct tcp2_transport_parameters *transport_parameters;
+  struct tcp2_stream_table *stream_table;
+  struct tcp2_crypto_context *crypto_context;
+
+  /*
+   * Other connection state.
+   */
+};
+
+/*
+ * Select the allocator for an object belonging to a connection.
+ */
+static inline const struct tcp2_allocator *tcp2_connection_allocator(
+    const struct tcp2_connection *connection, uint64_t type) {
+  if ((type < 64) &&
+      ((UINT64_C(1) << type) & TCP2_CONNECTION_LIFETIME_TYPES)) {
+    return &connection->arena->tcp2_allocator;
+  }
+
+  return connection->thread_context->allocator;
+}
+
+/*
+ * The connection is the first object allocated from its own arena.
+ */
+struct tcp2_connection *tcp2_create_connection(
+    struct tcp2_thread_context *tcp2_thread_context) {
+  struct tcp2_arena *arena =
+    tcp2_create_arena(tcp2_thread_context->allocator, 0,
+                      TCP2_ARENA_WIPE_ON_DESTROY);
+  if (!arena)
+    return NULL;
+
+  struct tcp2_connection *connection =
+    tcp2_allocator_alloc(&arena->tcp2_allocator,
+                         TCP2_TYPE_CONNECTION,
+                         sizeof(struct tcp2_connection));
+  if (!connection) {
+    tcp2_destroy_arena(arena);
+    return NULL;
+  }
+
+  connection->thread_context = tcp2_thread_context;
+  connection->arena = arena;
+
+  connection->transport_parameters =
+    tcp2_allocator_alloc(tcp2_connection_allocator(
+                           connection, TCP2_TYPE_TRANSPORT_PARAMETERS),
+                         TCP2_TYPE_TRANSPORT_PARAMETERS,
+                         sizeof(struct tcp2_transport_parameters));
+  if (!connection->transport_parameters) {
+    tcp2_destroy_arena(arena);
+    return NULL;
+  }
+
+  /*
+   * Handshake state, stream table and crypto contexts are allocated the same
+   * way as the handshake progresses.
+   */
+
+  return connection;
+}
+
+/*
+ * Closing a connection.  Objects allocated from the thread context are freed
+ * individually, everything else goes with the arena, including the
+ * connection itself.
+ */
+void tcp2_destroy_connection(struct tcp2_connection *connection) {
+  tcp2_connection_free_sent_packets(connection);
+  tcp2_connection_free_ack_ranges(connection);
+  tcp2_connection_cancel_timers(connection);
+
+  tcp2_destroy_arena(connection->arena);
+}
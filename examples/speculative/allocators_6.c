@@ -0,0 +1,654 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+
+/*
+ * This case study builds on allocators_1.c and demonstrates one of the goals
+ * listed there: setting limits on allocations in order to avoid memory
+ * blowout and general system overload.
+ *
+ * Without limits, a flood of Initial packets, each creating connection state,
+ * grows memory until the operating system steps in and kills the process.
+ * The budget allocator shown here wraps any tcp2 allocator and enforces two
+ * kinds of byte limits, both globally and per type id:
+ * - A hard limit: allocations that would exceed it fail, and tcp2 handles the
+ *   failure like any other allocation failure
+ * - A soft limit: crossing it does not fail anything, but notifies the engine
+ *   so that it can shed load before the hard limit is reached, for example by
+ *   refusing new connections, shrinking receive windows or dropping 0-RTT
+ *   data.  The engine is notified again when usage falls back below the soft
+ *   limit.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - Limits are shared by all threads, but updating shared counters on every
+ *   alloc and free would make them a point of contention.  Instead, a budget
+ *   is split into a shared part, the budget, and a per-thread part, the budget
+ *   allocator.  Threads reserve credit from the shared counters in chunks of
+ *   TCP2_BUDGET_CREDIT bytes and consume it locally.  Only reserving and
+ *   returning credit touches the shared counters.
+ * - The shared counters count reserved bytes, so they never exceed a hard
+ *   limit.  Credit held by one thread is not available to others, so an
+ *   allocation may fail up to (threads * TCP2_BUDGET_CREDIT) bytes before a
+ *   hard limit is reached.  Limits are expected to be far larger than that.
+ * - Bytes are counted as requested by tcp2, not as consumed by the wrapped
+ *   allocator including its overheads.
+ * - Per type limits exist for type ids below TCP2_BUDGET_MAX_TYPES.  All other
+ *   type ids, including 0, only count against the global limits.
+ * - The pressure callback is called on whichever thread crossed the soft
+ *   limit, from within an alloc or free.  It must be quick and must not
+ *   allocate through the budget.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * The chunk size in which threads reserve and return credit.
+ */
+#define TCP2_BUDGET_CREDIT          (64 * 1024)
+
+/*
+ * Type ids at or above this value only count against the global limits.
+ */
+#define TCP2_BUDGET_MAX_TYPES       64
+
+/*
+ * A limit of zero means unlimited.
+ */
+#define TCP2_BUDGET_UNLIMITED       0
+
+/*
+ * Pressure levels passed to the pressure callback.
+ */
+#define TCP2_BUDGET_NORMAL          0
+#define TCP2_BUDGET_SOFT_LIMIT      1
+
+
+
+/*
+ * The shared accounting of the global budget, or of one type id.
+ */
+struct tcp2_budget_account {
+  size_t soft_limit;
+  size_t hard_limit;
+
+  _Atomic size_t reserved;
+
+  /*
+   * Set while reserved is above the soft limit, so that every crossing is
+   * reported exactly once.  Crossings are reported under crossing_lock, so
+   * that their reports arrive in order.
+   */
+  _Atomic int over_soft_limit;
+  atomic_flag crossing_lock;
+};
+
+/*
+ * Budget.
+ *
+ * Shared between all threads.  Limits are set before any budget allocators
+ * are created.
+ */
+struct tcp2_budget {
+  struct tcp2_budget_account global;
+  struct tcp2_budget_account types[TCP2_BUDGET_MAX_TYPES];
+
+  /*
+   * Called when an account crosses its soft limit in either direction.  The
+   * type is 0 for the global account.
+   */
+  void (*on_pressure)(void *user_data, uint64_t type, int pressure);
+  void *user_data;
+};
+
+/*
+ * Budget allocator.
+ *
+ * The per-thread part of a budget.  Holds the credit the thread has reserved
+ * but not yet used.
+ */
+struct tcp2_budget_allocator {
+  struct tcp2_allocator tcp2_allocator;
+
+  const struct tcp2_allocator *backing;
+
+  struct tcp2_budget *budget;
+
+  size_t global_credit;
+  size_t type_credit[TCP2_BUDGET_MAX_TYPES];
+};
+
+
+
+/*
+ * Report soft limit crossings of an account, after reserved was changed to
+ * 'reserved' by the caller.
+ *
+ * The common case, no crossing, costs a load.  A crossing takes the lock of
+ * the account and, until the flag agrees with a fresh read of reserved,
+ * flips it and reports, so that concurrent reserves and releases can never
+ * leave the flag, or the last report, disagreeing with the usage.  Reserved
+ * and the flag are accessed sequentially consistent: a thread that sees the
+ * flag agree with its own change returns, and the lock holder is then bound
+ * to see that change on its next read.
+ */
+static void tcp2_budget_check_soft_limit(struct tcp2_budget *budget,
+                                         struct tcp2_budget_account *account,
+                                         uint64_t type, size_t reserved) {
+  if (account->soft_limit == TCP2_BUDGET_UNLIMITED)
+    return;
+
+  if (atomic_load(&account->over_soft_limit) ==
+      (reserved > account->soft_limit)) {
+    return;
+  }
+
+  while (atomic_flag_test_and_set_explicit(&account->crossing_lock,
+                                           memory_order_acquire))
+    ;
+
+  for (;;) {
+    int over = atomic_load(&account->reserved) > account->soft_limit;
+
+    if (atomic_load(&account->over_soft_limit) == over)
+      break;
+
+    atomic_store(&account->over_soft_limit, over);
+
+    if (budget->on_pressure) {
+      budget->on_pressure(budget->user_data, type,
+                          over ? TCP2_BUDGET_SOFT_LIMIT : TCP2_BUDGET_NORMAL);
+    }
+  }
+
+  atomic_flag_clear_explicit(&account->crossing_lock, memory_order_release);
+}
+
+/*
+ * Reserve bytes from a shared account.  A compare and swap loop, so that the
+ * shared counter never exceeds the hard limit, not even for a moment, and
+ * concurrent reservations never fail on each other's overshoot.
+ *
+ * Returns:
+ * 0 on success, -1 if the reservation would exceed the hard limit, in which
+ * case nothing is reserved.
+ */
+static int tcp2_budget_reserve(struct tcp2_budget *budget,
+                               struct tcp2_budget_account *account,
+                               uint64_t type, size_t bytes) {
+  size_t reserved = atomic_load_explicit(&account->reserved,
+                                         memory_order_relaxed);
+
+  do {
+    if ((account->hard_limit != TCP2_BUDGET_UNLIMITED) &&
+        (bytes > account->hard_limit - reserved))
+      return -1;
+  } while (!atomic_compare_exchange_weak(&account->reserved, &reserved,
+                                         reserved + bytes));
+
+  tcp2_budget_check_soft_limit(budget, account, type, reserved + bytes);
+
+  return 0;
+}
+
+static void tcp2_budget_release(struct tcp2_budget *budget,
+                                struct tcp2_budget_account *account,
+                                uint64_t type, size_t bytes) {
+  size_t reserved = atomic_fetch_sub(&account->reserved, bytes) - bytes;
+
+  tcp2_budget_check_soft_limit(budget, account, type, reserved);
+}
+
+/*
+ * Take credit for an allocation, reserving more from the shared account when
+ * the thread has run out.
+ */
+static int tcp2_budget_take(struct tcp2_budget *budget,
+                            struct tcp2_budget_account *account,
+                            uint64_t type, size_t *credit, size_t size) {
+  if (*credit < size) {
+    size_t bytes = (size > TCP2_BUDGET_CREDIT) ? size : TCP2_BUDGET_CREDIT;
+
+    if (tcp2_budget_reserve(budget, account, type, bytes)) {
+      /*
+       * Try again without reserving ahead, the limit may still allow the
+       * allocation itself.
+       */
+      bytes = size - *credit;
+      if (tcp2_budget_reserve(budget, account, type, bytes))
+        return -1;
+    }
+
+    *credit += bytes;
+  }
+
+  *credit -= size;
+
+  return 0;
+}
+
+/*
+ * Give credit back after a free, returning any excess to the shared account
+ * so that other threads may use it.
+ */
+static void tcp2_budget_give(struct tcp2_budget *budget,
+                             struct tcp2_budget_account *account,
+                             uint64_t type, size_t *credit, size_t size) {
+  *credit += size;
+
+  if (*credit > 2 * TCP2_BUDGET_CREDIT) {
+    size_t excess = *credit - TCP2_BUDGET_CREDIT;
+
+    tcp2_budget_release(budget, account, type, excess);
+    *credit -= excess;
+  }
+}
+
+
+
+/*
+ * The definitions of the budget alloc and free functions.
+ */
+static void *tcp2_budget_alloc(const struct tcp2_allocator *allocator,
+                               uint64_t type, size_t size) {
+  struct tcp2_budget_allocator *budget_allocator =
+    (struct tcp2_budget_allocator *)allocator;
+  struct tcp2_budget *budget = budget_allocator->budget;
+
+  int typed = (type != 0) && (type < TCP2_BUDGET_MAX_TYPES);
+
+  if (typed &&
+      tcp2_budget_take(budget, &budget->types[type], type,
+                       &budget_allocator->type_credit[type], size)) {
+    return NULL;
+  }
+
+  if (tcp2_budget_take(budget, &budget->global, 0,
+                       &budget_allocator->global_credit, size)) {
+    if (typed) {
+      tcp2_budget_give(budget, &budget->types[type], type,
+                       &budget_allocator->type_credit[type], size);
+    }
+    return NULL;
+  }
+
+  void *obj = tcp2_allocator_alloc(budget_allocator->backing, type, size);
+  if (!obj) {
+    tcp2_budget_give(budget, &budget->global, 0,
+                     &budget_allocator->global_credit, size);
+    if (typed) {
+      tcp2_budget_give(budget, &budget->types[type], type,
+                       &budget_allocator->type_credit[type], size);
+    }
+  }
+
+  return obj;
+}
+
+static void tcp2_budget_free(const struct tcp2_allocator *allocator,
+                             uint64_t type, size_t size, void *obj) {
+  struct tcp2_budget_allocator *budget_allocator =
+    (struct tcp2_budget_allocator *)allocator;
+  struct tcp2_budget *budget = budget_allocator->budget;
+
+  tcp2_allocator_free(budget_allocator->backing, type, size, obj);
+
+  tcp2_budget_give(budget, &budget->global, 0,
+                   &budget_allocator->global_credit, size);
+
+  if ((type != 0) && (type < TCP2_BUDGET_MAX_TYPES)) {
+    tcp2_budget_give(budget, &budget->types[type], type,
+                     &budget_allocator->type_credit[type], size);
+  }
+}
+
+/*
+ * Budgets count live bytes, which a trim does not change.
+ */
+static size_t tcp2_budget_trim(const struct tcp2_allocator *allocator,
+                               size_t target) {
+  const struct tcp2_budget_allocator *budget_allocator =
+    (const struct tcp2_budget_allocator *)allocator;
+
+  return tcp2_allocator_trim(budget_allocator->backing, target);
+}
+
+
+
+/*
+ * The global operations structure to hold references to budget alloc and
+ * free.
+ */
+static struct tcp2_allocator_operations tcp2_budget_allocator_operations = {
+  .alloc = tcp2_budget_alloc,
+  .free = tcp2_budget_free,
+  .trim = tcp2_budget_trim,
+};
+
+
+
+/*
+ * Create a budget, without any limits.  The budget structure itself is not
+ * accounted for.
+ */
+struct tcp2_budget *tcp2_create_budget(
+    void (*on_pressure)(void *user_data, uint64_t type, int pressure),
+    void *user_data) {
+  struct tcp2_budget *budget =
+    tcp2_allocator_alloc(tcp2_get_trivial_allocator(),
+                         0, sizeof(struct tcp2_budget));
+  if (!budget)
+    return NULL;
+
+  memset(budget, 0, sizeof(struct tcp2_budget));
+
+  atomic_flag_clear(&budget->global.crossing_lock);
+  for (uint64_t type = 1; type < TCP2_BUDGET_MAX_TYPES; type++)
+    atomic_flag_clear(&budget->types[type].crossing_lock);
+
+  budget->on_pressure = on_pressure;
+  budget->user_data = user_data;
+
+  return budget;
+}
+
+/*
+ * Set the limits of a budget.
+ *
+ * Arguments:
+ * budget: the budget
+ *
+ * type: the type id to limit, or 0 for the global limits
+ *
+ * soft_limit: bytes above which the engine is asked to shed load, or
+ *             TCP2_BUDGET_UNLIMITED
+ *
+ * hard_limit: bytes above which allocations fail, or TCP2_BUDGET_UNLIMITED
+ *
+ * Returns:
+ * 0 on success, -1 if the type id cannot be limited.
+ */
+int tcp2_budget_set_limits(struct tcp2_budget *budget, uint64_t type,
+                           size_t soft_limit, size_t hard_limit) {
+  if (type >= TCP2_BUDGET_MAX_TYPES)
+    return -1;
+
+  struct tcp2_budget_account *account =
+    (type == 0) ? &budget->global : &budget->types[type];
+
+  account->soft_limit = soft_limit;
+  account->hard_limit = hard_limit;
+
+  return 0;
+}
+
+void tcp2_destroy_budget(struct tcp2_budget *budget) {
+  tcp2_allocator_free(tcp2_get_trivial_allocator(),
+                      0, sizeof(struct tcp2_budget), budget);
+}
+
+
+
+/*
+ * Create a budget allocator for the calling thread.
+ *
+ * Arguments:
+ * budget: the shared budget
+ *
+ * backing: the allocator of the thread, which does the actual allocation
+ *
+ * Returns:
+ * A new budget allocator, or NULL upon failure.
+ */
+struct tcp2_budget_allocator *tcp2_create_budget_allocator(
+    struct tcp2_budget *budget,
+    const struct tcp2_allocator *backing) {
+  struct tcp2_budget_allocator *budget_allocator =
+    tcp2_allocator_alloc(backing, 0, sizeof(struct tcp2_budget_allocator));
+  if (!budget_allocator)
+    return NULL;
+
+  memset(budget_allocator, 0, sizeof(struct tcp2_budget_allocator));
+
+  budget_allocator->tcp2_allocator.operations =
+    &tcp2_budget_allocator_operations;
+  budget_allocator->backing = backing;
+  budget_allocator->budget = budget;
+
+  return budget_allocator;
+}
+
+/*
+ * Budget allocator destructor.  Unused credit is returned to the budget.
+ */
+void tcp2_destroy_budget_allocator(
+    struct tcp2_budget_allocator *budget_allocator) {
+  struct tcp2_budget *budget = budget_allocator->budget;
+
+  tcp2_budget_release(budget, &budget->global, 0,
+                      budget_allocator->global_credit);
+
+  for (uint64_t type = 1; type < TCP2_BUDGET_MAX_TYPES; ++type) {
+    if (budget_allocator->type_credit[type] > 0) {
+      tcp2_budget_release(budget, &budget->types[type], type,
+                          budget_allocator->type_credit[type]);
+    }
+  }
+
+  tcp2_allocator_free(budget_allocator->backing,
+                      0, sizeof(struct tcp2_budget_allocator),
+                      budget_allocator);
+}
+
+
+
+
+
+
+/*
+ * The following shows how the tcp2 engine sheds load when the budget of the
+ * system context is under pressure.
+ *
+ * Load shedding measures, as flags held by the system context:
+ */
+#define TCP2_SHED_NEW_CONNECTIONS   (1 << 0)
+#define TCP2_SHED_RECEIVE_WINDOWS   (1 << 1)
+#define TCP2_SHED_0RTT              (1 << 2)
+#define TCP2_SHED_MEASURES          3
+
+struct tcp2_system_context {
+  /*
+   * Other global state, see allocators_3.c.
+   */
+
+  struct tcp2_budget *budget;
+
+  /*
+   * For each measure, the number of accounts currently over their soft limit
+   * that call for it.  Several accounts may call for the same measure, and
+   * it stays in effect until all of them are back to normal.
+   */
+  _Atomic int shedding[TCP2_SHED_MEASURES];
+};
+
+/*
+ * The load shedding measures currently in effect.
+ */
+static int tcp2_system_context_shedding(
+    struct tcp2_system_context *tcp2_system_context) {
+  int measures = 0;
+
+  for (int i = 0; i < TCP2_SHED_MEASURES; ++i) {
+    if (atomic_load_explicit(&tcp2_system_context->shedding[i],
+                             memory_order_relaxed) > 0) {
+      measures |= 1 << i;
+    }
+  }
+
+  return measures;
+}
+
+/*
+ * The pressure callback installed by the system context.  Pressure on
+ * connection state, or global pressure, stops new connections from being
+ * accepted and drops 0-RTT data, which a client is able to resend.  Pressure
+ * on stream data shrinks the receive windows advertised to peers, which slows
+ * them down without failing anything.
+ */
+static void tcp2_system_context_on_pressure(void *user_data,
+                                            uint64_t type, int pressure) {
+  struct tcp2_system_context *tcp2_system_context = user_data;
+  int measures;
+
+  switch (type) {
+  case 0:
+    measures = TCP2_SHED_NEW_CONNECTIONS | TCP2_SHED_0RTT |
+               TCP2_SHED_RECEIVE_WINDOWS;
+    break;
+  case TCP2_TYPE_CONNECTION:
+  case TCP2_TYPE_ARENA_CHUNK:
+  case TCP2_TYPE_HANDSHAKE_STATE:
+  case TCP2_TYPE_CRYPTO_CONTEXT:
+    measures = TCP2_SHED_NEW_CONNECTIONS | TCP2_SHED_0RTT;
+    break;
+  case TCP2_TYPE_STREAM:
+  case TCP2_TYPE_STREAM_TABLE:
+    measures = TCP2_SHED_RECEIVE_WINDOWS;
+    break;
+  default:
+    return;
+  }
+
+  /*
+   * Every account reports each crossing exactly once, in either direction,
+   * so counting them keeps a measure in effect while any account needs it.
+   */
+  int delta = (pressure == TCP2_BUDGET_SOFT_LIMIT) ? 1 : -1;
+
+  for (int i = 0; i < TCP2_SHED_MEASURES; ++i) {
+    if (measures & (1 << i)) {
+      atomic_fetch_add_explicit(&tcp2_system_context->shedding[i], delta,
+                                memory_order_relaxed);
+    }
+  }
+}
+
+/*
+ * Set memory limits for a system context.  Must be called before any thread
+ * contexts are created.  Each thread context then wraps its allocator in a
+ * budget allocator for the system context budget.
+ */
+int tcp2_system_context_set_memory_limits(
+    struct tcp2_system_context *tcp2_system_context,
+    uint64_t type, size_t soft_limit, size_t hard_limit) {
+  if (!tcp2_system_context->budget) {
+    tcp2_system_context->budget =
+      tcp2_create_budget(&tcp2_system_context_on_pressure,
+                         tcp2_system_context);
+    if (!tcp2_system_context->budget)
+      return -1;
+  }
+
+  return tcp2_budget_set_limits(tcp2_system_context->budget,
+                                type, soft_limit, hard_limit);
+}
+
+/*
+ * Handling of an Initial packet that would create a new connection.  While
+ * shedding, no connection state is allocated at all; the client is refused
+ * statelessly.
+ */
+static void tcp2_on_initial_packet(
+    struct tcp2_thread_context *tcp2_thread_context,
+    const struct tcp2_packet *packet) {
+  int shedding =
+    tcp2_system_context_shedding(tcp2_thread_context->system_context);
+
+  if (shedding & TCP2_SHED_NEW_CONNECTIONS) {
+    tcp2_send_stateless_refusal(tcp2_thread_context, packet);
+    return;
+  }
+
+  struct tcp2_connection *connection =
+    tcp2_create_connection(tcp2_thread_context);
+  if (!connection) {
+    /*
+     * A hard limit was reached.
+     */
+    tcp2_send_stateless_refusal(tcp2_thread_context, packet);
+    return;
+  }
+
+  if (shedding & TCP2_SHED_0RTT)
+    tcp2_connection_reject_0rtt(connection);
+
+  tcp2_connection_on_initial(connection, packet);
+}
+
+
+
+/*
+ * Finally, an application limiting connection state to 512 MiB, with load
+ * shedding starting at 384 MiB, and all of tcp2 to 2 GiB.  Connection state
+ * lives in per-connection arenas (allocators_5.c), so it is the arena chunks
+ * that are limited.
+ */
+void app_configure_tcp2_memory(
+    struct tcp2_system_context *tcp2_system_context) {
+  tcp2_system_context_set_memory_limits(tcp2_system_context,
+                                        TCP2_TYPE_ARENA_CHUNK,
+                                        384 * 1024 * 1024,
+                                        512 * 1024 * 1024);
+
+  tcp2_system_context_set_memory_limits(tcp2_system_context, 0,
+                                        (size_t)1536 * 1024 * 1024,
+                                        (size_t)2048 * 1024 * 1024);
+}
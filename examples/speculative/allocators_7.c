@@ -0,0 +1,461 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+
+/*
+ * This case study builds on allocators_1.c and demonstrates another of the
+ * goals listed there: producing statistics or telemetry.
+ *
+ * The telemetry allocator wraps any tcp2 allocator and counts, per type id:
+ * - the number of allocations and frees, from which the number of live
+ *   objects and the allocation rate are derived
+ * - the number of live bytes and the high water mark of live bytes
+ * - a histogram of requested sizes, which is mostly of interest for the
+ *   dynamically sized regions of type id 0
+ *
+ * The counters are kept per thread and are only ever written by the thread
+ * that owns them, so the hot path contains no shared atomic operations.  A
+ * snapshot API on the system context merges the counters of all threads when
+ * they are read.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - Each counter has a single writer, the owning thread, and any number of
+ *   readers.  Counters are atomics accessed with relaxed loads and stores, no
+ *   read-modify-write, which compiles to plain loads and stores on common
+ *   platforms while keeping concurrent reads well defined.
+ * - A snapshot is not an atomic picture of the whole system: counters of
+ *   different threads, and different counters of one thread, are read at
+ *   slightly different times.  This is acceptable for telemetry.
+ * - High water marks are tracked per thread.  The merged high water mark is
+ *   the sum of the per-thread marks, which is an upper bound of the true
+ *   system wide high water mark, as threads rarely peak at the same time.
+ * - Frees must be made on the owning thread.  When objects are freed on other
+ *   threads, the telemetry allocator is placed underneath the remote free
+ *   allocator of allocators_4.c, which moves those frees to the owner.
+ * - Counters of threads that have exited are folded into the system context,
+ *   so that totals never go backwards.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * Type ids at or above this value are counted together, in the last slot.
+ */
+#define TCP2_TELEMETRY_MAX_TYPES    64
+#define TCP2_TELEMETRY_OTHER        TCP2_TELEMETRY_MAX_TYPES
+
+/*
+ * Size histogram buckets.  Bucket n counts requests of up to 2^n bytes, the
+ * last bucket counts everything larger.
+ */
+#define TCP2_TELEMETRY_BUCKETS      24
+
+
+
+/*
+ * The counters of one type id, written by a single thread.
+ */
+struct tcp2_telemetry_counters {
+  _Atomic uint64_t allocs;
+  _Atomic uint64_t frees;
+  _Atomic uint64_t live_bytes;
+  _Atomic uint64_t high_water_bytes;
+  _Atomic uint64_t sizes[TCP2_TELEMETRY_BUCKETS];
+};
+
+/*
+ * Telemetry allocator.
+ *
+ * One per thread, linked into the registry of its system context.
+ */
+struct tcp2_telemetry_allocator {
+  struct tcp2_allocator tcp2_allocator;
+
+  const struct tcp2_allocator *backing;
+
+  struct tcp2_system_context *system_context;
+
+  struct tcp2_telemetry_allocator *prev;
+  struct tcp2_telemetry_allocator *next;
+
+  struct tcp2_telemetry_counters counters[TCP2_TELEMETRY_MAX_TYPES + 1];
+};
+
+/*
+ * The merged statistics of one type id, as returned in a snapshot.
+ */
+struct tcp2_alloc_type_stats {
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t live_count;
+  uint64_t live_bytes;
+  uint64_t high_water_bytes;
+  uint64_t sizes[TCP2_TELEMETRY_BUCKETS];
+};
+
+/*
+ * A snapshot of the allocation statistics of a system context.  The time at
+ * which it was taken allows rates to be computed from two snapshots.
+ */
+struct tcp2_alloc_stats {
+  struct timespec taken;
+
+  struct tcp2_alloc_type_stats types[TCP2_TELEMETRY_MAX_TYPES + 1];
+};
+
+/*
+ * The system context keeps the registry of telemetry allocators, and the
+ * folded counters of the ones that have been destroyed.
+ */
+struct tcp2_system_context {
+  /*
+   * Other global state, see allocators_3.c.
+   */
+
+  struct tcp2_mutex telemetry_lock;
+  struct tcp2_telemetry_allocator *telemetry_allocators;
+  struct tcp2_alloc_stats telemetry_retired;
+};
+
+
+
+/*
+ * Single writer counter updates.
+ */
+static inline uint64_t tcp2_telemetry_read(_Atomic uint64_t *counter) {
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static inline void tcp2_telemetry_write(_Atomic uint64_t *counter,
+                                        uint64_t value) {
+  atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+static inline void tcp2_telemetry_add(_Atomic uint64_t *counter,
+                                      uint64_t value) {
+  tcp2_telemetry_write(counter, tcp2_telemetry_read(counter) + value);
+}
+
+static inline unsigned tcp2_telemetry_bucket(size_t size) {
+  if (size <= 1)
+    return 0;
+
+  unsigned bucket = 64 - __builtin_clzll((unsigned long long)(size - 1));
+  if (bucket >= TCP2_TELEMETRY_BUCKETS)
+    bucket = TCP2_TELEMETRY_BUCKETS - 1;
+
+  return bucket;
+}
+
+static inline struct tcp2_telemetry_counters *tcp2_telemetry_counters_of(
+    struct tcp2_telemetry_allocator *telemetry_allocator, uint64_t type) {
+  if (type >= TCP2_TELEMETRY_MAX_TYPES)
+    type = TCP2_TELEMETRY_OTHER;
+
+  return &telemetry_allocator->counters[type];
+}
+
+
+
+/*
+ * The definitions of the telemetry alloc and free functions.  Failed
+ * allocations are not counted.
+ */
+static void *tcp2_telemetry_alloc(const struct tcp2_allocator *allocator,
+                                  uint64_t type, size_t size) {
+  struct tcp2_telemetry_allocator *telemetry_allocator =
+    (struct tcp2_telemetry_allocator *)allocator;
+
+  void *obj = tcp2_allocator_alloc(telemetry_allocator->backing, type, size);
+  if (!obj)
+    return NULL;
+
+  struct tcp2_telemetry_counters *counters =
+    tcp2_telemetry_counters_of(telemetry_allocator, type);
+
+  tcp2_telemetry_add(&counters->allocs, 1);
+  tcp2_telemetry_add(&counters->sizes[tcp2_telemetry_bucket(size)], 1);
+
+  uint64_t live_bytes = tcp2_telemetry_read(&counters->live_bytes) + size;
+  tcp2_telemetry_write(&counters->live_bytes, live_bytes);
+  if (live_bytes > tcp2_telemetry_read(&counters->high_water_bytes))
+    tcp2_telemetry_write(&counters->high_water_bytes, live_bytes);
+
+  return obj;
+}
+
+static void tcp2_telemetry_free(const struct tcp2_allocator *allocator,
+                                uint64_t type, size_t size, void *obj) {
+  struct tcp2_telemetry_allocator *telemetry_allocator =
+    (struct tcp2_telemetry_allocator *)allocator;
+
+  tcp2_allocator_free(telemetry_allocator->backing, type, size, obj);
+
+  struct tcp2_telemetry_counters *counters =
+    tcp2_telemetry_counters_of(telemetry_allocator, type);
+
+  tcp2_telemetry_add(&counters->frees, 1);
+  tcp2_telemetry_write(&counters->live_bytes,
+                       tcp2_telemetry_read(&counters->live_bytes) - size);
+}
+
+static size_t tcp2_telemetry_trim(const struct tcp2_allocator *allocator,
+                                  size_t target) {
+  const struct tcp2_telemetry_allocator *telemetry_allocator =
+    (const struct tcp2_telemetry_allocator *)allocator;
+
+  return tcp2_allocator_trim(telemetry_allocator->backing, target);
+}
+
+
+
+/*
+ * The global operations structure to hold references to telemetry alloc and
+ * free.
+ */
+static struct tcp2_allocator_operations
+  tcp2_telemetry_allocator_operations = {
+  .alloc = tcp2_telemetry_alloc,
+  .free = tcp2_telemetry_free,
+  .trim = tcp2_telemetry_trim,
+};
+
+
+
+/*
+ * Add the counters of one telemetry allocator to a snapshot.
+ */
+static void tcp2_telemetry_merge(
+    struct tcp2_alloc_stats *tcp2_alloc_stats,
+    struct tcp2_telemetry_allocator *telemetry_allocator) {
+  for (int type = 0; type <= TCP2_TELEMETRY_MAX_TYPES; ++type) {
+    struct tcp2_telemetry_counters *counters =
+      &telemetry_allocator->counters[type];
+    struct tcp2_alloc_type_stats *stats = &tcp2_alloc_stats->types[type];
+
+    stats->allocs += tcp2_telemetry_read(&counters->allocs);
+    stats->frees += tcp2_telemetry_read(&counters->frees);
+    stats->live_bytes += tcp2_telemetry_read(&counters->live_bytes);
+    stats->high_water_bytes +=
+      tcp2_telemetry_read(&counters->high_water_bytes);
+
+    for (int bucket = 0; bucket < TCP2_TELEMETRY_BUCKETS; ++bucket)
+      stats->sizes[bucket] += tcp2_telemetry_read(&counters->sizes[bucket]);
+  }
+}
+
+/*
+ * Create a telemetry allocator for the calling thread and register it with
+ * the system context.
+ *
+ * Arguments:
+ * tcp2_system_context: the system context whose snapshots will include the
+ *                      counters of this allocator
+ *
+ * backing: the allocator of the thread, which does the actual allocation
+ *
+ * Returns:
+ * A new telemetry allocator, or NULL upon failure.
+ */
+struct tcp2_telemetry_allocator *tcp2_create_telemetry_allocator(
+    struct tcp2_system_context *tcp2_system_context,
+    const struct tcp2_allocator *backing) {
+  struct tcp2_telemetry_allocator *telemetry_allocator =
+    tcp2_allocator_alloc(backing,
+                         0, sizeof(struct tcp2_telemetry_allocator));
+  if (!telemetry_allocator)
+    return NULL;
+
+  memset(telemetry_allocator, 0, sizeof(struct tcp2_telemetry_allocator));
+
+  telemetry_allocator->tcp2_allocator.operations =
+    &tcp2_telemetry_allocator_operations;
+  telemetry_allocator->backing = backing;
+  telemetry_allocator->system_context = tcp2_system_context;
+
+  tcp2_mutex_lock(&tcp2_system_context->telemetry_lock);
+
+  telemetry_allocator->next = tcp2_system_context->telemetry_allocators;
+  if (telemetry_allocator->next)
+    telemetry_allocator->next->prev = telemetry_allocator;
+  tcp2_system_context->telemetry_allocators = telemetry_allocator;
+
+  tcp2_mutex_unlock(&tcp2_system_context->telemetry_lock);
+
+  return telemetry_allocator;
+}
+
+/*
+ * Telemetry allocator destructor.  Its counters are folded into the system
+ * context before it is unregistered.
+ */
+void tcp2_destroy_telemetry_allocator(
+    struct tcp2_telemetry_allocator *telemetry_allocator) {
+  struct tcp2_system_context *tcp2_system_context =
+    telemetry_allocator->system_context;
+
+  tcp2_mutex_lock(&tcp2_system_context->telemetry_lock);
+
+  tcp2_telemetry_merge(&tcp2_system_context->telemetry_retired,
+                       telemetry_allocator);
+
+  if (telemetry_allocator->prev)
+    telemetry_allocator->prev->next = telemetry_allocator->next;
+  else
+    tcp2_system_context->telemetry_allocators = telemetry_allocator->next;
+
+  if (telemetry_allocator->next)
+    telemetry_allocator->next->prev = telemetry_allocator->prev;
+
+  tcp2_mutex_unlock(&tcp2_system_context->telemetry_lock);
+
+  tcp2_allocator_free(telemetry_allocator->backing,
+                      0, sizeof(struct tcp2_telemetry_allocator),
+                      telemetry_allocator);
+}
+
+
+
+/*
+ * Take a snapshot of the allocation statistics of all threads of a system
+ * context.  May be called from any thread, the threads being measured are
+ * never stopped or locked.
+ *
+ * Arguments:
+ * tcp2_system_context: the system context
+ *
+ * tcp2_alloc_stats: receives the merged statistics.  Type ids at or above
+ *                   TCP2_TELEMETRY_MAX_TYPES are merged into the entry at
+ *                   TCP2_TELEMETRY_OTHER.
+ */
+void tcp2_system_context_get_alloc_stats(
+    struct tcp2_system_context *tcp2_system_context,
+    struct tcp2_alloc_stats *tcp2_alloc_stats) {
+  tcp2_mutex_lock(&tcp2_system_context->telemetry_lock);
+
+  *tcp2_alloc_stats = tcp2_system_context->telemetry_retired;
+
+  for (struct tcp2_telemetry_allocator *telemetry_allocator =
+         tcp2_system_context->telemetry_allocators;
+       telemetry_allocator;
+       telemetry_allocator = telemetry_allocator->next) {
+    tcp2_telemetry_merge(tcp2_alloc_stats, telemetry_allocator);
+  }
+
+  tcp2_mutex_unlock(&tcp2_system_context->telemetry_lock);
+
+  for (int type = 0; type <= TCP2_TELEMETRY_MAX_TYPES; ++type) {
+    struct tcp2_alloc_type_stats *stats = &tcp2_alloc_stats->types[type];
+
+    /*
+     * Allocs are read before frees, so the frees read may include frees of
+     * allocations counted after the allocs were read, and outnumber them.
+     */
+    stats->live_count =
+      (stats->allocs > stats->frees) ? stats->allocs - stats->frees : 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &tcp2_alloc_stats->taken);
+}
+
+/*
+ * The allocation rate of a type id, in allocations per second, between two
+ * snapshots.
+ */
+double tcp2_alloc_stats_rate(const struct tcp2_alloc_stats *earlier,
+                             const struct tcp2_alloc_stats *later,
+                             uint64_t type) {
+  if (type >= TCP2_TELEMETRY_MAX_TYPES)
+    type = TCP2_TELEMETRY_OTHER;
+
+  double seconds =
+    (double)(later->taken.tv_sec - earlier->taken.tv_sec) +
+    (double)(later->taken.tv_nsec - earlier->taken.tv_nsec) / 1e9;
+  if (seconds <= 0)
+    return 0;
+
+  return (double)(later->types[type].allocs - earlier->types[type].allocs) /
+         seconds;
+}
+
+
+
+
+
+
+/*
+ * Finally, an application that logs which object types grow, once a minute.
+ */
+void app_on_telemetry_timer(struct app_context *app_context) {
+  struct tcp2_system_context *tcp2_system_context =
+    app_retrieve_tcp2_system_context();
+
+  struct tcp2_alloc_stats *previous = app_get_previous_stats(app_context);
+  struct tcp2_alloc_stats *current = app_get_current_stats(app_context);
+
+  tcp2_system_context_get_alloc_stats(tcp2_system_context, current);
+
+  for (uint64_t type = 0; type <= TCP2_TELEMETRY_MAX_TYPES; ++type) {
+    if (current->types[type].live_bytes > previous->types[type].live_bytes) {
+      app_log(app_context,
+              "type %llu: %llu live objects, %llu live bytes, "
+              "%llu high water bytes, %.0f allocs/s",
+              (unsigned long long)type,
+              (unsigned long long)current->types[type].live_count,
+              (unsigned long long)current->types[type].live_bytes,
+              (unsigned long long)current->types[type].high_water_bytes,
+              tcp2_alloc_stats_rate(previous, current, type));
+    }
+  }
+
+  app_swap_stats(app_context);
+}
@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+
+/*
+ * This case study builds on the previous allocator case studies and
+ * demonstrates a registry of all of the type ids used by tcp2.
+ *
+ * allocators_1.c states that type ids will be defined in header files
+ * alongside their object definitions.  Spread out like that, nothing knows
+ * the full set of type ids, so an allocator can only learn about sizes from
+ * the size arguments it receives at runtime, and every allocator that wants
+ * to treat types differently needs its own registration calls.
+ *
+ * The registry is a single list, expanded at compile time into:
+ * - the type id constants themselves
+ * - a constant table holding the size, alignment and zeroing policy of every
+ *   type id, which allocators use to build their slab classes, magazines and
+ *   zeroing tables once at initialisation
+ * - switch based accessors, which the compiler reduces to a constant when the
+ *   type id is known at the call site, as it is for every allocation made by
+ *   tcp2 itself, and to a jump table otherwise
+ *
+ * The list is an X macro: every entry is a call to a macro named by the user
+ * of the list, so each expansion picks the fields it needs.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - Entries are listed in ascending order of type id, without gaps, so that
+ *   the last id plus one is the size of the tables indexed by type id.
+ * - A size of 0 marks a type whose objects vary in size, such as arena chunks
+ *   or stream tables that grow.  Allocators do not build fixed size classes
+ *   for these.
+ * - The registry only covers tcp2 type ids, which are all below 1048576.
+ *   Application type ids remain unknown to tcp2 and are zeroed on alloc, as
+ *   they always were.
+ * - The per allocator tables of the previous case studies are sized for 64
+ *   type ids.  The registry refuses to compile when it outgrows that.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * The registry.
+ *
+ * X(name, id, size, alignment, zeroing policy)
+ *
+ * The zeroing policies are those of allocators_1.c.
+ */
+#define TCP2_TYPES(X) \
+  X(CONNECTION, 1, \
+    sizeof(struct tcp2_connection), \
+    _Alignof(struct tcp2_connection), \
+    TCP2_ZERO_ON_ALLOC) \
+  X(STREAM, 2, \
+    sizeof(struct tcp2_stream), \
+    _Alignof(struct tcp2_stream), \
+    TCP2_ZERO_ON_ALLOC) \
+  X(SENT_PACKET, 3, \
+    sizeof(struct tcp2_sent_packet), \
+    _Alignof(struct tcp2_sent_packet), \
+    TCP2_ZERO_NONE) \
+  X(ACK_RANGE, 4, \
+    sizeof(struct tcp2_ack_range), \
+    _Alignof(struct tcp2_ack_range), \
+    TCP2_ZERO_NONE) \
+  X(TIMER_NODE, 5, \
+    sizeof(struct tcp2_timer_node), \
+    _Alignof(struct tcp2_timer_node), \
+    TCP2_ZERO_NONE) \
+  X(SLAB, 6, \
+    TCP2_SLAB_SIZE, \
+    TCP2_SLAB_SIZE, \
+    TCP2_ZERO_NONE) \
+  X(MAGAZINE, 7, \
+    sizeof(struct tcp2_magazine), \
+    _Alignof(struct tcp2_magazine), \
+    TCP2_ZERO_NONE) \
+  X(THREAD_CONTEXT, 8, \
+    sizeof(struct tcp2_thread_context), \
+    _Alignof(struct tcp2_thread_context), \
+    TCP2_ZERO_ON_ALLOC) \
+  X(HANDSHAKE_STATE, 9, \
+    sizeof(struct tcp2_handshake_state), \
+    _Alignof(struct tcp2_handshake_state), \
+    TCP2_ZERO_ON_ALLOC | TCP2_ZERO_ON_FREE) \
+  X(TRANSPORT_PARAMETERS, 10, \
+    sizeof(struct tcp2_transport_parameters), \
+    _Alignof(struct tcp2_transport_parameters), \
+    TCP2_ZERO_ON_ALLOC) \
+  X(STREAM_TABLE, 11, \
+    0, \
+    _Alignof(max_align_t), \
+    TCP2_ZERO_ON_ALLOC) \
+  X(CRYPTO_CONTEXT, 12, \
+    sizeof(struct tcp2_crypto_context), \
+    _Alignof(struct tcp2_crypto_context), \
+    TCP2_ZERO_ON_ALLOC | TCP2_ZERO_ON_FREE) \
+  X(ARENA_CHUNK, 13, \
+    0, \
+    TCP2_ARENA_ALIGN, \
+    TCP2_ZERO_NONE) \
+  X(PACKET_BUFFER, 14, \
+    0, \
+    _Alignof(max_align_t), \
+    TCP2_ZERO_NONE) \
+  X(BUFFER, 15, \
+    sizeof(struct tcp2_buffer), \
+    _Alignof(struct tcp2_buffer), \
+    TCP2_ZERO_NONE) \
+  X(SEND_REGION, 16, \
+    sizeof(struct tcp2_send_region), \
+    _Alignof(struct tcp2_send_region), \
+    TCP2_ZERO_NONE)
+
+
+
+/*
+ * The type ids.  TCP2_TYPE_REGISTRY_SIZE follows the last entry, so it is one
+ * more than the highest type id.
+ */
+#define TCP2_TYPE_ENUM(name, id, size, align, zero) \
+  TCP2_TYPE_##name = (id),
+
+enum tcp2_type {
+  TCP2_TYPES(TCP2_TYPE_ENUM)
+  TCP2_TYPE_REGISTRY_SIZE
+};
+
+#undef TCP2_TYPE_ENUM
+
+_Static_assert(TCP2_TYPE_REGISTRY_SIZE <= 64,
+               "allocator tables hold 64 type ids");
+
+/*
+ * Entries must cover every id from 1 up to the last entry, without gaps or
+ * duplicates: the id of every entry must be its position in the registry,
+ * which an enum without explicit values counts.
+ */
+#define TCP2_TYPE_POSITION(name, id, size, align, zero) \
+  TCP2_TYPE_POSITION_##name,
+
+enum tcp2_type_position {
+  TCP2_TYPE_POSITION_DYNAMIC,
+  TCP2_TYPES(TCP2_TYPE_POSITION)
+};
+
+#undef TCP2_TYPE_POSITION
+
+#define TCP2_TYPE_CHECK_ORDER(name, id, size, align, zero) \
+  _Static_assert((int)TCP2_TYPE_##name == (int)TCP2_TYPE_POSITION_##name, \
+                 "type id of " #name " does not match its position");
+
+TCP2_TYPES(TCP2_TYPE_CHECK_ORDER)
+
+#undef TCP2_TYPE_CHECK_ORDER
+
+
+
+/*
+ * The constant table.
+ */
+struct tcp2_type_info {
+  const char *name;
+  size_t size;
+  size_t align;
+  int zero_policy;
+};
+
+#define TCP2_TYPE_INFO(name, id, size, align, zero) \
+  [id] = { #name, (size), (align), (zero) },
+
+static const struct tcp2_type_info
+  tcp2_type_registry[TCP2_TYPE_REGISTRY_SIZE] = {
+  [0] = { "DYNAMIC", 0, _Alignof(max_align_t), TCP2_ZERO_NONE },
+  TCP2_TYPES(TCP2_TYPE_INFO)
+};
+
+#undef TCP2_TYPE_INFO
+
+/*
+ * Look up the registry entry of a type id.
+ *
+ * Returns:
+ * The entry, or NULL for type ids that are not tcp2 type ids.
+ */
+static inline const struct tcp2_type_info *tcp2_type_get_info(uint64_t type) {
+  if (type >= TCP2_TYPE_REGISTRY_SIZE)
+    return NULL;
+
+  return &tcp2_type_registry[type];
+}
+
+
+
+/*
+ * Switch based accessors.  With a constant type id these inline to a
+ * constant, with a variable one the switch becomes a jump table or a table
+ * lookup, without any bounds checks of its own.
+ */
+#define TCP2_TYPE_SIZE_CASE(name, id, size, align, zero) \
+  case (id): return (size);
+
+static inline size_t tcp2_type_size(uint64_t type) {
+  switch (type) {
+  TCP2_TYPES(TCP2_TYPE_SIZE_CASE)
+  default:
+    return 0;
+  }
+}
+
+#undef TCP2_TYPE_SIZE_CASE
+
+#define TCP2_TYPE_ZERO_POLICY_CASE(name, id, size, align, zero) \
+  case (id): return (zero);
+
+static inline int tcp2_type_zero_policy(uint64_t type) {
+  switch (type) {
+  case 0:
+    return TCP2_ZERO_NONE;
+  TCP2_TYPES(TCP2_TYPE_ZERO_POLICY_CASE)
+  default:
+    return TCP2_ZERO_ON_ALLOC;
+  }
+}
+
+#undef TCP2_TYPE_ZERO_POLICY_CASE
+
+
+
+/*
+ * tcp2 internally allocates fixed size objects through these, so the size
+ * argument always matches the registry.
+ */
+#define tcp2_alloc_object(allocator, name) \
+  tcp2_allocator_alloc((allocator), TCP2_TYPE_##name, \
+                       tcp2_type_size(TCP2_TYPE_##name))
+
+#define tcp2_free_object(allocator, name, obj) \
+  tcp2_allocator_free((allocator), TCP2_TYPE_##name, \
+                      tcp2_type_size(TCP2_TYPE_##name), (obj))
+
+
+
+
+
+
+/*
+ * The following shows allocators using the registry.
+ *
+ * The trivial allocator of allocators_1.c builds its zeroing policy table from
+ * the registry, the slab allocator of allocators_2.c builds a slab class for
+ * every fixed size type, and the system context of allocators_3.c registers
+ * every fixed size type with its depot.  The slab and magazine allocators
+ * zero objects according to tcp2_type_zero_policy.
+ */
+
+
+
+/*
+ * An application listing the registry, for example in a debugging aid.
+ */
+void app_dump_tcp2_types(struct app_context *app_context) {
+  for (uint64_t type = 1; type < TCP2_TYPE_REGISTRY_SIZE; ++type) {
+    const struct tcp2_type_info *info = tcp2_type_get_info(type);
+
+    app_log(app_context, "%2llu %-24s size %6zu align %5zu zero %d",
+            (unsigned long long)type, info->name,
+            info->size, info->align, info->zero_policy);
+  }
+}
@@ -0,0 +1,586 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+
+/*
+ * This case study builds on allocators_1.c and allocators_8.c and demonstrates
+ * a pool allocator for packet buffers backed by huge pages.
+ *
+ * Packet bodies are dynamically sized, so until now they have been allocated
+ * with type id 0 and ended up in malloc.  At millions of packets per second,
+ * packet buffers are scattered over a large number of small pages and the TLB
+ * misses caused by touching them become measurable.
+ *
+ * Packet buffers now have their own type id, TCP2_TYPE_PACKET_BUFFER, and
+ * their sizes fall in two classes:
+ * - MTU sized buffers, holding a single datagram
+ * - GSO sized buffers, holding a train of datagrams to be segmented by the
+ *   kernel or network card, or a coalesced train delivered by GRO
+ *
+ * The pool allocator carves fixed size buffers of both classes out of 2 MiB
+ * regions, each mapped as a single huge page where the system allows it and
+ * as regular pages, with transparent huge pages requested, otherwise.  All
+ * regions live inside one contiguous range of address space reserved when the
+ * pool is created, which makes it cheap to tell whether a buffer belongs to
+ * the pool, and leaves the pool as a single range that can later be
+ * registered with the kernel, for example as io_uring fixed buffers.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - A pool is not thread safe, one is created per thread, as with the slab
+ *   allocator of allocators_2.c.
+ * - Reserving the address range maps nothing, it only claims virtual address
+ *   space.  Regions are committed inside it one at a time as they are needed.
+ * - A region serves a single size class, which is decided when the region is
+ *   committed.
+ * - Requests larger than a GSO buffer, requests of other type ids, and all
+ *   requests once the reserved range is exhausted, go to the backing
+ *   allocator.  Frees are routed by address, so a buffer is always returned
+ *   to where it came from.
+ * - Explicit huge pages need to be provisioned by the administrator, through
+ *   vm.nr_hugepages.  Without them the pool still works, with whatever
+ *   transparent huge page support the system offers.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * TCP2_TYPE_PACKET_BUFFER is defined in the type registry, see allocators_8.c.
+ * It is dynamically sized and never zeroed.
+ */
+
+/*
+ * Region size, which is also the huge page size.
+ */
+#define TCP2_POOL_REGION_SHIFT      21
+#define TCP2_POOL_REGION_SIZE       ((size_t)1 << TCP2_POOL_REGION_SHIFT)
+
+/*
+ * The sizes of the two buffer classes.  An MTU buffer holds the largest UDP
+ * payload tcp2 sends or accepts, plus headroom.  A GSO buffer holds the
+ * largest UDP datagram the kernel segments or coalesces.
+ */
+#define TCP2_POOL_MTU_BUFFER_SIZE   2048
+#define TCP2_POOL_GSO_BUFFER_SIZE   (64 * 1024)
+
+#define TCP2_POOL_CLASS_MTU         0
+#define TCP2_POOL_CLASS_GSO         1
+#define TCP2_POOL_CLASSES           2
+
+/*
+ * Default number of regions reserved per pool, 256 MiB of address space.
+ */
+#define TCP2_POOL_DEFAULT_REGIONS   128
+
+
+
+/*
+ * Buffer class.
+ *
+ * Free buffers are kept on a free list threaded through the buffers.  New
+ * buffers are carved from the current region of the class.
+ */
+struct tcp2_pool_class {
+  size_t buffer_size;
+
+  void *free_list;
+
+  char *carve_next;
+  char *carve_end;
+};
+
+/*
+ * Region.
+ *
+ * Kept outside of the region itself, so buffers fill regions exactly.
+ * in_use counts the buffers of the region that are allocated, so that idle
+ * regions can be found when the pool is trimmed.  releasing marks the idle
+ * regions picked by a trim that is in progress.
+ */
+struct tcp2_pool_region {
+  int committed;
+  int huge;
+  int buffer_class;
+  int releasing;
+  uint32_t in_use;
+};
+
+/*
+ * Pool allocator.
+ */
+struct tcp2_pool_allocator {
+  struct tcp2_allocator tcp2_allocator;
+
+  const struct tcp2_allocator *backing;
+
+  /*
+   * The reserved range of address space, aligned to the region size.
+   */
+  char *base;
+  size_t region_count;
+  size_t regions_committed;
+
+  /*
+   * The number of regions below regions_committed that have been released
+   * by a trim and may be committed again.
+   */
+  size_t regions_released;
+
+  struct tcp2_pool_class classes[TCP2_POOL_CLASSES];
+
+  struct tcp2_pool_region *regions;
+
+  /*
+   * The NUMA node regions are committed for, -1 for none.  See
+   * allocators_10.c.
+   */
+  int numa_node;
+};
+
+
+
+/*
+ * Commit the next region of the reserved range to a buffer class.
+ *
+ * Returns:
+ * 0 on success, -1 if the range is exhausted or no memory could be mapped.
+ */
+static int tcp2_pool_commit_region(struct tcp2_pool_allocator *pool_allocator,
+                                   int buffer_class) {
+  size_t index = pool_allocator->regions_committed;
+
+  /*
+   * Regions released by a trim are committed again before the range grows.
+   */
+  if (pool_allocator->regions_released > 0) {
+    for (index = 0; pool_allocator->regions[index].committed; ++index)
+      ;
+  }
+  else
+  if (index == pool_allocator->region_count) {
+    return -1;
+  }
+
+  char *start = pool_allocator->base + (index << TCP2_POOL_REGION_SHIFT);
+  int huge = 1;
+
+  void *mapped = mmap(start, TCP2_POOL_REGION_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED |
+                      MAP_HUGETLB | MAP_HUGE_2MB,
+                      -1, 0);
+  if (mapped == MAP_FAILED) {
+    /*
+     * No huge pages available, fall back to regular pages and ask for
+     * transparent huge pages, which the region alignment makes possible.
+     */
+    huge = 0;
+    mapped = mmap(start, TCP2_POOL_REGION_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (mapped == MAP_FAILED)
+      return -1;
+
+    madvise(mapped, TCP2_POOL_REGION_SIZE, MADV_HUGEPAGE);
+  }
+
+  /*
+   * The new mapping does not inherit any policy of the reserved range, so it
+   * is applied per region, before the region is first touched.
+   */
+  if (pool_allocator->numa_node >= 0)
+    tcp2_numa_bind(pool_allocator->numa_node, mapped, TCP2_POOL_REGION_SIZE);
+
+  struct tcp2_pool_region *region = &pool_allocator->regions[index];
+  region->committed = 1;
+  region->huge = huge;
+  region->buffer_class = buffer_class;
+  region->in_use = 0;
+
+  struct tcp2_pool_class *pool_class = &pool_allocator->classes[buffer_class];
+  pool_class->carve_next = start;
+  pool_class->carve_end = start + TCP2_POOL_REGION_SIZE;
+
+  if (index == pool_allocator->regions_committed)
+    pool_allocator->regions_committed++;
+  else
+    pool_allocator->regions_released--;
+
+  return 0;
+}
+
+/*
+ * Select the buffer class for a request.
+ *
+ * Returns:
+ * The class, or -1 if the request is not served by the pool.
+ */
+static inline int tcp2_pool_class_of(uint64_t type, size_t size) {
+  if (type != TCP2_TYPE_PACKET_BUFFER)
+    return -1;
+
+  if (size <= TCP2_POOL_MTU_BUFFER_SIZE)
+    return TCP2_POOL_CLASS_MTU;
+
+  if (size <= TCP2_POOL_GSO_BUFFER_SIZE)
+    return TCP2_POOL_CLASS_GSO;
+
+  return -1;
+}
+
+static inline int tcp2_pool_owns(
+    const struct tcp2_pool_allocator *pool_allocator, const void *obj) {
+  return ((const char *)obj >= pool_allocator->base) &&
+         ((const char *)obj < pool_allocator->base +
+                              (pool_allocator->region_count <<
+                               TCP2_POOL_REGION_SHIFT));
+}
+
+static inline struct tcp2_pool_region *tcp2_pool_region_of(
+    const struct tcp2_pool_allocator *pool_allocator, const void *obj) {
+  size_t index = (size_t)((const char *)obj - pool_allocator->base) >>
+                 TCP2_POOL_REGION_SHIFT;
+
+  return &pool_allocator->regions[index];
+}
+
+
+
+/*
+ * The definitions of the pool alloc and free functions.
+ */
+static void *tcp2_pool_alloc(const struct tcp2_allocator *allocator,
+                             uint64_t type, size_t size) {
+  struct tcp2_pool_allocator *pool_allocator =
+    (struct tcp2_pool_allocator *)allocator;
+
+  int buffer_class = tcp2_pool_class_of(type, size);
+  if (buffer_class < 0)
+    return tcp2_allocator_alloc(pool_allocator->backing, type, size);
+
+  struct tcp2_pool_class *pool_class = &pool_allocator->classes[buffer_class];
+
+  void *obj = pool_class->free_list;
+  if (obj) {
+    pool_class->free_list = *(void **)obj;
+  }
+  else {
+    if ((pool_class->carve_next == pool_class->carve_end) &&
+        tcp2_pool_commit_region(pool_allocator, buffer_class)) {
+      return tcp2_allocator_alloc(pool_allocator->backing, type, size);
+    }
+
+    obj = pool_class->carve_next;
+    pool_class->carve_next += pool_class->buffer_size;
+  }
+
+  tcp2_pool_region_of(pool_allocator, obj)->in_use++;
+
+  return obj;
+}
+
+static void tcp2_pool_free(const struct tcp2_allocator *allocator,
+                           uint64_t type, size_t size, void *obj) {
+  struct tcp2_pool_allocator *pool_allocator =
+    (struct tcp2_pool_allocator *)allocator;
+
+  if (!tcp2_pool_owns(pool_allocator, obj)) {
+    tcp2_allocator_free(pool_allocator->backing, type, size, obj);
+    return;
+  }
+
+  struct tcp2_pool_region *region = tcp2_pool_region_of(pool_allocator, obj);
+  struct tcp2_pool_class *pool_class =
+    &pool_allocator->classes[region->buffer_class];
+
+  *(void **)obj = pool_class->free_list;
+  pool_class->free_list = obj;
+  region->in_use--;
+}
+
+/*
+ * Release idle regions, those without allocated buffers, until the target is
+ * reached.  Their buffers are unlinked from the free lists and the region is
+ * returned to reserved address space, so it costs no memory until it is
+ * committed again, possibly for the other class.
+ *
+ * The idle regions are picked first, then each free list is walked once,
+ * whatever the number of regions released, which is proportional to the
+ * number of free buffers.  Trims are rare, allocations and frees are not, so
+ * that cost is kept out of the hot path.
+ */
+static size_t tcp2_pool_trim(const struct tcp2_allocator *allocator,
+                             size_t target) {
+  struct tcp2_pool_allocator *pool_allocator =
+    (struct tcp2_pool_allocator *)allocator;
+  size_t released = 0;
+
+  for (size_t index = 0; index < pool_allocator->regions_committed; ++index) {
+    struct tcp2_pool_region *region = &pool_allocator->regions[index];
+    if (!region->committed || (region->in_use > 0))
+      continue;
+
+    region->releasing = 1;
+    released += TCP2_POOL_REGION_SIZE;
+
+    if ((target != 0) && (released >= target))
+      break;
+  }
+
+  if (released == 0)
+    return tcp2_allocator_trim(pool_allocator->backing, target);
+
+  /*
+   * The free lists are threaded through the buffers, so they are filtered
+   * before any region goes away.
+   */
+  for (int buffer_class = 0; buffer_class < TCP2_POOL_CLASSES;
+       ++buffer_class) {
+    struct tcp2_pool_class *pool_class = &pool_allocator->classes[buffer_class];
+
+    void **link = &pool_class->free_list;
+    while (*link) {
+      if (tcp2_pool_region_of(pool_allocator, *link)->releasing)
+        *link = *(void **)*link;
+      else
+        link = (void **)*link;
+    }
+
+    if ((pool_class->carve_next != pool_class->carve_end) &&
+        tcp2_pool_region_of(pool_allocator,
+                            pool_class->carve_next)->releasing) {
+      pool_class->carve_next = NULL;
+      pool_class->carve_end = NULL;
+    }
+  }
+
+  for (size_t index = 0; index < pool_allocator->regions_committed; ++index) {
+    struct tcp2_pool_region *region = &pool_allocator->regions[index];
+    if (!region->releasing)
+      continue;
+
+    char *start = pool_allocator->base + (index << TCP2_POOL_REGION_SHIFT);
+
+    /*
+     * Mapping over the region can fail, when the process is out of mappings
+     * for example, and the region then stays mapped with its pages.  Its
+     * buffers are already unlinked, so it is still handed back as released:
+     * committing it maps over it again just the same.  Its pages are
+     * dropped in place instead, and if even that fails, they are not
+     * counted as released.
+     */
+    if ((mmap(start, TCP2_POOL_REGION_SIZE, PROT_NONE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+              -1, 0) == MAP_FAILED) &&
+        (madvise(start, TCP2_POOL_REGION_SIZE, MADV_DONTNEED) != 0))
+      released -= TCP2_POOL_REGION_SIZE;
+
+    region->releasing = 0;
+    region->committed = 0;
+    pool_allocator->regions_released++;
+  }
+
+  if ((target != 0) && (released >= target))
+    return released;
+
+  return released + tcp2_allocator_trim(pool_allocator->backing,
+                                        target ? target - released : 0);
+}
+
+
+
+/*
+ * The global operations structure to hold references to pool alloc and free.
+ */
+static struct tcp2_allocator_operations tcp2_pool_allocator_operations = {
+  .alloc = tcp2_pool_alloc,
+  .free = tcp2_pool_free,
+  .trim = tcp2_pool_trim,
+};
+
+
+
+/*
+ * Create a pool allocator.
+ *
+ * Arguments:
+ * backing: the allocator for everything the pool does not serve itself
+ *
+ * region_count: the number of regions to reserve address space for, 0 for
+ *               TCP2_POOL_DEFAULT_REGIONS
+ *
+ * Returns:
+ * A new pool allocator, or NULL upon failure.  No region is committed yet.
+ */
+struct tcp2_pool_allocator *tcp2_create_pool_allocator(
+    const struct tcp2_allocator *backing, size_t region_count) {
+  if (region_count == 0)
+    region_count = TCP2_POOL_DEFAULT_REGIONS;
+
+  struct tcp2_pool_allocator *pool_allocator =
+    tcp2_allocator_alloc(backing, 0, sizeof(struct tcp2_pool_allocator));
+  if (!pool_allocator)
+    return NULL;
+
+  memset(pool_allocator, 0, sizeof(struct tcp2_pool_allocator));
+
+  pool_allocator->tcp2_allocator.operations = &tcp2_pool_allocator_operations;
+  pool_allocator->backing = backing;
+  pool_allocator->region_count = region_count;
+  pool_allocator->numa_node = -1;
+
+  pool_allocator->regions =
+    tcp2_allocator_alloc(backing, 0,
+                         region_count * sizeof(struct tcp2_pool_region));
+  if (!pool_allocator->regions) {
+    tcp2_allocator_free(backing, 0, sizeof(struct tcp2_pool_allocator),
+                        pool_allocator);
+    return NULL;
+  }
+
+  memset(pool_allocator->regions, 0,
+         region_count * sizeof(struct tcp2_pool_region));
+
+  /*
+   * Reserve one extra region of address space so that the range can be
+   * aligned to the region size, then give back what is not needed.
+   */
+  size_t range_size = region_count << TCP2_POOL_REGION_SHIFT;
+  char *reserved = mmap(NULL, range_size + TCP2_POOL_REGION_SIZE, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (reserved == MAP_FAILED) {
+    tcp2_allocator_free(backing, 0,
+                        region_count * sizeof(struct tcp2_pool_region),
+                        pool_allocator->regions);
+    tcp2_allocator_free(backing, 0, sizeof(struct tcp2_pool_allocator),
+                        pool_allocator);
+    return NULL;
+  }
+
+  char *base = (char *)(((uintptr_t)reserved + TCP2_POOL_REGION_SIZE - 1) &
+                        ~(uintptr_t)(TCP2_POOL_REGION_SIZE - 1));
+  if (base > reserved)
+    munmap(reserved, (size_t)(base - reserved));
+  munmap(base + range_size,
+         (size_t)(reserved + TCP2_POOL_REGION_SIZE - base));
+
+  pool_allocator->base = base;
+
+  pool_allocator->classes[TCP2_POOL_CLASS_MTU].buffer_size =
+    TCP2_POOL_MTU_BUFFER_SIZE;
+  pool_allocator->classes[TCP2_POOL_CLASS_GSO].buffer_size =
+    TCP2_POOL_GSO_BUFFER_SIZE;
+
+  return pool_allocator;
+}
+
+/*
+ * Pool allocator destructor.  The whole reserved range is unmapped, so every
+ * buffer must have been freed, or at least must not be used any more.
+ */
+void tcp2_destroy_pool_allocator(struct tcp2_pool_allocator *pool_allocator) {
+  const struct tcp2_allocator *backing = pool_allocator->backing;
+  size_t region_count = pool_allocator->region_count;
+
+  munmap(pool_allocator->base, region_count << TCP2_POOL_REGION_SHIFT);
+
+  tcp2_allocator_free(backing, 0,
+                      region_count * sizeof(struct tcp2_pool_region),
+                      pool_allocator->regions);
+  tcp2_allocator_free(backing, 0, sizeof(struct tcp2_pool_allocator),
+                      pool_allocator);
+}
+
+/*
+ * Commit every future region of the pool for a NUMA node.  Regions committed
+ * before the call keep their placement.
+ */
+void tcp2_pool_allocator_set_numa_node(
+    struct tcp2_pool_allocator *pool_allocator, int node) {
+  pool_allocator->numa_node = node;
+}
+
+/*
+ * Describe the memory of the pool, for registration with the kernel.  The
+ * whole reserved range is returned, committed or not, so that it only needs
+ * to be registered once.
+ */
+void tcp2_pool_allocator_get_range(
+    const struct tcp2_pool_allocator *pool_allocator,
+    struct iovec *range) {
+  range->iov_base = pool_allocator->base;
+  range->iov_len = pool_allocator->region_count << TCP2_POOL_REGION_SHIFT;
+}
+
+
+
+
+
+
+/*
+ * Finally, a thread placing a pool allocator in front of its slab allocator,
+ * so packet buffers come from huge pages and everything else from slabs.
+ */
+void app_on_thread_start() {
+  struct tcp2_slab_allocator *tcp2_slab_allocator =
+    tcp2_create_slab_allocator(tcp2_get_trivial_allocator());
+
+  tcp2_slab_allocator_register_tcp2_types(tcp2_slab_allocator);
+
+  struct tcp2_pool_allocator *tcp2_pool_allocator =
+    tcp2_create_pool_allocator(&tcp2_slab_allocator->tcp2_allocator, 0);
+
+  struct tcp2_thread_context *tcp2_thread_context =
+    tcp2_create_thread_context(tcp2_system_context,
+                               &tcp2_pool_allocator->tcp2_allocator);
+
+  app_store_tcp2_thread_context(tcp2_thread_context);
+
+  app_execute_thread_loop();
+}
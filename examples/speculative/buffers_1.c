@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+/*
+ * This case study demonstrates some ideas about the tcp2_buffer, which
+ * events_in_out_1.c left as an opaque class, and about keeping buffers for
+ * reuse rather than creating and destroying one for every event.
+ *
+ * In events_in_out_1.c the application creates a new buffer_out for every
+ * read and every timeout, and destroys it again whenever tcp2 produced
+ * nothing.  Most timer events produce nothing, so most of those buffers are
+ * allocated, never written and freed.
+ *
+ * Here each thread context owns a pool of buffers:
+ * - A buffer is a small header and a data region.  The header has its own
+ *   type id, TCP2_TYPE_BUFFER, the data region is a TCP2_TYPE_PACKET_BUFFER
+ *   which the pool allocator of allocators_9.c serves from huge pages.
+ * - Destroyed buffers go back to the pool of their thread context with their
+ *   data region still attached, so getting a buffer from the pool is a list
+ *   pop with no allocation at all.
+ * - The pool is bounded, buffers beyond the bound are freed.
+ *
+ * The tcp2_events side of reuse is shown in events_in_out_2.c.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - A pool is not thread safe, it is only used on the thread of its thread
+ *   context.  A buffer destroyed on another thread, typically an I/O thread
+ *   that has just sent it, is freed through the allocator recorded in the
+ *   buffer instead.  With remote free enabled (allocators_4.c), that memory
+ *   still finds its way back to the owning thread.
+ * - The calling thread is identified by a thread local pointer to the pool of
+ *   the thread context created on that thread, as with the remote free
+ *   allocator.
+ * - All pooled buffers have the same capacity, large enough for a GSO train
+ *   of datagrams.  Buffers of other capacities are never pooled.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * The capacity of pooled buffers, see allocators_9.c.
+ */
+#define TCP2_BUFFER_CAPACITY        TCP2_POOL_GSO_BUFFER_SIZE
+
+/*
+ * The default number of idle buffers a pool keeps.
+ */
+#define TCP2_BUFFER_POOL_MAX_FREE   64
+
+
+
+/*
+ * Buffer.
+ *
+ * data: the data region, of 'capacity' bytes, of which the first 'length'
+ *       are in use
+ * allocator: the allocator that the header and data region were allocated
+ *            from, and are freed to
+ * pool: the pool of the thread context that created the buffer
+ * next: the pool free list link, only used while the buffer is idle
+ */
+struct tcp2_buffer {
+  char *data;
+  size_t length;
+  size_t capacity;
+
+  const struct tcp2_allocator *allocator;
+  struct tcp2_buffer_pool *pool;
+  struct tcp2_buffer *next;
+};
+
+/*
+ * Buffer pool, one per thread context.
+ *
+ * thread_context: the owner of the pool, whose allocator is read for every
+ *                 new buffer, as remote free (allocators_4.c) may replace it
+ *                 after the pool was set up
+ */
+struct tcp2_buffer_pool {
+  struct tcp2_thread_context *thread_context;
+
+  struct tcp2_buffer *free_list;
+  uint32_t free_count;
+  uint32_t max_free;
+};
+
+static _Thread_local const struct tcp2_buffer_pool *tcp2_buffer_pool_current;
+
+
+
+/*
+ * Allocate and free a buffer, header and data region both.
+ */
+static struct tcp2_buffer *tcp2_buffer_alloc(struct tcp2_buffer_pool *pool,
+                                             size_t capacity) {
+  const struct tcp2_allocator *allocator = pool->thread_context->allocator;
+
+  struct tcp2_buffer *buffer =
+    tcp2_allocator_alloc(allocator, TCP2_TYPE_BUFFER,
+                         sizeof(struct tcp2_buffer));
+  if (!buffer)
+    return NULL;
+
+  buffer->data =
+    tcp2_allocator_alloc(allocator, TCP2_TYPE_PACKET_BUFFER, capacity);
+  if (!buffer->data) {
+    tcp2_allocator_free(allocator, TCP2_TYPE_BUFFER,
+                        sizeof(struct tcp2_buffer), buffer);
+    return NULL;
+  }
+
+  buffer->length = 0;
+  buffer->capacity = capacity;
+  buffer->allocator = allocator;
+  buffer->pool = pool;
+  buffer->next = NULL;
+
+  return buffer;
+}
+
+static void tcp2_buffer_free(struct tcp2_buffer *buffer) {
+  const struct tcp2_allocator *allocator = buffer->allocator;
+
+  tcp2_allocator_free(allocator, TCP2_TYPE_PACKET_BUFFER, buffer->capacity,
+                      buffer->data);
+  tcp2_allocator_free(allocator, TCP2_TYPE_BUFFER,
+                      sizeof(struct tcp2_buffer), buffer);
+}
+
+
+
+/*
+ * Set up the pool of a thread context, on the thread of that thread context.
+ *
+ * Arguments:
+ * thread_context: the thread context that owns the pool
+ *
+ * max_free: the number of idle buffers to keep, 0 for
+ *           TCP2_BUFFER_POOL_MAX_FREE
+ */
+void tcp2_buffer_pool_init(struct tcp2_buffer_pool *pool,
+                           struct tcp2_thread_context *thread_context,
+                           uint32_t max_free) {
+  pool->thread_context = thread_context;
+  pool->free_list = NULL;
+  pool->free_count = 0;
+  pool->max_free = max_free ? max_free : TCP2_BUFFER_POOL_MAX_FREE;
+
+  tcp2_buffer_pool_current = pool;
+}
+
+/*
+ * Free every idle buffer of a pool.  Idle buffers are idle memory too, a trim
+ * (allocators_12.c) of a thread context frees them before trimming its
+ * allocator.
+ */
+void tcp2_buffer_pool_trim(struct tcp2_buffer_pool *pool) {
+  struct tcp2_buffer *buffer;
+
+  while ((buffer = pool->free_list)) {
+    pool->free_list = buffer->next;
+    tcp2_buffer_free(buffer);
+  }
+
+  pool->free_count = 0;
+}
+
+/*
+ * Pool destructor.  Buffers that are still in use are freed through their
+ * allocator when they are destroyed.
+ */
+void tcp2_buffer_pool_cleanup(struct tcp2_buffer_pool *pool) {
+  tcp2_buffer_pool_trim(pool);
+
+  if (tcp2_buffer_pool_current == pool)
+    tcp2_buffer_pool_current = NULL;
+}
+
+
+
+/*
+ * Get an empty buffer from the pool of a thread context.  Must be called on
+ * the thread of the thread context.
+ *
+ * Returns:
+ * An empty buffer of TCP2_BUFFER_CAPACITY bytes, or NULL upon failure.
+ */
+struct tcp2_buffer *tcp2_thread_context_get_buffer(
+    struct tcp2_thread_context *tcp2_thread_context) {
+  struct tcp2_buffer_pool *pool = &tcp2_thread_context->buffer_pool;
+
+  struct tcp2_buffer *buffer = pool->free_list;
+  if (buffer) {
+    pool->free_list = buffer->next;
+    pool->free_count--;
+    buffer->next = NULL;
+
+    return buffer;
+  }
+
+  return tcp2_buffer_alloc(pool, TCP2_BUFFER_CAPACITY);
+}
+
+/*
+ * Destroy a buffer.  May be called on any thread.  On the thread that owns
+ * the pool of the buffer, it is emptied and returned to that pool.
+ */
+void tcp2_destroy_buffer(struct tcp2_buffer *buffer) {
+  struct tcp2_buffer_pool *pool = buffer->pool;
+
+  if ((pool == tcp2_buffer_pool_current) &&
+      (pool->free_count < pool->max_free) &&
+      (buffer->capacity == TCP2_BUFFER_CAPACITY)) {
+    buffer->length = 0;
+    buffer->next = pool->free_list;
+    pool->free_list = buffer;
+    pool->free_count++;
+
+    return;
+  }
+
+  tcp2_buffer_free(buffer);
+}
+
+int tcp2_buffer_empty(const struct tcp2_buffer *buffer) {
+  return buffer->length == 0;
+}
+
+
+
+
+
+
+/*
+ * The thread context, as shown in allocators_12.c, with its buffer pool, and
+ * the parts of its constructor and destructor that deal with the pool.
+ */
+struct tcp2_thread_context {
+  struct tcp2_system_context *system_context;
+
+  const struct tcp2_allocator *allocator;
+
+  struct tcp2_magazine_allocator *magazine_allocator;
+
+  struct tcp2_remote_free_allocator *remote_free_allocator;
+
+  uint64_t trim_generation;
+
+  struct tcp2_buffer_pool buffer_pool;
+};
+
+struct tcp2_thread_context *tcp2_create_thread_context(
+    struct tcp2_system_context *tcp2_system_context,
+    const struct tcp2_allocator *allocator) {
+  /*
+   * Allocator set up as in allocators_3.c, trim state as in allocators_12.c.
+   */
+
+  tcp2_buffer_pool_init(&tcp2_thread_context->buffer_pool,
+                        tcp2_thread_context, 0);
+
+  return tcp2_thread_context;
+}
+
+void tcp2_destroy_thread_context(
+    struct tcp2_thread_context *tcp2_thread_context) {
+  tcp2_buffer_pool_cleanup(&tcp2_thread_context->buffer_pool);
+
+  /*
+   * Allocator torn down as in allocators_3.c.
+   */
+}
+
+/*
+ * Trim a thread context, as in allocators_12.c, emptying the pool first so
+ * that its buffers reach the allocator before it is trimmed.  A trim
+ * requested through the system context runs this too, from tcp2_process.
+ */
+size_t tcp2_thread_context_trim(
+    struct tcp2_thread_context *tcp2_thread_context, size_t target) {
+  if (tcp2_thread_context->remote_free_allocator) {
+    tcp2_remote_free_allocator_drain(
+      tcp2_thread_context->remote_free_allocator);
+  }
+
+  tcp2_buffer_pool_trim(&tcp2_thread_context->buffer_pool);
+
+  return tcp2_allocator_trim(tcp2_thread_context->allocator, target);
+}
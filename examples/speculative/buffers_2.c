@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+/*
+ * This case study builds on buffers_1.c and turns the tcp2_buffer into a
+ * chain of segments, which the application can hand to sendmsg or sendmmsg
+ * as an iovec array without flattening it first.
+ *
+ * A packet that tcp2 produces is made of parts with very different origins:
+ * - the packet header, written by tcp2
+ * - frames, such as acks, also written by tcp2
+ * - stream payload, which already sits in a stream send buffer
+ * - the authentication tag, written by the packet protection
+ * With a contiguous buffer all of these are copied next to each other.  With
+ * a segment chain each part is a segment, which either holds bytes in the
+ * data region of the buffer or refers to bytes held elsewhere, and the
+ * kernel gathers the parts while it copies them anyway.
+ *
+ * The buffer keeps its data region from buffers_1.c, now used as the
+ * headroom for the bytes tcp2 writes itself, and gains a segment array.
+ * Datagram boundaries within a buffer are the topic of another case study,
+ * here a buffer holds the segments of one datagram or of a train of
+ * datagrams to a single destination.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - Segments live in a fixed size array inside the buffer, not in a linked
+ *   list of separately allocated nodes: appending a segment never allocates,
+ *   and the iovec export is a loop over an array.  TCP2_BUFFER_MAX_SEGMENTS
+ *   is well below the IOV_MAX of common systems.
+ * - A segment that refers to memory outside of the buffer does not own that
+ *   memory.  Whoever appends it guarantees that it stays valid until the
+ *   buffer is destroyed, for stream payload this is the stream send buffer,
+ *   which only releases data once it has been acknowledged, long after the
+ *   datagram was sent.
+ * - Appending bytes that follow on from the previous segment in memory
+ *   extends that segment instead of adding a new one, so that a buffer built
+ *   from many small writes to its own data region still exports a single
+ *   iovec.
+ * - The exported iovec array refers to the buffer, it is valid until the
+ *   buffer is changed or destroyed.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * The number of segments a buffer holds.  A datagram typically needs three
+ * or four: header and frames, payload, perhaps a second payload range that
+ * wraps around the end of a stream send buffer, and the tag.
+ */
+#define TCP2_BUFFER_MAX_SEGMENTS    64
+
+
+
+struct tcp2_buffer_segment {
+  const char *base;
+  size_t length;
+};
+
+/*
+ * Buffer, as in buffers_1.c, with the segment chain.
+ *
+ * data: the data region that tcp2 writes its own bytes to, of which the
+ *       first 'length' bytes are used
+ * segments: the content of the buffer, in order, of which the first
+ *           'segment_count' are used
+ * total_length: the sum of the lengths of all segments
+ */
+struct tcp2_buffer {
+  char *data;
+  size_t length;
+  size_t capacity;
+
+  uint32_t segment_count;
+  size_t total_length;
+  struct tcp2_buffer_segment segments[TCP2_BUFFER_MAX_SEGMENTS];
+
+  const struct tcp2_allocator *allocator;
+  struct tcp2_buffer_pool *pool;
+  struct tcp2_buffer *next;
+};
+
+
+
+/*
+ * Empty a buffer, which is what tcp2_destroy_buffer does first.
+ */
+void tcp2_buffer_reset(struct tcp2_buffer *buffer) {
+  buffer->length = 0;
+  buffer->segment_count = 0;
+  buffer->total_length = 0;
+}
+
+/*
+ * Destroy a buffer, as in buffers_1.c.  The buffer is emptied on both paths,
+ * so that a pooled buffer is handed out again without stale segments, and so
+ * that whatever its segments hold on to is released before it is freed.
+ */
+void tcp2_destroy_buffer(struct tcp2_buffer *buffer) {
+  struct tcp2_buffer_pool *pool = buffer->pool;
+
+  tcp2_buffer_reset(buffer);
+
+  if ((pool == tcp2_buffer_pool_current) &&
+      (pool->free_count < pool->max_free) &&
+      (buffer->capacity == TCP2_BUFFER_CAPACITY)) {
+    buffer->next = pool->free_list;
+    pool->free_list = buffer;
+    pool->free_count++;
+
+    return;
+  }
+
+  tcp2_buffer_free(buffer);
+}
+
+int tcp2_buffer_empty(const struct tcp2_buffer *buffer) {
+  return buffer->total_length == 0;
+}
+
+size_t tcp2_buffer_length(const struct tcp2_buffer *buffer) {
+  return buffer->total_length;
+}
+
+/*
+ * Append a segment that refers to memory outside of the data region.
+ *
+ * Returns:
+ * 0 on success, -1 if the buffer has no segment left.
+ */
+int tcp2_buffer_append_ref(struct tcp2_buffer *buffer,
+                           const void *base, size_t length) {
+  if (length == 0)
+    return 0;
+
+  if (buffer->segment_count > 0) {
+    struct tcp2_buffer_segment *last =
+      &buffer->segments[buffer->segment_count - 1];
+
+    if (last->base + last->length == (const char *)base) {
+      last->length += length;
+      buffer->total_length += length;
+      return 0;
+    }
+  }
+
+  if (buffer->segment_count == TCP2_BUFFER_MAX_SEGMENTS)
+    return -1;
+
+  buffer->segments[buffer->segment_count++] =
+    (struct tcp2_buffer_segment){ .base = base, .length = length };
+  buffer->total_length += length;
+
+  return 0;
+}
+
+/*
+ * Reserve bytes at the end of the data region for tcp2 to write to, and
+ * append them as a segment.  This is how headers, frames and tags are
+ * written: reserve, then write in place.
+ *
+ * Returns:
+ * A pointer to the reserved bytes, or NULL if the data region or the segment
+ * array is full.
+ */
+void *tcp2_buffer_reserve(struct tcp2_buffer *buffer, size_t length) {
+  if (buffer->capacity - buffer->length < length)
+    return NULL;
+
+  char *reserved = buffer->data + buffer->length;
+
+  if (tcp2_buffer_append_ref(buffer, reserved, length) != 0)
+    return NULL;
+
+  buffer->length += length;
+
+  return reserved;
+}
+
+/*
+ * Append a copy of some bytes to the buffer.  For small pieces a copy is
+ * cheaper than a segment, both for tcp2 and for the kernel.
+ *
+ * Returns:
+ * 0 on success, -1 if the buffer is full.
+ */
+int tcp2_buffer_append_copy(struct tcp2_buffer *buffer,
+                            const void *bytes, size_t length) {
+  void *reserved = tcp2_buffer_reserve(buffer, length);
+  if (!reserved)
+    return -1;
+
+  memcpy(reserved, bytes, length);
+
+  return 0;
+}
+
+/*
+ * A position in a buffer to roll back to, for tcp2 to undo a partially
+ * written packet.  Appends after the mark may have extended the segment
+ * before it, so its length is part of the mark.
+ */
+struct tcp2_buffer_mark {
+  uint32_t segment_count;
+  size_t length;
+  size_t total_length;
+  size_t last_segment_length;
+};
+
+void tcp2_buffer_mark(const struct tcp2_buffer *buffer,
+                      struct tcp2_buffer_mark *mark) {
+  mark->segment_count = buffer->segment_count;
+  mark->length = buffer->length;
+  mark->total_length = buffer->total_length;
+  mark->last_segment_length = (buffer->segment_count > 0) ?
+    buffer->segments[buffer->segment_count - 1].length : 0;
+}
+
+void tcp2_buffer_rollback(struct tcp2_buffer *buffer,
+                          const struct tcp2_buffer_mark *mark) {
+  buffer->segment_count = mark->segment_count;
+  buffer->length = mark->length;
+  buffer->total_length = mark->total_length;
+
+  if (mark->segment_count > 0)
+    buffer->segments[mark->segment_count - 1].length =
+      mark->last_segment_length;
+}
+
+/*
+ * Export the segments of a buffer as an iovec array, for sendmsg and
+ * sendmmsg.
+ *
+ * Arguments:
+ * iov: receives a pointer to the iovec array, which refers to the buffer and
+ *      is valid until the buffer is changed or destroyed
+ *
+ * Returns:
+ * The number of entries in the array.
+ */
+size_t tcp2_buffer_iov(const struct tcp2_buffer *buffer,
+                       const struct iovec **iov) {
+  /*
+   * The segment layout matches struct iovec, so the segment array is the
+   * iovec array.
+   */
+  _Static_assert(sizeof(struct tcp2_buffer_segment) == sizeof(struct iovec),
+                 "segments are exported as iovecs");
+  _Static_assert(offsetof(struct tcp2_buffer_segment, base) ==
+                 offsetof(struct iovec, iov_base),
+                 "segments are exported as iovecs");
+  _Static_assert(offsetof(struct tcp2_buffer_segment, length) ==
+                 offsetof(struct iovec, iov_len),
+                 "segments are exported as iovecs");
+
+  *iov = (const struct iovec *)buffer->segments;
+
+  return buffer->segment_count;
+}
+
+/*
+ * Copy the content of a buffer into contiguous memory, for applications or
+ * transports that cannot gather.
+ *
+ * Returns:
+ * The number of bytes copied, at most 'length'.
+ */
+size_t tcp2_buffer_flatten(const struct tcp2_buffer *buffer,
+                           void *bytes, size_t length) {
+  size_t copied = 0;
+
+  for (uint32_t index = 0;
+       (index < buffer->segment_count) && (copied < length);
+       ++index) {
+    size_t piece = buffer->segments[index].length;
+    if (piece > length - copied)
+      piece = length - copied;
+
+    memcpy((char *)bytes + copied, buffer->segments[index].base, piece);
+    copied += piece;
+  }
+
+  return copied;
+}
+
+
+
+
+
+
+/*
+ * Inside tcp2, a short header packet carrying stream data is assembled
+ * without copying the payload: header and frame headers are written to the
+ * data region, the payload is referenced in the stream send buffer, and the
+ * tag is reserved last and written by the packet protection.
+ */
+static int tcp2_connection_write_stream_packet(
+    struct tcp2_connection *connection,
+    struct tcp2_stream *stream,
+    struct tcp2_buffer *buffer_out) {
+  struct tcp2_buffer_mark mark;
+
+  tcp2_buffer_mark(buffer_out, &mark);
+
+  struct tcp2_stream_range range =
+    tcp2_stream_next_send_range(stream,
+                                tcp2_connection_max_payload(connection));
+
+  if ((tcp2_connection_write_header(connection, buffer_out) != 0) ||
+      (tcp2_stream_write_frame_header(stream, &range, buffer_out) != 0) ||
+      (tcp2_buffer_append_ref(buffer_out, range.first, range.first_length)
+         != 0) ||
+      (tcp2_buffer_append_ref(buffer_out, range.second, range.second_length)
+         != 0) ||
+      (tcp2_connection_protect(connection, buffer_out, mark.total_length)
+         != 0)) {
+    /*
+     * Out of room: undo the partial packet, it is sent in the next buffer.
+     */
+    tcp2_buffer_rollback(buffer_out, &mark);
+
+    return -1;
+  }
+
+  tcp2_stream_on_range_sent(stream, &range);
+
+  return 0;
+}
+
+
+
+
+
+
+/*
+ * The application sends buffer_out with a single sendmsg call, in place of
+ * app_network_write_udp in events_in_out_2.c.
+ */
+void app_network_write_udp(struct app_context *app_context,
+                           struct tcp2_buffer *buffer_out) {
+  const struct iovec *iov;
+  size_t iov_count = tcp2_buffer_iov(buffer_out, &iov);
+
+  struct msghdr msghdr = {
+    .msg_name = app_get_peer_address(app_context, buffer_out),
+    .msg_namelen = sizeof(struct sockaddr_storage),
+    .msg_iov = (struct iovec *)iov,
+    .msg_iovlen = iov_count,
+  };
+
+  if (sendmsg(app_context->udp_socket, &msghdr, 0) < 0)
+    app_count_send_error(app_context, errno);
+
+  tcp2_destroy_buffer(buffer_out);
+}
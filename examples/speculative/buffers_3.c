@@ -0,0 +1,481 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+/*
+ * This case study builds on buffers_2.c and demonstrates zero copy sending of
+ * stream data: the application hands tcp2 memory it owns, and tcp2 refers to
+ * that memory from the segments of buffer_out until the data has been
+ * acknowledged by the peer, without ever copying it.
+ *
+ * A regular stream send copies the payload into a stream send buffer, and
+ * the payload is then copied again into packets.  buffers_2.c removes the
+ * second copy by referencing the stream send buffer from buffer_out.  This
+ * case study removes the first one, for applications that already hold the
+ * payload in memory that outlives the send, such as a file cache, a response
+ * cache or a memory mapped file.
+ *
+ * The application passes a region of memory and a completion callback.  tcp2
+ * wraps the region in a small reference counted send region, and holds
+ * references to it:
+ * - one held by the stream, until every byte of the region is acknowledged,
+ *   as lost bytes are retransmitted from the region
+ * - one for every segment of a buffer that refers to the region, until that
+ *   buffer is destroyed, which the application does once it has been sent
+ * When the last reference is dropped the completion callback is called, and
+ * the application may reuse or release the memory.
+ *
+ * Application memory that is itself reference counted is supported by using
+ * its release function as the completion callback.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - The memory must not change between the send call and the completion
+ *   callback.  Retransmissions must carry the same bytes as the original
+ *   transmission.
+ * - Buffers can be destroyed on any thread, see buffers_1.c, so references
+ *   are atomic and the completion callback runs on whichever thread drops the
+ *   last reference.  This is nearly always the thread of the connection, as
+ *   acknowledgements arrive long after the datagram was handed to the kernel,
+ *   but applications must not rely on it.  The send region itself is freed
+ *   through the allocator of the thread context of the connection, which is
+ *   safe from other threads with remote free enabled (allocators_4.c), just
+ *   as for the buffers themselves.
+ * - A region is released as soon as it is acknowledged, or when the stream is
+ *   reset or the connection is closed, whichever comes first.  On reset and
+ *   close the callback receives a status saying so.
+ * - Small sends gain nothing from this, the send region and the callback
+ *   cost more than a copy.  Below TCP2_ZERO_COPY_MIN_LENGTH bytes, the
+ *   payload is copied into the stream send buffer as usual and the callback
+ *   is called with TCP2_SEND_COPIED before the send function returns.  The
+ *   copy is then delivered like any other stream data, without further
+ *   notice.
+ * - Packet protection encrypts the payload into the output, which is a copy
+ *   in its own right.  Zero copy pays off fully where protection is done by
+ *   the kernel or the network card, or where the cipher writes its output
+ *   straight into the data region of the buffer, which then refers to the
+ *   application memory only as the retransmission source.
+ * ----END DISCUSSION----
+ */
+
+
+
+#define TCP2_ZERO_COPY_MIN_LENGTH   4096
+
+/*
+ * Completion statuses passed to the completion callback.
+ */
+#define TCP2_SEND_ACKNOWLEDGED      0
+#define TCP2_SEND_STREAM_RESET      1
+#define TCP2_SEND_CONNECTION_CLOSED 2
+
+/*
+ * The memory was copied, and belongs to the application again.  Says nothing
+ * about the delivery of the data.
+ */
+#define TCP2_SEND_COPIED            3
+
+
+
+/*
+ * The completion callback.
+ *
+ * Arguments:
+ * user_data: as given to the send function
+ *
+ * base, length: the region as given to the send function
+ *
+ * status: one of the TCP2_SEND_* completion statuses
+ */
+typedef void (*tcp2_send_complete_function)(void *user_data,
+                                            const void *base, size_t length,
+                                            int status);
+
+/*
+ * Send region.
+ *
+ * Allocated with type id TCP2_TYPE_SEND_REGION, from the allocator of the
+ * thread context of the connection.
+ *
+ * offset: the stream offset of the first byte of the region
+ */
+struct tcp2_send_region {
+  const char *base;
+  size_t length;
+  uint64_t offset;
+
+  _Atomic uint32_t references;
+  int status;
+
+  tcp2_send_complete_function complete;
+  void *user_data;
+
+  const struct tcp2_allocator *allocator;
+
+  /*
+   * The regions of a stream that are not yet fully acknowledged, in stream
+   * order.
+   */
+  struct tcp2_send_region *next;
+};
+
+/*
+ * Buffer, as in buffers_2.c, with a send region for every segment.  The
+ * entry of a segment that refers to the data region of the buffer, or to
+ * memory that tcp2 owns, is NULL.
+ */
+struct tcp2_buffer {
+  char *data;
+  size_t length;
+  size_t capacity;
+
+  uint32_t segment_count;
+  size_t total_length;
+  struct tcp2_buffer_segment segments[TCP2_BUFFER_MAX_SEGMENTS];
+  struct tcp2_send_region *segment_regions[TCP2_BUFFER_MAX_SEGMENTS];
+
+  const struct tcp2_allocator *allocator;
+  struct tcp2_buffer_pool *pool;
+  struct tcp2_buffer *next;
+};
+
+
+
+static inline void tcp2_send_region_ref(struct tcp2_send_region *region) {
+  atomic_fetch_add_explicit(&region->references, 1, memory_order_relaxed);
+}
+
+/*
+ * Drop a reference.  The thread that drops the last one completes the region
+ * and frees it, the acquire ordering makes the status written by the stream
+ * visible to it.
+ */
+static void tcp2_send_region_unref(struct tcp2_send_region *region) {
+  if (atomic_fetch_sub_explicit(&region->references, 1,
+                                memory_order_acq_rel) != 1)
+    return;
+
+  region->complete(region->user_data, region->base, region->length,
+                   region->status);
+
+  tcp2_allocator_free(region->allocator, TCP2_TYPE_SEND_REGION,
+                      sizeof(struct tcp2_send_region), region);
+}
+
+
+
+/*
+ * Append a segment that refers to part of a send region.  The buffer takes a
+ * reference that is dropped when the buffer is reset or destroyed.
+ *
+ * Unlike tcp2_buffer_append_ref, contiguous bytes are only merged into the
+ * previous segment when it refers to the same region, so every segment has
+ * exactly one region to release.
+ *
+ * Returns:
+ * 0 on success, -1 if the buffer has no segment left.
+ */
+int tcp2_buffer_append_region(struct tcp2_buffer *buffer,
+                              struct tcp2_send_region *region,
+                              size_t region_offset, size_t length) {
+  if (length == 0)
+    return 0;
+
+  const char *base = region->base + region_offset;
+
+  if (buffer->segment_count > 0) {
+    uint32_t last = buffer->segment_count - 1;
+
+    if ((buffer->segment_regions[last] == region) &&
+        (buffer->segments[last].base + buffer->segments[last].length ==
+         base)) {
+      buffer->segments[last].length += length;
+      buffer->total_length += length;
+      return 0;
+    }
+  }
+
+  if (buffer->segment_count == TCP2_BUFFER_MAX_SEGMENTS)
+    return -1;
+
+  tcp2_send_region_ref(region);
+
+  buffer->segments[buffer->segment_count] =
+    (struct tcp2_buffer_segment){ .base = base, .length = length };
+  buffer->segment_regions[buffer->segment_count] = region;
+  buffer->segment_count++;
+  buffer->total_length += length;
+
+  return 0;
+}
+
+/*
+ * Append a segment, as in buffers_2.c, recording that it has no region.
+ * Bytes are only merged into a previous segment without a region, for the
+ * same reason as in tcp2_buffer_append_region.  tcp2_buffer_reserve, and so
+ * tcp2_buffer_append_copy, append through this function.
+ */
+int tcp2_buffer_append_ref(struct tcp2_buffer *buffer,
+                           const void *base, size_t length) {
+  if (length == 0)
+    return 0;
+
+  if (buffer->segment_count > 0) {
+    uint32_t last = buffer->segment_count - 1;
+
+    if (!buffer->segment_regions[last] &&
+        (buffer->segments[last].base + buffer->segments[last].length ==
+         (const char *)base)) {
+      buffer->segments[last].length += length;
+      buffer->total_length += length;
+      return 0;
+    }
+  }
+
+  if (buffer->segment_count == TCP2_BUFFER_MAX_SEGMENTS)
+    return -1;
+
+  buffer->segments[buffer->segment_count] =
+    (struct tcp2_buffer_segment){ .base = base, .length = length };
+  buffer->segment_regions[buffer->segment_count] = NULL;
+  buffer->segment_count++;
+  buffer->total_length += length;
+
+  return 0;
+}
+
+/*
+ * Drop the references of the segments in [first, segment_count).
+ */
+static void tcp2_buffer_release_regions(struct tcp2_buffer *buffer,
+                                        uint32_t first) {
+  for (uint32_t index = first; index < buffer->segment_count; ++index) {
+    if (buffer->segment_regions[index]) {
+      tcp2_send_region_unref(buffer->segment_regions[index]);
+      buffer->segment_regions[index] = NULL;
+    }
+  }
+}
+
+/*
+ * Empty a buffer, as in buffers_2.c, dropping the references of its segments.
+ */
+void tcp2_buffer_reset(struct tcp2_buffer *buffer) {
+  tcp2_buffer_release_regions(buffer, 0);
+
+  buffer->length = 0;
+  buffer->segment_count = 0;
+  buffer->total_length = 0;
+}
+
+/*
+ * Roll back to a mark, as in buffers_2.c, dropping the references of the
+ * segments that are cut off.  A region segment before the mark that was
+ * extended after it keeps its single reference.
+ */
+void tcp2_buffer_rollback(struct tcp2_buffer *buffer,
+                          const struct tcp2_buffer_mark *mark) {
+  tcp2_buffer_release_regions(buffer, mark->segment_count);
+
+  buffer->segment_count = mark->segment_count;
+  buffer->length = mark->length;
+  buffer->total_length = mark->total_length;
+
+  if (mark->segment_count > 0)
+    buffer->segments[mark->segment_count - 1].length =
+      mark->last_segment_length;
+}
+
+/*
+ * Destroy a buffer, as in buffers_2.c, with the reset of this case study.
+ * The references are dropped on whichever thread destroys the buffer, which
+ * is safe as they are atomic, see the DISCUSSION above.  Dropping them
+ * before the buffer is pooled or freed means no region outlives the last
+ * buffer that refers to it.
+ */
+void tcp2_destroy_buffer(struct tcp2_buffer *buffer) {
+  struct tcp2_buffer_pool *pool = buffer->pool;
+
+  tcp2_buffer_reset(buffer);
+
+  if ((pool == tcp2_buffer_pool_current) &&
+      (pool->free_count < pool->max_free) &&
+      (buffer->capacity == TCP2_BUFFER_CAPACITY)) {
+    buffer->next = pool->free_list;
+    pool->free_list = buffer;
+    pool->free_count++;
+
+    return;
+  }
+
+  tcp2_buffer_free(buffer);
+}
+
+
+
+/*
+ * Send application owned memory on a stream, without copying it.
+ *
+ * Arguments:
+ * base, length: the memory to send, which must stay valid and unchanged
+ *               until the completion callback is called
+ *
+ * complete, user_data: the completion callback and its argument
+ *
+ * Returns:
+ * 0 on success, in which case the callback is called exactly once, possibly
+ * before this function returns.  -1 on failure, in which case the callback
+ * is never called and the memory belongs to the application again.
+ */
+int tcp2_stream_send_zero_copy(struct tcp2_stream *stream,
+                               const void *base, size_t length,
+                               tcp2_send_complete_function complete,
+                               void *user_data) {
+  if (length < TCP2_ZERO_COPY_MIN_LENGTH) {
+    if (tcp2_stream_send(stream, base, length) != 0)
+      return -1;
+
+    complete(user_data, base, length, TCP2_SEND_COPIED);
+    return 0;
+  }
+
+  const struct tcp2_allocator *allocator =
+    stream->connection->thread_context->allocator;
+
+  struct tcp2_send_region *region =
+    tcp2_allocator_alloc(allocator, TCP2_TYPE_SEND_REGION,
+                         sizeof(struct tcp2_send_region));
+  if (!region)
+    return -1;
+
+  region->base = base;
+  region->length = length;
+  region->offset = stream->send_offset;
+  region->status = TCP2_SEND_ACKNOWLEDGED;
+  region->complete = complete;
+  region->user_data = user_data;
+  region->allocator = allocator;
+  region->next = NULL;
+
+  /*
+   * The reference of the stream.
+   */
+  atomic_init(&region->references, 1);
+
+  *stream->send_regions_tail = region;
+  stream->send_regions_tail = &region->next;
+  stream->send_offset += length;
+
+  tcp2_connection_schedule_send(stream->connection);
+
+  return 0;
+}
+
+/*
+ * Inside tcp2, acknowledgement of a stream range releases the stream's
+ * reference of every region that is now fully acknowledged.  Segments still
+ * held in buffers keep their regions alive until those buffers are gone.
+ */
+static void tcp2_stream_on_acked(struct tcp2_stream *stream,
+                                 uint64_t acked_offset) {
+  struct tcp2_send_region *region;
+
+  while ((region = stream->send_regions) &&
+         (region->offset + region->length <= acked_offset)) {
+    stream->send_regions = region->next;
+    if (!stream->send_regions)
+      stream->send_regions_tail = &stream->send_regions;
+
+    tcp2_send_region_unref(region);
+  }
+}
+
+/*
+ * And on reset or close, every region is released with the matching status.
+ */
+static void tcp2_stream_release_regions(struct tcp2_stream *stream,
+                                        int status) {
+  struct tcp2_send_region *region;
+
+  while ((region = stream->send_regions)) {
+    stream->send_regions = region->next;
+
+    region->status = status;
+    tcp2_send_region_unref(region);
+  }
+
+  stream->send_regions_tail = &stream->send_regions;
+}
+
+
+
+
+
+
+/*
+ * The application serving files from a cache of reference counted pages.
+ * The cache entry is pinned for the send, and unpinned on completion.
+ */
+static void app_on_cache_send_complete(void *user_data,
+                                       const void *base, size_t length,
+                                       int status) {
+  app_cache_entry_unpin((struct app_cache_entry *)user_data);
+}
+
+void app_send_cached_response(struct app_context *app_context,
+                              struct tcp2_stream *stream,
+                              struct app_cache_entry *entry) {
+  app_cache_entry_pin(entry);
+
+  if (tcp2_stream_send_zero_copy(stream, entry->data, entry->length,
+                                 &app_on_cache_send_complete, entry) != 0) {
+    app_cache_entry_unpin(entry);
+    app_send_error_response(app_context, stream);
+  }
+}
@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+/*
+ * This case study builds on buffers_2.c and adds packet boundaries to the
+ * tcp2_buffer, so that a buffer filled with a batch of datagrams, by recvmmsg
+ * for example, describes every datagram it holds.
+ *
+ * events_in_out_1.c states that buffer_in "may contain multiple packets", but
+ * not where each of them starts and ends, who sent it, with which ECN
+ * codepoint, or when it arrived.  All of these are known to the application
+ * when it reads the datagrams, and all of them are needed by tcp2:
+ * - boundaries, as a datagram may hold several coalesced QUIC packets and
+ *   the last of them has no length field
+ * - the source address, to find the connection and to detect migration
+ * - the local address, for servers bound to several addresses
+ * - the ECN codepoint, for congestion control
+ * - the receive timestamp, for RTT measurement and ack delay
+ *
+ * A buffer now carries a packet descriptor array next to its segments.  For
+ * input, each descriptor refers to a slot of the data region, and the helper
+ * functions below set up a recvmmsg call that reads straight into the slots
+ * and descriptors, then complete the descriptors from the results and
+ * control messages.  tcp2_process walks the descriptors in a single call.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - Slots are TCP2_POOL_MTU_BUFFER_SIZE bytes, so a buffer of
+ *   TCP2_BUFFER_CAPACITY bytes holds a batch of TCP2_BUFFER_MAX_PACKETS
+ *   datagrams.  Datagrams larger than a slot are truncated by the kernel,
+ *   which QUIC's maximum datagram size rules out for compliant peers.  The
+ *   kernel flags them with MSG_TRUNC, and they are dropped when the
+ *   descriptors are completed, rather than parsed as short datagrams.
+ * - Addresses are stored in the descriptor as a union of the IPv4 and IPv6
+ *   socket addresses, rather than a sockaddr_storage, which is four times
+ *   larger than needed.
+ * - Receive timestamps come from the kernel when SO_TIMESTAMPNS is enabled on
+ *   the socket, and otherwise from a single clock read per batch.  Both are
+ *   CLOCK_REALTIME based, in nanoseconds.
+ * - An application that does not read with recvmmsg fills the descriptors
+ *   itself with tcp2_buffer_add_packet, one per datagram.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * The number of datagrams in a buffer, one per slot of the data region.
+ */
+#define TCP2_BUFFER_SLOT_SIZE       TCP2_POOL_MTU_BUFFER_SIZE
+#define TCP2_BUFFER_MAX_PACKETS \
+  (TCP2_BUFFER_CAPACITY / TCP2_BUFFER_SLOT_SIZE)
+
+/*
+ * ECN codepoints, as in the two low bits of the traffic class.
+ */
+#define TCP2_ECN_NOT_ECT            0
+#define TCP2_ECN_ECT1               1
+#define TCP2_ECN_ECT0               2
+#define TCP2_ECN_CE                 3
+
+
+
+union tcp2_address {
+  struct sockaddr sa;
+  struct sockaddr_in sin;
+  struct sockaddr_in6 sin6;
+};
+
+/*
+ * Packet descriptor.
+ *
+ * offset, length: the datagram, within the data region of the buffer
+ * peer: the source address of a received datagram, or the destination
+ *       address of one to be sent
+ * local: the local address a datagram was received on, if known, with a
+ *        family of AF_UNSPEC otherwise
+ * ecn: the ECN codepoint
+ * timestamp: the receive time in nanoseconds, 0 if unknown
+ */
+struct tcp2_packet_descriptor {
+  uint32_t offset;
+  uint32_t length;
+
+  union tcp2_address peer;
+  union tcp2_address local;
+
+  uint8_t ecn;
+  uint64_t timestamp;
+};
+
+/*
+ * Buffer, as in buffers_2.c, with the packet descriptors.
+ */
+struct tcp2_buffer {
+  char *data;
+  size_t length;
+  size_t capacity;
+
+  uint32_t segment_count;
+  size_t total_length;
+  struct tcp2_buffer_segment segments[TCP2_BUFFER_MAX_SEGMENTS];
+  struct tcp2_send_region *segment_regions[TCP2_BUFFER_MAX_SEGMENTS];
+
+  uint32_t packet_count;
+  struct tcp2_packet_descriptor packets[TCP2_BUFFER_MAX_PACKETS];
+
+  const struct tcp2_allocator *allocator;
+  struct tcp2_buffer_pool *pool;
+  struct tcp2_buffer *next;
+};
+
+
+
+/*
+ * Empty a buffer, as in buffers_3.c, dropping its descriptors as well: a
+ * buffer that was used for input may come back from the pool as buffer_out.
+ */
+void tcp2_buffer_reset(struct tcp2_buffer *buffer) {
+  tcp2_buffer_release_regions(buffer, 0);
+
+  buffer->length = 0;
+  buffer->segment_count = 0;
+  buffer->total_length = 0;
+  buffer->packet_count = 0;
+}
+
+/*
+ * Describe a datagram that has been written to the data region by the
+ * application.
+ *
+ * Returns:
+ * 0 on success, -1 if the descriptor array is full or the datagram is
+ * outside of the data region.
+ */
+int tcp2_buffer_add_packet(struct tcp2_buffer *buffer,
+                           size_t offset, size_t length,
+                           const struct sockaddr *peer, socklen_t peer_length,
+                           uint8_t ecn, uint64_t timestamp) {
+  if ((buffer->packet_count == TCP2_BUFFER_MAX_PACKETS) ||
+      (offset > buffer->capacity) ||
+      (length > buffer->capacity - offset) ||
+      (peer_length > sizeof(union tcp2_address)))
+    return -1;
+
+  struct tcp2_packet_descriptor *packet =
+    &buffer->packets[buffer->packet_count++];
+
+  packet->offset = (uint32_t)offset;
+  packet->length = (uint32_t)length;
+  memcpy(&packet->peer, peer, peer_length);
+  packet->local.sa.sa_family = AF_UNSPEC;
+  packet->ecn = ecn & 3;
+  packet->timestamp = timestamp;
+
+  return 0;
+}
+
+
+
+/*
+ * The control message space needed per datagram: the traffic class for ECN,
+ * the local address and the kernel timestamp.
+ */
+#define TCP2_RECV_CONTROL_SIZE \
+  (CMSG_SPACE(sizeof(int)) + \
+   CMSG_SPACE(sizeof(struct in6_pktinfo)) + \
+   CMSG_SPACE(sizeof(struct timespec)))
+
+/*
+ * The arguments of one recvmmsg call, kept by the application, typically on
+ * the stack of its read handler.
+ */
+struct tcp2_recv_batch {
+  struct mmsghdr msgs[TCP2_BUFFER_MAX_PACKETS];
+  struct iovec iovs[TCP2_BUFFER_MAX_PACKETS];
+  char control[TCP2_BUFFER_MAX_PACKETS][TCP2_RECV_CONTROL_SIZE];
+};
+
+/*
+ * Set up a recvmmsg call that reads into the slots of an empty buffer, with
+ * the source address of every datagram going straight into its descriptor.
+ *
+ * Returns:
+ * The number of messages to pass to recvmmsg.
+ */
+unsigned tcp2_buffer_prepare_recvmmsg(struct tcp2_buffer *buffer,
+                                      struct tcp2_recv_batch *batch) {
+  unsigned count = (unsigned)(buffer->capacity / TCP2_BUFFER_SLOT_SIZE);
+  if (count > TCP2_BUFFER_MAX_PACKETS)
+    count = TCP2_BUFFER_MAX_PACKETS;
+
+  for (unsigned index = 0; index < count; ++index) {
+    batch->iovs[index].iov_base = buffer->data + index * TCP2_BUFFER_SLOT_SIZE;
+    batch->iovs[index].iov_len = TCP2_BUFFER_SLOT_SIZE;
+
+    batch->msgs[index].msg_hdr = (struct msghdr){
+      .msg_name = &buffer->packets[index].peer,
+      .msg_namelen = sizeof(union tcp2_address),
+      .msg_iov = &batch->iovs[index],
+      .msg_iovlen = 1,
+      .msg_control = batch->control[index],
+      .msg_controllen = TCP2_RECV_CONTROL_SIZE,
+    };
+  }
+
+  return count;
+}
+
+/*
+ * Fill in the addresses, ECN codepoint and timestamp of a descriptor from
+ * the control messages of a received datagram.
+ *
+ * Arguments:
+ * now: the receive time of the batch in nanoseconds, used for datagrams
+ *      without a kernel timestamp
+ */
+static void tcp2_packet_parse_control(struct tcp2_packet_descriptor *packet,
+                                      const struct msghdr *msg_hdr,
+                                      uint64_t now) {
+  packet->local.sa.sa_family = AF_UNSPEC;
+  packet->ecn = TCP2_ECN_NOT_ECT;
+  packet->timestamp = now;
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg_hdr);
+       cmsg;
+       cmsg = CMSG_NXTHDR((struct msghdr *)msg_hdr, cmsg)) {
+    if (((cmsg->cmsg_level == IPPROTO_IP) && (cmsg->cmsg_type == IP_TOS)) ||
+        ((cmsg->cmsg_level == IPPROTO_IPV6) &&
+         (cmsg->cmsg_type == IPV6_TCLASS))) {
+      int tclass = (cmsg->cmsg_len == CMSG_LEN(sizeof(uint8_t))) ?
+        *(uint8_t *)CMSG_DATA(cmsg) : *(int *)CMSG_DATA(cmsg);
+      packet->ecn = tclass & 3;
+    }
+    else
+    if ((cmsg->cmsg_level == IPPROTO_IP) &&
+        (cmsg->cmsg_type == IP_PKTINFO)) {
+      const struct in_pktinfo *info =
+        (const struct in_pktinfo *)CMSG_DATA(cmsg);
+      packet->local.sin.sin_family = AF_INET;
+      packet->local.sin.sin_addr = info->ipi_addr;
+    }
+    else
+    if ((cmsg->cmsg_level == IPPROTO_IPV6) &&
+        (cmsg->cmsg_type == IPV6_PKTINFO)) {
+      const struct in6_pktinfo *info =
+        (const struct in6_pktinfo *)CMSG_DATA(cmsg);
+      packet->local.sin6.sin6_family = AF_INET6;
+      packet->local.sin6.sin6_addr = info->ipi6_addr;
+    }
+    else
+    if ((cmsg->cmsg_level == SOL_SOCKET) &&
+        (cmsg->cmsg_type == SO_TIMESTAMPNS)) {
+      const struct timespec *ts = (const struct timespec *)CMSG_DATA(cmsg);
+      packet->timestamp =
+        (uint64_t)ts->tv_sec * 1000000000ULL + (uint64_t)ts->tv_nsec;
+    }
+  }
+}
+
+/*
+ * Complete the descriptors of a buffer after recvmmsg returned 'count'
+ * messages.  Truncated datagrams are dropped, and the descriptors of the
+ * datagrams after them move down, so that the buffer holds whole datagrams
+ * only.
+ *
+ * Arguments:
+ * now: as for tcp2_packet_parse_control
+ *
+ * Returns:
+ * The number of datagrams dropped.
+ */
+unsigned tcp2_buffer_complete_recvmmsg(struct tcp2_buffer *buffer,
+                                       const struct tcp2_recv_batch *batch,
+                                       unsigned count, uint64_t now) {
+  unsigned kept = 0;
+
+  for (unsigned index = 0; index < count; ++index) {
+    if (batch->msgs[index].msg_hdr.msg_flags & MSG_TRUNC)
+      continue;
+
+    struct tcp2_packet_descriptor *packet = &buffer->packets[kept++];
+
+    if (packet != &buffer->packets[index])
+      packet->peer = buffer->packets[index].peer;
+
+    packet->offset = index * TCP2_BUFFER_SLOT_SIZE;
+    packet->length = batch->msgs[index].msg_len;
+    tcp2_packet_parse_control(packet, &batch->msgs[index].msg_hdr, now);
+  }
+
+  buffer->packet_count = kept;
+
+  return count - kept;
+}
+
+
+
+
+
+
+/*
+ * Inside tcp2, tcp2_process walks the descriptors of buffer_in, handing each
+ * datagram with its metadata to the packet layer.  Lengths are never parsed
+ * to find datagram boundaries.
+ */
+static void tcp2_process_buffer_in(struct tcp2_context *tcp2_context,
+                                   struct tcp2_events *tcp2_events) {
+  struct tcp2_buffer *buffer_in = tcp2_events->buffer_in;
+
+  for (uint32_t index = 0; index < buffer_in->packet_count; ++index) {
+    const struct tcp2_packet_descriptor *packet = &buffer_in->packets[index];
+
+    tcp2_on_datagram(tcp2_context,
+                     buffer_in->data + packet->offset, packet->length,
+                     packet);
+  }
+}
+
+
+
+
+
+
+/*
+ * Hand a buffer of input to tcp2, and handle the output.
+ *
+ * Returns:
+ * The buffer, which still belongs to the application, or NULL when tcp2
+ * kept it to finish later, see events_in_out_3.c.
+ */
+static struct tcp2_buffer *app_tcp2_process_input(
+    struct app_context *app_context,
+    struct tcp2_buffer *buffer_in) {
+  struct tcp2_context *tcp2_context = app_get_tcp2_context(app_context);
+  struct tcp2_events *tcp2_events = &app_context->tcp2_events;
+
+  tcp2_events->buffer_in = buffer_in;
+
+  tcp2_process(tcp2_context, tcp2_events);
+
+  buffer_in = tcp2_events->buffer_in;
+  tcp2_events->buffer_in = NULL;
+
+  app_after_tcp2_process(app_context, tcp2_events);
+
+  return buffer_in;
+}
+
+/*
+ * The application reading a batch of datagrams with one system call, in
+ * place of app_network_read_udp in events_in_out_2.c.  The socket has
+ * IP_RECVTOS, IP_PKTINFO and SO_TIMESTAMPNS, or their IPv6 counterparts,
+ * enabled.
+ *
+ * Reading is readiness based here: the event loop calls this function
+ * whenever the socket is readable, and nothing is re-armed.  The function
+ * owns buffer_in from start to end, unless tcp2 keeps it, in place of
+ * app_network_on_udp_read of events_in_out_2.c, which re-arms a read into
+ * the buffer it was given.
+ */
+void app_network_on_readable(struct app_context *app_context) {
+  struct tcp2_context *tcp2_context = app_get_tcp2_context(app_context);
+  struct tcp2_buffer *buffer_in =
+    tcp2_thread_context_get_buffer(tcp2_context->thread_context);
+  struct tcp2_recv_batch batch;
+
+  if (!buffer_in)
+    return;
+
+  unsigned count = tcp2_buffer_prepare_recvmmsg(buffer_in, &batch);
+
+  int received = recvmmsg(app_context->udp_socket, batch.msgs, count,
+                          MSG_DONTWAIT, NULL);
+  if (received > 0) {
+    unsigned dropped =
+      tcp2_buffer_complete_recvmmsg(buffer_in, &batch, (unsigned)received,
+                                    app_clock_realtime_ns());
+    if (dropped > 0)
+      app_count_truncated(app_context, dropped);
+
+    buffer_in = app_tcp2_process_input(app_context, buffer_in);
+  }
+
+  if (buffer_in)
+    tcp2_destroy_buffer(buffer_in);
+}
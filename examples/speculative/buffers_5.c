@@ -0,0 +1,456 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+/*
+ * This case study builds on buffers_2.c and buffers_4.c and groups the
+ * datagrams in buffer_out into trains for UDP generic segmentation offload
+ * (GSO).
+ *
+ * When tcp2_process produces many datagrams for one peer, sending them one by
+ * one costs a system call, a route lookup and a pass through the UDP and IP
+ * layers per datagram.  With the UDP_SEGMENT socket option or control
+ * message, Linux accepts a single send of up to 64 datagrams of equal size,
+ * the last of which may be shorter, and splits them as late as possible, in
+ * the NIC where it supports it.
+ *
+ * tcp2 therefore builds buffer_out as a list of trains, each described by a
+ * packet descriptor: a destination, an ECN codepoint, a segment size, a
+ * segment count and the range of iovec entries holding it.  A train with a
+ * segment count of 1 is an ordinary datagram.  The application sends every
+ * train with one msghdr, adding a UDP_SEGMENT control message when the
+ * segment count is above 1, and the whole buffer with one sendmmsg call.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - The application tells tcp2 whether it may form trains, and of how many
+ *   segments at most, through max_segments_out in tcp2_events.  The default
+ *   of 1 disables GSO, for systems or sockets without UDP_SEGMENT.  The
+ *   application raises it when the kernel supports UDP_SEGMENT, and falls
+ *   back by setting it to 1 when it gets EIO from a train, which is how
+ *   Linux reports a device that cannot segment.
+ * - A datagram joins the current train when it has the same destination and
+ *   ECN codepoint, when the train is not full, and when its length is at most
+ *   the segment size.  A shorter datagram closes the train, as only the last
+ *   segment may be short.  tcp2 sizes the datagrams it writes to one peer
+ *   alike, the full path MTU, so bulk transfers form full trains.
+ * - Every datagram starts a new segment of the chain, so that a train is
+ *   always a whole number of iovec entries, even if its bytes would follow
+ *   on from the previous datagram in the data region.
+ * - Descriptors replace the implicit single destination of buffers_2.c,
+ *   a buffer_out may now hold output for several peers, such as a server
+ *   context answering on several paths.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * The limits of a train, as enforced by the Linux UDP layer.
+ */
+#define TCP2_GSO_MAX_SEGMENTS       64
+#define TCP2_GSO_MAX_LENGTH         (65535 - 8 - 40)
+
+
+
+/*
+ * Packet descriptor, as in buffers_4.c, with the fields of a train.
+ *
+ * offset, length: the train, within the content of the buffer
+ * segment_first, segment_count: the train, within the segment chain of the
+ *                               buffer, for sending
+ * gso_size: the length of every datagram in the train but the last
+ * gso_count: the number of datagrams in the train
+ * closed: set once a datagram shorter than gso_size was added
+ */
+struct tcp2_packet_descriptor {
+  uint32_t offset;
+  uint32_t length;
+
+  uint32_t segment_first;
+  uint32_t segment_count;
+
+  uint16_t gso_size;
+  uint16_t gso_count;
+  uint8_t closed;
+
+  union tcp2_address peer;
+  union tcp2_address local;
+
+  uint8_t ecn;
+  uint64_t timestamp;
+};
+
+/*
+ * Buffer, as in buffers_4.c, with a marker that stops appends from extending
+ * the segments of a previous datagram.
+ */
+struct tcp2_buffer {
+  char *data;
+  size_t length;
+  size_t capacity;
+
+  uint32_t segment_count;
+  uint32_t segment_sealed;
+  size_t total_length;
+  struct tcp2_buffer_segment segments[TCP2_BUFFER_MAX_SEGMENTS];
+  struct tcp2_send_region *segment_regions[TCP2_BUFFER_MAX_SEGMENTS];
+
+  uint32_t packet_count;
+  struct tcp2_packet_descriptor packets[TCP2_BUFFER_MAX_PACKETS];
+
+  const struct tcp2_allocator *allocator;
+  struct tcp2_buffer_pool *pool;
+  struct tcp2_buffer *next;
+};
+
+/*
+ * The events structure, as in events_in_out_2.c, with the GSO limit.
+ *
+ * max_segments_out: the largest train tcp2 may put in buffer_out, 1 to send
+ *                   every datagram on its own
+ */
+struct tcp2_events {
+  struct tcp2_buffer *buffer_in;
+  struct tcp2_buffer *buffer_out;
+  struct timeval timeout_out;
+
+  uint16_t max_segments_out;
+};
+
+void tcp2_events_init(struct tcp2_events *tcp2_events) {
+  tcp2_events->buffer_in = NULL;
+  tcp2_events->buffer_out = NULL;
+  tcp2_events->timeout_out = (struct timeval){0, 0};
+  tcp2_events->max_segments_out = 1;
+}
+
+
+
+/*
+ * Empty a buffer, as in buffers_4.c, including the seal.
+ */
+void tcp2_buffer_reset(struct tcp2_buffer *buffer) {
+  tcp2_buffer_release_regions(buffer, 0);
+
+  buffer->length = 0;
+  buffer->segment_count = 0;
+  buffer->segment_sealed = 0;
+  buffer->total_length = 0;
+  buffer->packet_count = 0;
+}
+
+/*
+ * Append a segment, as in buffers_3.c, extending the last segment only if it
+ * belongs to the current datagram.
+ */
+int tcp2_buffer_append_ref(struct tcp2_buffer *buffer,
+                           const void *base, size_t length) {
+  if (length == 0)
+    return 0;
+
+  if (buffer->segment_count > buffer->segment_sealed) {
+    uint32_t last = buffer->segment_count - 1;
+
+    if (!buffer->segment_regions[last] &&
+        (buffer->segments[last].base + buffer->segments[last].length ==
+         (const char *)base)) {
+      buffer->segments[last].length += length;
+      buffer->total_length += length;
+      return 0;
+    }
+  }
+
+  if (buffer->segment_count == TCP2_BUFFER_MAX_SEGMENTS)
+    return -1;
+
+  buffer->segments[buffer->segment_count] =
+    (struct tcp2_buffer_segment){ .base = base, .length = length };
+  buffer->segment_regions[buffer->segment_count] = NULL;
+  buffer->segment_count++;
+  buffer->total_length += length;
+
+  return 0;
+}
+
+
+
+/*
+ * Inside tcp2, every datagram written to buffer_out is bracketed by these
+ * two functions, which maintain the trains.
+ */
+static int tcp2_address_equal(const union tcp2_address *a,
+                              const union tcp2_address *b) {
+  if (a->sa.sa_family != b->sa.sa_family)
+    return 0;
+
+  if (a->sa.sa_family == AF_INET)
+    return (a->sin.sin_port == b->sin.sin_port) &&
+           (a->sin.sin_addr.s_addr == b->sin.sin_addr.s_addr);
+
+  return (a->sin6.sin6_port == b->sin6.sin6_port) &&
+         (memcmp(&a->sin6.sin6_addr, &b->sin6.sin6_addr,
+                 sizeof(struct in6_addr)) == 0);
+}
+
+/*
+ * Start a datagram to 'peer'.  The bytes of the datagram are then appended
+ * with the functions of buffers_2.c and buffers_3.c.
+ *
+ * Returns:
+ * 0 on success, -1 if the buffer cannot describe another train.
+ */
+static int tcp2_buffer_begin_datagram(struct tcp2_buffer *buffer,
+                                      const union tcp2_address *peer,
+                                      uint8_t ecn,
+                                      uint16_t max_segments) {
+  buffer->segment_sealed = buffer->segment_count;
+
+  if (buffer->packet_count > 0) {
+    struct tcp2_packet_descriptor *train =
+      &buffer->packets[buffer->packet_count - 1];
+
+    if (!train->closed &&
+        (train->gso_count < max_segments) &&
+        (train->gso_count < TCP2_GSO_MAX_SEGMENTS) &&
+        (train->length + train->gso_size <= TCP2_GSO_MAX_LENGTH) &&
+        (train->ecn == ecn) &&
+        tcp2_address_equal(&train->peer, peer))
+      return 0;
+  }
+
+  if (buffer->packet_count == TCP2_BUFFER_MAX_PACKETS)
+    return -1;
+
+  struct tcp2_packet_descriptor *train =
+    &buffer->packets[buffer->packet_count++];
+
+  *train = (struct tcp2_packet_descriptor){
+    .offset = (uint32_t)buffer->total_length,
+    .segment_first = buffer->segment_count,
+    .peer = *peer,
+    .ecn = ecn,
+  };
+  train->local.sa.sa_family = AF_UNSPEC;
+
+  return 0;
+}
+
+/*
+ * Finish the datagram started by tcp2_buffer_begin_datagram.  A datagram
+ * longer than the segment size of its train, which tcp2 only writes after a
+ * path MTU change, is moved to a train of its own: its segments are distinct
+ * from those of the train thanks to the seal, so this is a matter of
+ * descriptors only.
+ *
+ * Returns:
+ * 0 on success, -1 if a new train was needed and the buffer cannot describe
+ * another one, in which case the caller undoes the datagram.
+ */
+static int tcp2_buffer_end_datagram(struct tcp2_buffer *buffer) {
+  struct tcp2_packet_descriptor *train =
+    &buffer->packets[buffer->packet_count - 1];
+  uint32_t end = (uint32_t)buffer->total_length;
+  uint32_t datagram_offset = train->offset + train->length;
+  uint32_t datagram_length = end - datagram_offset;
+
+  if ((train->gso_count > 0) && (datagram_length > train->gso_size)) {
+    if (buffer->packet_count == TCP2_BUFFER_MAX_PACKETS)
+      return -1;
+
+    struct tcp2_packet_descriptor *next =
+      &buffer->packets[buffer->packet_count++];
+
+    *next = *train;
+    next->offset = datagram_offset;
+    next->length = 0;
+    next->segment_first = buffer->segment_sealed;
+    next->gso_count = 0;
+    train->segment_count = buffer->segment_sealed - train->segment_first;
+    train->closed = 1;
+    train = next;
+  }
+
+  if (train->gso_count == 0)
+    train->gso_size = (uint16_t)datagram_length;
+  else
+  if (datagram_length < train->gso_size)
+    train->closed = 1;
+
+  train->length += datagram_length;
+  train->segment_count = buffer->segment_count - train->segment_first;
+  ++train->gso_count;
+
+  return 0;
+}
+
+
+
+
+
+
+/*
+ * Inside tcp2, the connection writes its pending datagrams to buffer_out,
+ * using tcp2_connection_write_stream_packet from buffers_2.c for the content
+ * of each.
+ */
+static void tcp2_connection_write_output(struct tcp2_connection *connection,
+                                         struct tcp2_events *tcp2_events,
+                                         struct tcp2_buffer *buffer_out) {
+  while (tcp2_connection_can_send(connection)) {
+    struct tcp2_buffer_mark mark;
+
+    tcp2_buffer_mark(buffer_out, &mark);
+
+    uint32_t packet_mark = buffer_out->packet_count;
+    struct tcp2_packet_descriptor train_mark =
+      (packet_mark > 0) ? buffer_out->packets[packet_mark - 1] :
+                          (struct tcp2_packet_descriptor){0};
+
+    if (tcp2_buffer_begin_datagram(buffer_out,
+                                   tcp2_connection_peer(connection),
+                                   tcp2_connection_ecn(connection),
+                                   tcp2_events->max_segments_out) != 0)
+      break;
+
+    if ((tcp2_connection_write_stream_packet(
+           connection, tcp2_connection_next_stream(connection),
+           buffer_out) != 0) ||
+        (tcp2_buffer_end_datagram(buffer_out) != 0)) {
+      /*
+       * Out of room: undo the datagram and its descriptors, it is sent in
+       * the next buffer.
+       */
+      tcp2_buffer_rollback(buffer_out, &mark);
+      buffer_out->packet_count = packet_mark;
+      if (packet_mark > 0)
+        buffer_out->packets[packet_mark - 1] = train_mark;
+      break;
+    }
+  }
+}
+
+
+
+
+
+
+/*
+ * The application enables trains once it has its socket.  A kernel that
+ * knows UDP_SEGMENT answers getsockopt for it, older kernels fail with
+ * ENOPROTOOPT, and the default of 1 stays.  Whether the device can segment
+ * is only known from the first train, see EIO below.
+ */
+void app_on_udp_socket_created(struct app_context *app_context) {
+  int gso_size;
+  socklen_t length = sizeof(gso_size);
+
+  tcp2_events_init(&app_context->tcp2_events);
+
+  if (getsockopt(app_context->udp_socket, SOL_UDP, UDP_SEGMENT,
+                 &gso_size, &length) == 0)
+    app_context->tcp2_events.max_segments_out = TCP2_GSO_MAX_SEGMENTS;
+}
+
+/*
+ * The application sends all trains of buffer_out with a single sendmmsg
+ * call, in place of app_network_write_udp in buffers_2.c.  The socket does
+ * not need the UDP_SEGMENT option, the segment size is given per train.
+ */
+void app_network_write_udp(struct app_context *app_context,
+                           struct tcp2_buffer *buffer_out) {
+  struct mmsghdr msgs[TCP2_BUFFER_MAX_PACKETS];
+  union {
+    char buffer[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+  } control[TCP2_BUFFER_MAX_PACKETS];
+  const struct iovec *iov;
+
+  tcp2_buffer_iov(buffer_out, &iov);
+
+  for (uint32_t index = 0; index < buffer_out->packet_count; ++index) {
+    const struct tcp2_packet_descriptor *train = &buffer_out->packets[index];
+
+    msgs[index].msg_hdr = (struct msghdr){
+      .msg_name = (void *)&train->peer,
+      .msg_namelen = (train->peer.sa.sa_family == AF_INET) ?
+        sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6),
+      .msg_iov = (struct iovec *)&iov[train->segment_first],
+      .msg_iovlen = train->segment_count,
+    };
+
+    if (train->gso_count > 1) {
+      msgs[index].msg_hdr.msg_control = control[index].buffer;
+      msgs[index].msg_hdr.msg_controllen = sizeof(control[index].buffer);
+
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[index].msg_hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      memcpy(CMSG_DATA(cmsg), &train->gso_size, sizeof(uint16_t));
+    }
+  }
+
+  uint32_t sent = 0;
+  while (sent < buffer_out->packet_count) {
+    int result = sendmmsg(app_context->udp_socket, &msgs[sent],
+                          buffer_out->packet_count - sent, 0);
+    if (result < 0) {
+      if (errno == EIO)
+        app_context->tcp2_events.max_segments_out = 1;
+
+      app_count_send_error(app_context, errno);
+      break;
+    }
+
+    sent += (uint32_t)result;
+  }
+
+  tcp2_destroy_buffer(buffer_out);
+}
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+/*
+ * This case study builds on buffers_4.c and buffers_5.c and accepts
+ * datagrams coalesced by UDP generic receive offload (GRO) in buffer_in.
+ *
+ * With the UDP_GRO socket option enabled, Linux merges consecutive datagrams
+ * of one flow into a single large datagram, and reports the size of the
+ * original datagrams in a UDP_GRO control message.  One receive then
+ * delivers up to 64 datagrams.  This is the mirror image of the GSO trains
+ * of buffers_5.c, and is described by the same packet descriptor: a
+ * gso_size above 0 says that the bytes of the descriptor are a train of
+ * datagrams of that size, the last of which may be shorter.
+ *
+ * tcp2_process splits a train in place, handing each datagram to the packet
+ * layer as a pointer into the data region, without any copy.  As all
+ * datagrams of a train come from the same source address, they nearly
+ * always belong to the same connection, so the connection found for the
+ * first datagram is checked against the connection id of the following ones
+ * with a single comparison, instead of a lookup in the connection table of
+ * the thread per datagram.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - A train can be up to 64KiB, so with GRO a buffer of TCP2_BUFFER_CAPACITY
+ *   bytes holds a single train, where buffers_4.c fits 32 separate
+ *   datagrams.  The application receives into several buffers with one
+ *   recvmmsg call, and passes each to tcp2_process.  Batches of buffers are
+ *   the topic of another case study.
+ * - The kernel only coalesces datagrams with the same source and
+ *   destination addresses and the same traffic class, so the address, ECN
+ *   and timestamp fields of the descriptor apply to every datagram of the
+ *   train.
+ * - The cached connection is only reused for short header packets carrying
+ *   its current connection id.  Long header packets, packets with another
+ *   connection id, for example after the peer switched to a new one, and
+ *   packets following one that closed the connection go through the full
+ *   lookup.
+ * - The kernel flags a train that did not fit its buffer with MSG_TRUNC.
+ *   Its datagrams are laid out back to back, so those before the cut are
+ *   whole and kept, only the cut one is dropped.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * The control message space needed per train: as in buffers_4.c, plus the
+ * segment size.
+ */
+#define TCP2_RECV_GRO_CONTROL_SIZE \
+  (TCP2_RECV_CONTROL_SIZE + CMSG_SPACE(sizeof(int)))
+
+/*
+ * The largest number of buffers received into with one recvmmsg call.
+ */
+#define TCP2_RECV_GRO_MAX_BATCH     64
+
+/*
+ * The arguments of one recvmmsg call that receives a train into each of
+ * 'count' buffers, kept by the application.  'count' is at most
+ * TCP2_RECV_GRO_MAX_BATCH.
+ */
+struct tcp2_recv_gro_batch {
+  struct tcp2_buffer *buffers[TCP2_RECV_GRO_MAX_BATCH];
+  struct mmsghdr msgs[TCP2_RECV_GRO_MAX_BATCH];
+  struct iovec iovs[TCP2_RECV_GRO_MAX_BATCH];
+  char control[TCP2_RECV_GRO_MAX_BATCH][TCP2_RECV_GRO_CONTROL_SIZE];
+  unsigned count;
+};
+
+/*
+ * Set up a recvmmsg call that receives one train into the whole data region
+ * of each buffer of the batch.
+ */
+void tcp2_prepare_recvmmsg_gro(struct tcp2_recv_gro_batch *batch) {
+  for (unsigned index = 0; index < batch->count; ++index) {
+    struct tcp2_buffer *buffer = batch->buffers[index];
+
+    batch->iovs[index].iov_base = buffer->data;
+    batch->iovs[index].iov_len = buffer->capacity;
+
+    batch->msgs[index].msg_hdr = (struct msghdr){
+      .msg_name = &buffer->packets[0].peer,
+      .msg_namelen = sizeof(union tcp2_address),
+      .msg_iov = &batch->iovs[index],
+      .msg_iovlen = 1,
+      .msg_control = batch->control[index],
+      .msg_controllen = TCP2_RECV_GRO_CONTROL_SIZE,
+    };
+  }
+}
+
+/*
+ * Complete the descriptor of each buffer after recvmmsg returned 'count'
+ * messages.  tcp2_packet_parse_control of buffers_4.c fills in the
+ * addresses, ECN codepoint and timestamp, the UDP_GRO control message is
+ * handled here.
+ *
+ * A train truncated by the kernel keeps its whole datagrams and loses the
+ * cut one, and a truncated single datagram leaves its buffer empty.
+ *
+ * Returns:
+ * The number of trains that were truncated.
+ */
+unsigned tcp2_complete_recvmmsg_gro(struct tcp2_recv_gro_batch *batch,
+                                    unsigned count, uint64_t now) {
+  unsigned truncated = 0;
+
+  for (unsigned index = 0; index < count; ++index) {
+    struct msghdr *msg_hdr = &batch->msgs[index].msg_hdr;
+    struct tcp2_buffer *buffer = batch->buffers[index];
+    struct tcp2_packet_descriptor *packet = &buffer->packets[0];
+
+    packet->offset = 0;
+    packet->length = batch->msgs[index].msg_len;
+    packet->gso_size = 0;
+    tcp2_packet_parse_control(packet, msg_hdr, now);
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg_hdr);
+         cmsg;
+         cmsg = CMSG_NXTHDR(msg_hdr, cmsg)) {
+      if ((cmsg->cmsg_level == SOL_UDP) && (cmsg->cmsg_type == UDP_GRO)) {
+        int gso_size;
+        memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(int));
+        packet->gso_size = (uint16_t)gso_size;
+      }
+    }
+
+    if (msg_hdr->msg_flags & MSG_TRUNC) {
+      truncated++;
+
+      if (packet->gso_size)
+        packet->length -= packet->length % packet->gso_size;
+      else
+        packet->length = 0;
+
+      if (packet->length == 0) {
+        buffer->packet_count = 0;
+        continue;
+      }
+    }
+
+    packet->gso_count = packet->gso_size ?
+      (uint16_t)((packet->length + packet->gso_size - 1) / packet->gso_size) :
+      1;
+
+    buffer->packet_count = 1;
+  }
+
+  return truncated;
+}
+
+
+
+
+
+
+/*
+ * Inside tcp2, buffer_in is walked as in buffers_4.c, with every train split
+ * into its datagrams.
+ */
+static int tcp2_connection_matches(const struct tcp2_connection *connection,
+                                   const char *datagram, size_t length) {
+  const struct tcp2_connection_id *id =
+    tcp2_connection_local_id(connection);
+
+  return !tcp2_connection_closed(connection) &&
+         ((datagram[0] & 0x80) == 0) &&
+         (length > id->length) &&
+         (memcmp(datagram + 1, id->bytes, id->length) == 0);
+}
+
+static void tcp2_process_buffer_in(struct tcp2_context *tcp2_context,
+                                   struct tcp2_events *tcp2_events) {
+  struct tcp2_buffer *buffer_in = tcp2_events->buffer_in;
+
+  for (uint32_t index = 0; index < buffer_in->packet_count; ++index) {
+    const struct tcp2_packet_descriptor *packet = &buffer_in->packets[index];
+    const char *train = buffer_in->data + packet->offset;
+    uint32_t gso_size = packet->gso_size ? packet->gso_size : packet->length;
+    struct tcp2_connection *connection = NULL;
+
+    for (uint32_t offset = 0; offset < packet->length; offset += gso_size) {
+      const char *datagram = train + offset;
+      size_t length = packet->length - offset;
+      if (length > gso_size)
+        length = gso_size;
+
+      if (!connection ||
+          !tcp2_connection_matches(connection, datagram, length)) {
+        connection = tcp2_context_lookup_connection(tcp2_context,
+                                                    datagram, length,
+                                                    &packet->peer);
+      }
+
+      if (connection)
+        tcp2_connection_on_datagram(connection, datagram, length, packet);
+      else
+        tcp2_context_on_unknown_datagram(tcp2_context, datagram, length,
+                                         packet);
+    }
+  }
+}
+
+
+
+
+
+
+/*
+ * The application receiving trains, in place of app_network_on_readable in
+ * buffers_4.c, with app_tcp2_process_input from there.  The socket has
+ * UDP_GRO enabled in addition to the options listed there.
+ */
+void app_network_on_readable(struct app_context *app_context) {
+  struct tcp2_context *tcp2_context = app_get_tcp2_context(app_context);
+  struct tcp2_recv_gro_batch batch;
+
+  unsigned batch_size = app_context->options.gro_batch_size;
+  if (batch_size > TCP2_RECV_GRO_MAX_BATCH)
+    batch_size = TCP2_RECV_GRO_MAX_BATCH;
+
+  /*
+   * Receive into as many buffers as the pool could provide.
+   */
+  for (batch.count = 0; batch.count < batch_size; ++batch.count) {
+    batch.buffers[batch.count] =
+      tcp2_thread_context_get_buffer(tcp2_context->thread_context);
+    if (!batch.buffers[batch.count])
+      break;
+  }
+
+  if (batch.count == 0)
+    return;
+
+  tcp2_prepare_recvmmsg_gro(&batch);
+
+  int received = recvmmsg(app_context->udp_socket, batch.msgs, batch.count,
+                          MSG_DONTWAIT, NULL);
+  if (received > 0) {
+    unsigned truncated =
+      tcp2_complete_recvmmsg_gro(&batch, (unsigned)received,
+                                 app_clock_realtime_ns());
+    if (truncated > 0)
+      app_count_truncated(app_context, truncated);
+
+    for (int index = 0; index < received; ++index) {
+      batch.buffers[index] =
+        app_tcp2_process_input(app_context, batch.buffers[index]);
+    }
+  }
+
+  /*
+   * Buffers that tcp2 kept are NULL, the rest go back to the pool.
+   */
+  for (unsigned index = 0; index < batch.count; ++index) {
+    if (batch.buffers[index])
+      tcp2_destroy_buffer(batch.buffers[index]);
+  }
+}
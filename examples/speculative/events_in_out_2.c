@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+/*
+ * This case study revisits events_in_out_1.c with buffers that are reused
+ * across calls to tcp2_process, using the per thread buffer pool shown in
+ * buffers_1.c.
+ *
+ * In events_in_out_1.c a tcp2_events structure is built on the stack for
+ * every event, with a newly created buffer_out, which is destroyed again
+ * whenever tcp2 produced nothing.  Here:
+ * - The application keeps one tcp2_events structure per tcp2 context, for
+ *   as long as the context lives.
+ * - buffer_out may be NULL on entry to tcp2_process.  tcp2 only takes a
+ *   buffer from the pool of the thread context once it actually has output,
+ *   so the many events that produce nothing cost no buffer at all.
+ * - If buffer_out is not NULL on entry, tcp2 appends to it.
+ * - After tcp2_process returns, the application either consumes buffer_out,
+ *   taking ownership and setting the field to NULL, or leaves it where it is
+ *   for the next call.  An empty buffer left in place is simply reused.
+ * - tcp2_events_cleanup returns a buffer_out that was never consumed to the
+ *   pool when the context goes away.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - This amends an assumption of events_in_out_1.c: tcp2 now does obtain
+ *   output buffers itself, from the pool of the thread context.  An
+ *   application that wants to provide its own buffers still can, by setting
+ *   buffer_out before the call.
+ * - Leaving a non empty buffer_out in place is allowed, tcp2 appends to it,
+ *   which lets an application that is temporarily unable to send collect the
+ *   output of several calls.  Once it is full, tcp2 keeps the rest of its
+ *   output queued internally until the buffer has been consumed.
+ * - Consumed buffers are destroyed by whoever consumes them, which returns
+ *   them to the pool when that happens on the thread of the thread context.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * The events structure, which was left undefined in events_in_out_1.c.
+ */
+struct tcp2_events {
+  struct tcp2_buffer *buffer_in;
+  struct tcp2_buffer *buffer_out;
+  struct timeval timeout_out;
+};
+
+void tcp2_events_init(struct tcp2_events *tcp2_events) {
+  tcp2_events->buffer_in = NULL;
+  tcp2_events->buffer_out = NULL;
+  tcp2_events->timeout_out = (struct timeval){0, 0};
+}
+
+void tcp2_events_cleanup(struct tcp2_events *tcp2_events) {
+  if (tcp2_events->buffer_out) {
+    tcp2_destroy_buffer(tcp2_events->buffer_out);
+    tcp2_events->buffer_out = NULL;
+  }
+}
+
+
+
+/*
+ * Inside tcp2, output is written through this helper, which obtains the
+ * output buffer on first use.
+ *
+ * Returns:
+ * The buffer to write output to, or NULL when no buffer could be obtained,
+ * in which case the output stays queued for a later call.
+ */
+static struct tcp2_buffer *tcp2_events_get_buffer_out(
+    struct tcp2_context *tcp2_context,
+    struct tcp2_events *tcp2_events) {
+  if (!tcp2_events->buffer_out) {
+    tcp2_events->buffer_out =
+      tcp2_thread_context_get_buffer(tcp2_context->thread_context);
+  }
+
+  return tcp2_events->buffer_out;
+}
+
+
+
+
+
+
+/*
+ * The handling of tcp2 output common to both events.
+ */
+static void app_after_tcp2_process(struct app_context *app_context,
+                                   struct tcp2_events *tcp2_events) {
+  if (!app_timer_keep_old_timeout(app_context, &tcp2_events->timeout_out)) {
+    app_timer_schedule(app_context,
+                       &tcp2_events->timeout_out,
+                       &app_timer_on_timeout);
+  }
+
+  tcp2_events->timeout_out = (struct timeval){0, 0};
+
+  /*
+   * Consume buffer_out only when there is something to send.  An empty
+   * buffer stays in place for the next call.
+   */
+  if (tcp2_events->buffer_out && !tcp2_buffer_empty(tcp2_events->buffer_out)) {
+    /*
+     * buffer_out is now property of the app's network layer, which destroys
+     * it once it has been sent.
+     */
+    app_network_write_udp(app_context, tcp2_events->buffer_out);
+    tcp2_events->buffer_out = NULL;
+  }
+}
+
+
+
+/*
+ * app_network_on_udp_read:
+ *
+ * As in events_in_out_1.c, with the events structure of the tcp2 context
+ * kept in the application context.
+ */
+void app_network_on_udp_read(struct app_context *app_context,
+                             struct tcp2_buffer *buffer_in) {
+  struct tcp2_context *tcp2_context = app_get_tcp2_context(app_context);
+
+  /*
+   * Initialised with tcp2_events_init when the tcp2 context was created, and
+   * cleaned up with tcp2_events_cleanup when it is destroyed.
+   */
+  struct tcp2_events *tcp2_events = &app_context->tcp2_events;
+
+  tcp2_events->buffer_in = buffer_in;
+
+  tcp2_process(tcp2_context, tcp2_events);
+
+  tcp2_events->buffer_in = NULL;
+
+  app_after_tcp2_process(app_context, tcp2_events);
+
+  /*
+   * Prepare for more udp packet reads from the network layer
+   */
+  app_network_read_udp(app_context, buffer_in, &app_network_on_udp_read);
+}
+
+/*
+ * app_timer_on_timeout
+ *
+ * No buffer is created here at all, tcp2 takes one only if the timeout
+ * produces output, a retransmission for example.
+ */
+void app_timer_on_timeout(struct app_context *app_context) {
+  struct tcp2_context *tcp2_context = app_get_tcp2_context(app_context);
+
+  tcp2_process(tcp2_context, &app_context->tcp2_events);
+
+  app_after_tcp2_process(app_context, &app_context->tcp2_events);
+}
@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+/*
+ * This case study builds on events_in_out_2.c and turns the 'nice to have'
+ * deadline timer of events_in_out_1.c into a field of tcp2_events.
+ *
+ * A single call to tcp2_process may have a lot of work to do: a burst of 64
+ * datagrams, each acknowledging data, followed by loss detection and the
+ * retransmissions it triggers, and the writing of new output.  For an event
+ * loop that serves other sockets, or other tcp2 contexts, such a call is a
+ * stall of possibly milliseconds.
+ *
+ * Here the application passes a relative deadline with every call.  tcp2
+ * works through its input, its expired timers and its output in small
+ * steps, and checks the clock between steps.  When the deadline has passed
+ * it stops, leaves the rest of its work queued within the context, and
+ * returns with the TCP2_EVENTS_INCOMPLETE flag set.  The next call to
+ * tcp2_process, with or without new input, resumes where the previous one
+ * stopped before it does anything else.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - The deadline is relative, like timeout_out, and {0, 0} means no
+ *   deadline.  It is converted to an absolute time with the clock read that
+ *   tcp2_process makes on entry anyway.
+ * - The deadline is checked after every TCP2_DEADLINE_CHECK_STEPS steps, a
+ *   step being one datagram, one timer or one output datagram, so that
+ *   clock reads stay a small fraction of the work.  A call may therefore
+ *   overrun its deadline by the time of a few steps.
+ * - Every phase of a call, input, expired timers and output, makes progress
+ *   on at least one step, however short the deadline.  Once the deadline
+ *   has passed, each remaining phase still runs a single step.  Under
+ *   sustained input with a tight deadline, loss detection and ack timers
+ *   still run and acks still go out, a datagram per call at worst, rather
+ *   than being starved by the input, which would only make peers retransmit
+ *   and add to the load.  It also means an application cannot livelock tcp2.
+ * - Input that has not been processed when the deadline passes must stay
+ *   valid.  tcp2 keeps the buffer: it moves buffer_in to the queue of its
+ *   context and sets the field to NULL, which tells the application that it
+ *   must neither reuse nor destroy the buffer.  tcp2 destroys it, returning
+ *   it to the pool, once it has been processed.  New input passed while
+ *   older input is queued is queued behind it, so datagrams are always
+ *   processed in the order they were received.
+ * - Expired timers and pending output need no such care: an expired timer
+ *   stays at the head of the event chain until it has been run, and a
+ *   connection keeps its unsent data until it has been written.
+ * - When a call returns incomplete, the application calls tcp2_process
+ *   again soon, but after giving its other events a turn, for example from
+ *   a deferred callback of its event loop.  timeout_out still reports the
+ *   next scheduled event, as the deferred call may be delayed.
+ * ----END DISCUSSION----
+ */
+
+
+
+#define TCP2_DEADLINE_CHECK_STEPS   8
+
+/*
+ * Flags of tcp2_events.
+ *
+ * TCP2_EVENTS_INCOMPLETE: the deadline passed before tcp2 finished its work
+ */
+#define TCP2_EVENTS_INCOMPLETE      0x1
+
+
+
+/*
+ * The events structure, as in buffers_5.c, with the deadline.
+ *
+ * deadline_in: the time tcp2_process may spend working, {0, 0} for no limit
+ * flags_out: set by tcp2_process, a combination of TCP2_EVENTS_* flags
+ */
+struct tcp2_events {
+  struct tcp2_buffer *buffer_in;
+  struct tcp2_buffer *buffer_out;
+  struct timeval timeout_out;
+
+  uint16_t max_segments_out;
+
+  struct timeval deadline_in;
+  uint32_t flags_out;
+};
+
+void tcp2_events_init(struct tcp2_events *tcp2_events) {
+  tcp2_events->buffer_in = NULL;
+  tcp2_events->buffer_out = NULL;
+  tcp2_events->timeout_out = (struct timeval){0, 0};
+  tcp2_events->max_segments_out = 1;
+  tcp2_events->deadline_in = (struct timeval){0, 0};
+  tcp2_events->flags_out = 0;
+}
+
+
+
+/*
+ * Inside tcp2, the context keeps the input it has not finished, and the
+ * position within the first queued buffer: a packet descriptor, and for a
+ * train of buffers_6.c, an offset within it.
+ */
+struct tcp2_input_queue {
+  struct tcp2_buffer *head;
+  struct tcp2_buffer *tail;
+  uint32_t packet_index;
+  uint32_t packet_offset;
+};
+
+/*
+ * The budget of one call to tcp2_process.
+ *
+ * expired: the deadline has passed, for the rest of the call
+ * passed: the current phase must stop
+ */
+struct tcp2_deadline {
+  uint64_t expires;
+  uint32_t steps;
+  int expired;
+  int passed;
+};
+
+static void tcp2_deadline_init(struct tcp2_deadline *deadline,
+                               uint64_t now,
+                               const struct timeval *relative) {
+  deadline->expires = ((relative->tv_sec == 0) && (relative->tv_usec == 0)) ?
+    UINT64_MAX :
+    now + (uint64_t)relative->tv_sec * 1000000000ULL +
+      (uint64_t)relative->tv_usec * 1000ULL;
+  deadline->steps = 0;
+  deadline->expired = 0;
+  deadline->passed = 0;
+}
+
+/*
+ * Start a phase.  After the deadline has passed, this grants the phase its
+ * single step.
+ */
+static void tcp2_deadline_start_phase(struct tcp2_deadline *deadline) {
+  deadline->passed = 0;
+}
+
+/*
+ * Account for a step, reading the clock every TCP2_DEADLINE_CHECK_STEPS
+ * steps.
+ *
+ * Returns:
+ * Non zero once the current phase must stop.
+ */
+static int tcp2_deadline_step(struct tcp2_deadline *deadline) {
+  if (deadline->expired ||
+      ((++deadline->steps % TCP2_DEADLINE_CHECK_STEPS == 0) &&
+       (deadline->expires != UINT64_MAX) &&
+       (tcp2_clock_monotonic_ns() >= deadline->expires))) {
+    deadline->expired = 1;
+    deadline->passed = 1;
+  }
+
+  return deadline->passed;
+}
+
+
+
+/*
+ * Process the datagrams of a buffer, one per step, as tcp2_process_buffer_in
+ * in buffers_6.c does, but from and up to a saved position.
+ *
+ * Returns:
+ * Non zero once all datagrams of the buffer have been processed.
+ */
+static int tcp2_process_buffer(struct tcp2_context *tcp2_context,
+                               const struct tcp2_buffer *buffer,
+                               uint32_t *packet_index,
+                               uint32_t *packet_offset,
+                               struct tcp2_deadline *deadline) {
+  while ((*packet_index < buffer->packet_count) && !deadline->passed) {
+    const struct tcp2_packet_descriptor *packet =
+      &buffer->packets[*packet_index];
+    uint32_t gso_size = packet->gso_size ? packet->gso_size : packet->length;
+    struct tcp2_connection *connection = NULL;
+
+    /*
+     * The connection of a train is cached as in buffers_6.c.  A train
+     * resumed in the middle starts with a lookup.
+     */
+    while ((*packet_offset < packet->length) && !deadline->passed) {
+      const char *datagram = buffer->data + packet->offset + *packet_offset;
+      uint32_t length = packet->length - *packet_offset;
+      if (length > gso_size)
+        length = gso_size;
+
+      if (!connection ||
+          !tcp2_connection_matches(connection, datagram, length)) {
+        connection = tcp2_context_lookup_connection(tcp2_context,
+                                                    datagram, length,
+                                                    &packet->peer);
+      }
+
+      if (connection)
+        tcp2_connection_on_datagram(connection, datagram, length, packet);
+      else
+        tcp2_context_on_unknown_datagram(tcp2_context, datagram, length,
+                                         packet);
+
+      *packet_offset += length;
+      tcp2_deadline_step(deadline);
+    }
+
+    if (*packet_offset >= packet->length) {
+      ++*packet_index;
+      *packet_offset = 0;
+    }
+  }
+
+  return *packet_index == buffer->packet_count;
+}
+
+/*
+ * Process the queued input, destroying every buffer once it is done.
+ */
+static void tcp2_process_input_queue(struct tcp2_context *tcp2_context,
+                                     struct tcp2_deadline *deadline) {
+  struct tcp2_input_queue *queue = &tcp2_context->input_queue;
+
+  while (queue->head &&
+         tcp2_process_buffer(tcp2_context, queue->head,
+                             &queue->packet_index, &queue->packet_offset,
+                             deadline)) {
+    struct tcp2_buffer *buffer = queue->head;
+
+    queue->head = buffer->next;
+    if (!queue->head)
+      queue->tail = NULL;
+    queue->packet_index = 0;
+    queue->packet_offset = 0;
+
+    buffer->next = NULL;
+    tcp2_destroy_buffer(buffer);
+  }
+}
+
+static void tcp2_input_queue_push(struct tcp2_input_queue *queue,
+                                  struct tcp2_buffer *buffer) {
+  buffer->next = NULL;
+
+  if (queue->tail)
+    queue->tail->next = buffer;
+  else
+    queue->head = buffer;
+
+  queue->tail = buffer;
+}
+
+
+
+/*
+ * tcp2_process with a deadline.  The phases are the same as before: input,
+ * expired timers, then output.  Every phase stops when the deadline passes,
+ * after its guaranteed step, and the next call starts over with the first
+ * phase, which continues from the saved position.
+ */
+void tcp2_process(struct tcp2_context *tcp2_context,
+                  struct tcp2_events *tcp2_events) {
+  struct tcp2_input_queue *queue = &tcp2_context->input_queue;
+  struct tcp2_buffer *buffer_in = tcp2_events->buffer_in;
+  struct tcp2_deadline deadline;
+  uint64_t now = tcp2_clock_monotonic_ns();
+
+  tcp2_deadline_init(&deadline, now, &tcp2_events->deadline_in);
+  tcp2_events->flags_out = 0;
+
+  tcp2_thread_context_drain_remote_frees(tcp2_context->thread_context);
+
+  tcp2_process_input_queue(tcp2_context, &deadline);
+
+  if (buffer_in) {
+    if (queue->head) {
+      /*
+       * Older input is still queued, the new input waits behind it.
+       */
+      tcp2_input_queue_push(queue, buffer_in);
+      tcp2_events->buffer_in = NULL;
+    }
+    else {
+      /*
+       * The common case: the input is processed in place, and only queued,
+       * with the position reached, when the deadline passes before the end
+       * of it.
+       */
+      uint32_t packet_index = 0;
+      uint32_t packet_offset = 0;
+
+      if (!tcp2_process_buffer(tcp2_context, buffer_in,
+                               &packet_index, &packet_offset, &deadline)) {
+        tcp2_input_queue_push(queue, buffer_in);
+        queue->packet_index = packet_index;
+        queue->packet_offset = packet_offset;
+        tcp2_events->buffer_in = NULL;
+      }
+    }
+  }
+
+  tcp2_deadline_start_phase(&deadline);
+
+  while (!deadline.passed &&
+         tcp2_context_run_expired_timer(tcp2_context, now))
+    tcp2_deadline_step(&deadline);
+
+  tcp2_deadline_start_phase(&deadline);
+
+  tcp2_context_write_output(tcp2_context, tcp2_events, &deadline);
+
+  if (deadline.expired)
+    tcp2_events->flags_out |= TCP2_EVENTS_INCOMPLETE;
+
+  tcp2_context_get_timeout(tcp2_context, now, &tcp2_events->timeout_out);
+}
+
+
+
+
+
+
+/*
+ * The handling of tcp2 output common to all events, as in
+ * events_in_out_2.c, with a deferred call when tcp2 is not done.
+ */
+static void app_after_tcp2_process(struct app_context *app_context,
+                                   struct tcp2_events *tcp2_events) {
+  if (!app_timer_keep_old_timeout(app_context, &tcp2_events->timeout_out)) {
+    app_timer_schedule(app_context,
+                       &tcp2_events->timeout_out,
+                       &app_timer_on_timeout);
+  }
+
+  tcp2_events->timeout_out = (struct timeval){0, 0};
+
+  if (tcp2_events->buffer_out && !tcp2_buffer_empty(tcp2_events->buffer_out)) {
+    app_network_write_udp(app_context, tcp2_events->buffer_out);
+    tcp2_events->buffer_out = NULL;
+  }
+
+  /*
+   * Run the rest of the work once the event loop has given its other ready
+   * events a turn.
+   */
+  if (tcp2_events->flags_out & TCP2_EVENTS_INCOMPLETE)
+    app_loop_defer(app_context, &app_on_tcp2_resume);
+}
+
+/*
+ * app_on_tcp2_resume
+ *
+ * A deferred callback of the event loop, which continues the work of an
+ * incomplete call.
+ */
+void app_on_tcp2_resume(struct app_context *app_context) {
+  struct tcp2_context *tcp2_context = app_get_tcp2_context(app_context);
+
+  tcp2_process(tcp2_context, &app_context->tcp2_events);
+
+  app_after_tcp2_process(app_context, &app_context->tcp2_events);
+}
+
+/*
+ * app_network_on_udp_read:
+ *
+ * As in events_in_out_2.c, with the deadline taken from the options of the
+ * application, and with a new buffer for the next read whenever tcp2 kept
+ * the last one.
+ */
+void app_network_on_udp_read(struct app_context *app_context,
+                             struct tcp2_buffer *buffer_in) {
+  struct tcp2_context *tcp2_context = app_get_tcp2_context(app_context);
+  struct tcp2_events *tcp2_events = &app_context->tcp2_events;
+
+  tcp2_events->buffer_in = buffer_in;
+  tcp2_events->deadline_in = app_context->options.tcp2_deadline;
+
+  tcp2_process(tcp2_context, tcp2_events);
+
+  if (!tcp2_events->buffer_in) {
+    buffer_in = tcp2_thread_context_get_buffer(tcp2_context->thread_context);
+  }
+
+  tcp2_events->buffer_in = NULL;
+
+  app_after_tcp2_process(app_context, tcp2_events);
+
+  app_network_read_udp(app_context, buffer_in, &app_network_on_udp_read);
+}
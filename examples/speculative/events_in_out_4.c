@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+/*
+ * This case study settles the DISCUSSION on timeout_out in events_in_out_1.c
+ * by offering both of its options, selected per tcp2_context, and defines
+ * app_timer_keep_old_timeout, which until now was a 'magic' function of the
+ * application.
+ *
+ * TCP2_TIMEOUT_ALWAYS, the default, is the first option: every call reports
+ * the time until the next scheduled event.  Simple, but an application that
+ * follows it re-arms its timer after every call, a system call with epoll
+ * timeouts or a timerfd, and most calls do not move the earliest event at
+ * all: an ack received moves the loss timer of one connection among many.
+ *
+ * TCP2_TIMEOUT_ON_CHANGE is the second option.  The context remembers the
+ * absolute time it last reported, which is when the timer of the
+ * application will fire, and only reports again when that has to change.
+ *
+ * The contract, identical in both modes, so that applications are written
+ * once:
+ * - tcp2_process sets TCP2_EVENTS_TIMEOUT_CHANGED in flags_out when the
+ *   application must act on timeout_out.  Without the flag, whatever timer
+ *   the application has armed for the context stays armed as it is.
+ * - With the flag, a timeout_out of {0, 0} means that no event is scheduled
+ *   and the timer is to be cancelled, any other value that the timer is to
+ *   be re-armed to fire after timeout_out.
+ * - In TCP2_TIMEOUT_ALWAYS mode the flag is always set.
+ * - An application that drops its timer for a reason of its own, such as
+ *   moving the context to another event loop, calls
+ *   tcp2_context_forget_timeout, so that the next call reports again.
+ * app_timer_keep_old_timeout is then no more than a test of the flag.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - The timeout is reported when the earliest event moved earlier than the
+ *   reported time, and not when it moved later.  A later move makes the
+ *   timer of the application fire early, and the call to tcp2_process that
+ *   follows runs nothing and reports the real time: one wasted wakeup,
+ *   against a re-arm for every ack that pushes the loss timer back.  Moves
+ *   later by more than TCP2_TIMEOUT_LATER_REPORT are reported anyway.  So
+ *   is the last event of a context going away, such as its last connection
+ *   going idle, which counts as a move later beyond any limit: the timer is
+ *   cancelled rather than left to fire for nothing.
+ * - Once the reported time has passed, the timer of the application has
+ *   fired or is about to, and is treated as if there were none: the next
+ *   call reports whatever is scheduled.
+ * - Times are compared in ticks of the timing wheel of timers_1.c, so that
+ *   moves within a tick are never reported.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * Timeout reporting modes.
+ */
+#define TCP2_TIMEOUT_ALWAYS         0
+#define TCP2_TIMEOUT_ON_CHANGE      1
+
+/*
+ * Flags of tcp2_events, in addition to those of events_in_out_3.c.
+ *
+ * TCP2_EVENTS_TIMEOUT_CHANGED: timeout_out is to be acted upon
+ */
+#define TCP2_EVENTS_TIMEOUT_CHANGED 0x2
+
+/*
+ * A move of the earliest event later than the reported time by more than
+ * this, in nanoseconds, is reported.
+ */
+#define TCP2_TIMEOUT_LATER_REPORT   (1000ULL * 1000 * 1000)
+
+/*
+ * The 'nothing reported' value of the reported time.
+ */
+#define TCP2_TIMEOUT_NONE           UINT64_MAX
+
+
+
+void tcp2_context_set_timeout_mode(struct tcp2_context *tcp2_context,
+                                   int mode) {
+  tcp2_context->timeout_mode = mode;
+  tcp2_context->timeout_reported = TCP2_TIMEOUT_NONE;
+}
+
+void tcp2_context_forget_timeout(struct tcp2_context *tcp2_context) {
+  tcp2_context->timeout_reported = TCP2_TIMEOUT_NONE;
+}
+
+
+
+/*
+ * Inside tcp2, tcp2_context_get_timeout of timers_1.c becomes the last step
+ * of tcp2_process.
+ */
+static void tcp2_timeout_to_timeval(uint64_t tick, uint64_t now,
+                                    struct timeval *timeout_out) {
+  /*
+   * At least a microsecond, as {0, 0} means that no event is scheduled.
+   */
+  uint64_t when = tick << TCP2_TIMER_TICK_SHIFT;
+  uint64_t relative = (when > now) ? (when - now + 999) / 1000 : 1;
+
+  timeout_out->tv_sec = relative / 1000000;
+  timeout_out->tv_usec = relative % 1000000;
+}
+
+void tcp2_context_report_timeout(struct tcp2_context *tcp2_context,
+                                 uint64_t now,
+                                 struct tcp2_events *tcp2_events) {
+  uint64_t next = tcp2_timer_wheel_next_expiry(&tcp2_context->timers);
+  uint64_t reported = tcp2_context->timeout_reported;
+  uint64_t now_tick = now >> TCP2_TIMER_TICK_SHIFT;
+
+  if (tcp2_context->timeout_mode == TCP2_TIMEOUT_ON_CHANGE) {
+    int armed = (reported != TCP2_TIMEOUT_NONE) && (reported > now_tick);
+
+    if (armed && (next != TCP2_TIMEOUT_NONE) && (next >= reported) &&
+        (next - reported <=
+           (TCP2_TIMEOUT_LATER_REPORT >> TCP2_TIMER_TICK_SHIFT)))
+      return;
+
+    if (!armed && (next == TCP2_TIMEOUT_NONE) &&
+        (reported == TCP2_TIMEOUT_NONE))
+      return;
+  }
+
+  tcp2_events->flags_out |= TCP2_EVENTS_TIMEOUT_CHANGED;
+  tcp2_context->timeout_reported = next;
+
+  if (next == TCP2_TIMEOUT_NONE)
+    tcp2_events->timeout_out = (struct timeval){0, 0};
+  else
+    tcp2_timeout_to_timeval(next, now, &tcp2_events->timeout_out);
+}
+
+
+
+
+
+
+/*
+ * The application side of the contract.
+ */
+int app_timer_keep_old_timeout(struct app_context *app_context,
+                               const struct tcp2_events *tcp2_events) {
+  return !(tcp2_events->flags_out & TCP2_EVENTS_TIMEOUT_CHANGED);
+}
+
+/*
+ * The handling of tcp2 output common to all events, as in
+ * events_in_out_3.c, with the timer cancelled when nothing is scheduled.
+ */
+static void app_after_tcp2_process(struct app_context *app_context,
+                                   struct tcp2_events *tcp2_events) {
+  if (!app_timer_keep_old_timeout(app_context, tcp2_events)) {
+    if ((tcp2_events->timeout_out.tv_sec == 0) &&
+        (tcp2_events->timeout_out.tv_usec == 0))
+      app_timer_cancel(app_context);
+    else
+      app_timer_schedule(app_context,
+                         &tcp2_events->timeout_out,
+                         &app_timer_on_timeout);
+  }
+
+  tcp2_events->timeout_out = (struct timeval){0, 0};
+
+  if (tcp2_events->buffer_out && !tcp2_buffer_empty(tcp2_events->buffer_out)) {
+    app_network_write_udp(app_context, tcp2_events->buffer_out);
+    tcp2_events->buffer_out = NULL;
+  }
+
+  if (tcp2_events->flags_out & TCP2_EVENTS_INCOMPLETE)
+    app_loop_defer(app_context, &app_on_tcp2_resume);
+}
+
+/*
+ * The application selects the mode once, when it creates the context.  A
+ * timerfd per context makes every re-arm a system call, which is what the
+ * mode saves.
+ */
+void app_on_tcp2_context_created(struct app_context *app_context,
+                                 struct tcp2_context *tcp2_context) {
+  tcp2_context_set_timeout_mode(tcp2_context, TCP2_TIMEOUT_ON_CHANGE);
+
+  tcp2_events_init(&app_context->tcp2_events);
+  app_context->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+}
+
+/*
+ * The event loop of the application moves the context to another thread:
+ * the old timer is gone, so tcp2 has to report again.
+ */
+void app_on_tcp2_context_moved(struct app_context *app_context,
+                               struct tcp2_context *tcp2_context) {
+  tcp2_context_forget_timeout(tcp2_context);
+}
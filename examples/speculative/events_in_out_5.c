@@ -0,0 +1,684 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+/*
+ * This case study adds a second entry point next to tcp2_process:
+ * tcp2_thread_process, which processes the events of all tcp2 contexts of a
+ * thread context in one call.
+ *
+ * A thread serves thousands of connections, spread over its tcp2 contexts.
+ * With tcp2_process the application demultiplexes every datagram to its
+ * context itself, and makes a call per context per event, each with its own
+ * clock read, its own housekeeping, its own output buffer and its own send,
+ * and its own timer to arm.
+ *
+ * tcp2_thread_process takes:
+ * - a batch of input buffers, as filled by one recvmmsg call with the
+ *   helpers of buffers_4.c or buffers_6.c
+ * - the current time, read once by the application
+ * - a deadline, as in events_in_out_3.c
+ * and:
+ * - demultiplexes every datagram to its connection, through the connection
+ *   table of the thread context, reusing the lookup for the datagrams of a
+ *   train as in buffers_6.c
+ * - runs the expired timers of every context of the thread, found through
+ *   a timing wheel of the thread context that holds a single wakeup timer
+ *   per context
+ * - writes the output of all contexts into one set of output buffers, whose
+ *   packet descriptors of buffers_5.c carry the destination of every train
+ * - reports a single timeout for the whole thread, with the contract of
+ *   events_in_out_4.c
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - The contexts touched by a call, by input or by an expired wakeup timer,
+ *   are linked into an active list of the thread context, and only those
+ *   are visited: the cost of a call does not grow with the number of idle
+ *   contexts.
+ * - A context's wakeup timer is scheduled at the coalesced time of the
+ *   earliest event of its own wheel, with the slack of timers_2.c, and is
+ *   only moved when that time changes.  Contexts with the same slack share
+ *   wakeup times, and so the slots of the thread wheel.
+ * - The housekeeping that tcp2_process does on entry, draining remote frees
+ *   and checking for a trim request, is done once per call.
+ * - Output goes to up to TCP2_THREAD_MAX_BUFFERS_OUT buffers, taken from the
+ *   pool of the thread context as they fill up.  When all are full, the
+ *   contexts that still have output stay on the active list and the call
+ *   returns incomplete, for the application to send and call again.
+ * - Input that is not finished when the deadline passes is kept, as in
+ *   events_in_out_3.c: tcp2 queues the buffer in the thread context and
+ *   sets its entry in buffers_in to NULL.
+ * - The phases have the guaranteed steps of events_in_out_3.c: after the
+ *   deadline has passed, the wakeup timers still run one step, and the
+ *   first context visited still runs one timer step and one output step.
+ *   A context that is left unfinished moves to the end of the active list,
+ *   so that the next call starts with another one.
+ * - Both entry points can be used on the same thread context, tcp2_process
+ *   for an application that already knows the context of an event, such as
+ *   a client with a connected socket.  Every timer of a context is scheduled
+ *   through tcp2_context_schedule_timer, whichever call schedules it, which
+ *   moves the wakeup timer of the context earlier when needed, and the end
+ *   of tcp2_process moves it to wherever the visit left the earliest event.
+ *   The thread timeout reflects such moves from the next call to
+ *   tcp2_thread_process, which an application makes after calls such as a
+ *   stream send anyway, to have their output written.
+ * ----END DISCUSSION----
+ */
+
+
+
+#define TCP2_THREAD_MAX_BUFFERS_IN  64
+#define TCP2_THREAD_MAX_BUFFERS_OUT 8
+
+
+
+/*
+ * The events structure of tcp2_thread_process.
+ *
+ * buffers_in, buffer_in_count: the input, each buffer described by packet
+ *                              descriptors
+ * now_in: the CLOCK_MONOTONIC time in nanoseconds
+ * deadline_in: as in events_in_out_3.c
+ * max_segments_out: as in buffers_5.c
+ * buffers_out, buffer_out_count: the output, consumed by the application
+ * timeout_out, flags_out: as in events_in_out_4.c
+ */
+struct tcp2_thread_events {
+  struct tcp2_buffer *buffers_in[TCP2_THREAD_MAX_BUFFERS_IN];
+  uint32_t buffer_in_count;
+  uint64_t now_in;
+  struct timeval deadline_in;
+  uint16_t max_segments_out;
+
+  struct tcp2_buffer *buffers_out[TCP2_THREAD_MAX_BUFFERS_OUT];
+  uint32_t buffer_out_count;
+  struct timeval timeout_out;
+  uint32_t flags_out;
+};
+
+void tcp2_thread_events_init(struct tcp2_thread_events *tcp2_thread_events) {
+  memset(tcp2_thread_events, 0, sizeof(*tcp2_thread_events));
+  tcp2_thread_events->max_segments_out = 1;
+}
+
+void tcp2_thread_events_cleanup(
+    struct tcp2_thread_events *tcp2_thread_events) {
+  for (uint32_t index = 0;
+       index < tcp2_thread_events->buffer_out_count;
+       ++index)
+    tcp2_destroy_buffer(tcp2_thread_events->buffers_out[index]);
+
+  tcp2_thread_events->buffer_out_count = 0;
+}
+
+
+
+/*
+ * Inside tcp2, the thread context gains:
+ * - context_timers: a timing wheel with the wakeup timer of every context
+ * - active_head, active_tail: the contexts to visit in this call
+ * - input_queue: unfinished input, as the one of the context in
+ *   events_in_out_3.c
+ * - timeout_reported: the tick of the last reported timeout
+ * and every context a wakeup_timer, an active flag and an active_next link.
+ */
+static void tcp2_thread_context_activate(
+    struct tcp2_thread_context *tcp2_thread_context,
+    struct tcp2_context *tcp2_context) {
+  if (tcp2_context->active)
+    return;
+
+  tcp2_context->active = 1;
+  tcp2_context->active_next = NULL;
+
+  if (tcp2_thread_context->active_tail)
+    tcp2_thread_context->active_tail->active_next = tcp2_context;
+  else
+    tcp2_thread_context->active_head = tcp2_context;
+
+  tcp2_thread_context->active_tail = tcp2_context;
+}
+
+static void tcp2_thread_context_deactivate_head(
+    struct tcp2_thread_context *tcp2_thread_context) {
+  struct tcp2_context *tcp2_context = tcp2_thread_context->active_head;
+
+  tcp2_thread_context->active_head = tcp2_context->active_next;
+  if (!tcp2_thread_context->active_head)
+    tcp2_thread_context->active_tail = NULL;
+
+  tcp2_context->active = 0;
+  tcp2_context->active_next = NULL;
+}
+
+/*
+ * The callback of the wakeup timer of a context.
+ */
+static void tcp2_context_on_wakeup_timer(struct tcp2_timer *timer,
+                                         uint64_t now) {
+  struct tcp2_context *tcp2_context =
+    (struct tcp2_context *)((char *)timer -
+                            offsetof(struct tcp2_context, wakeup_timer));
+
+  tcp2_thread_context_activate(tcp2_context->thread_context, tcp2_context);
+}
+
+/*
+ * Move the wakeup timer of a context to the coalesced time of its earliest
+ * event, after a visit.
+ */
+static void tcp2_thread_context_reschedule(
+    struct tcp2_thread_context *tcp2_thread_context,
+    struct tcp2_context *tcp2_context) {
+  uint64_t next =
+    tcp2_context_coalesce(tcp2_context,
+                          tcp2_timer_wheel_next_expiry(&tcp2_context->timers));
+
+  if (next == TCP2_TIMEOUT_NONE)
+    tcp2_timer_wheel_cancel(&tcp2_thread_context->context_timers,
+                            &tcp2_context->wakeup_timer);
+  else
+  if (!tcp2_timer_pending(&tcp2_context->wakeup_timer) ||
+      (tcp2_context->wakeup_timer.deadline != next))
+    tcp2_timer_wheel_schedule(&tcp2_thread_context->context_timers,
+                              &tcp2_context->wakeup_timer,
+                              next << TCP2_TIMER_TICK_SHIFT);
+}
+
+/*
+ * Inside tcp2, every timer of a context is scheduled through this function
+ * rather than straight on the wheel of the context, as in timers_1.c, so
+ * that an event scheduled outside of a visit, by tcp2_process or by an
+ * application call that arms the pacing or ack timer, never leaves the
+ * wakeup timer of the context behind it.  Moves later are left to the next
+ * visit, which reschedules the wakeup timer in full.
+ */
+void tcp2_context_schedule_timer(struct tcp2_context *tcp2_context,
+                                 struct tcp2_timer *timer, uint64_t when) {
+  tcp2_timer_wheel_schedule(&tcp2_context->timers, timer, when);
+
+  uint64_t tick = tcp2_context_coalesce(tcp2_context, timer->deadline);
+
+  if (!tcp2_timer_pending(&tcp2_context->wakeup_timer) ||
+      (tick < tcp2_context->wakeup_timer.deadline))
+    tcp2_timer_wheel_schedule(
+      &tcp2_context->thread_context->context_timers,
+      &tcp2_context->wakeup_timer, tick << TCP2_TIMER_TICK_SHIFT);
+}
+
+/*
+ * The end of tcp2_process, after tcp2_context_report_timeout of
+ * events_in_out_4.c.  A call to tcp2_process is a visit as well, and may
+ * have moved the earliest event of the context either way.
+ */
+void tcp2_process(struct tcp2_context *tcp2_context,
+                  struct tcp2_events *tcp2_events) {
+  /*
+   * Process events, and report the timeout of the context.
+   */
+
+  tcp2_thread_context_reschedule(tcp2_context->thread_context, tcp2_context);
+}
+
+
+
+/*
+ * Demultiplex the datagrams of a buffer, from and up to a saved position,
+ * as tcp2_process_buffer in events_in_out_3.c does for a single context.
+ *
+ * Returns:
+ * Non zero once all datagrams of the buffer have been processed.
+ */
+static int tcp2_thread_process_buffer(
+    struct tcp2_thread_context *tcp2_thread_context,
+    const struct tcp2_buffer *buffer,
+    uint32_t *packet_index,
+    uint32_t *packet_offset,
+    uint64_t now,
+    struct tcp2_deadline *deadline) {
+  while ((*packet_index < buffer->packet_count) && !deadline->passed) {
+    const struct tcp2_packet_descriptor *packet =
+      &buffer->packets[*packet_index];
+    uint32_t gso_size = packet->gso_size ? packet->gso_size : packet->length;
+    struct tcp2_connection *connection = NULL;
+
+    while ((*packet_offset < packet->length) && !deadline->passed) {
+      const char *datagram = buffer->data + packet->offset + *packet_offset;
+      uint32_t length = packet->length - *packet_offset;
+      if (length > gso_size)
+        length = gso_size;
+
+      if (!connection ||
+          !tcp2_connection_matches(connection, datagram, length)) {
+        connection =
+          tcp2_thread_context_lookup_connection(tcp2_thread_context,
+                                                datagram, length,
+                                                &packet->peer);
+      }
+
+      if (connection) {
+        tcp2_connection_on_datagram(connection, datagram, length, packet);
+        tcp2_thread_context_activate(tcp2_thread_context,
+                                     connection->context);
+      }
+      else {
+        /*
+         * Initial packets of new connections, handed to the context that
+         * accepts them, which is activated as well.
+         */
+        tcp2_thread_context_on_unknown_datagram(tcp2_thread_context,
+                                                datagram, length, packet,
+                                                now);
+      }
+
+      *packet_offset += length;
+      tcp2_deadline_step(deadline);
+    }
+
+    if (*packet_offset >= packet->length) {
+      ++*packet_index;
+      *packet_offset = 0;
+    }
+  }
+
+  return *packet_index == buffer->packet_count;
+}
+
+static void tcp2_thread_process_input(
+    struct tcp2_thread_context *tcp2_thread_context,
+    struct tcp2_thread_events *tcp2_thread_events,
+    uint64_t now,
+    struct tcp2_deadline *deadline) {
+  struct tcp2_input_queue *queue = &tcp2_thread_context->input_queue;
+
+  while (queue->head &&
+         tcp2_thread_process_buffer(tcp2_thread_context, queue->head,
+                                    &queue->packet_index,
+                                    &queue->packet_offset,
+                                    now, deadline)) {
+    struct tcp2_buffer *buffer = queue->head;
+
+    queue->head = buffer->next;
+    if (!queue->head)
+      queue->tail = NULL;
+    queue->packet_index = 0;
+    queue->packet_offset = 0;
+
+    buffer->next = NULL;
+    tcp2_destroy_buffer(buffer);
+  }
+
+  for (uint32_t index = 0;
+       index < tcp2_thread_events->buffer_in_count;
+       ++index) {
+    struct tcp2_buffer *buffer = tcp2_thread_events->buffers_in[index];
+    uint32_t packet_index = 0;
+    uint32_t packet_offset = 0;
+
+    if (!buffer)
+      continue;
+
+    if (queue->head ||
+        !tcp2_thread_process_buffer(tcp2_thread_context, buffer,
+                                    &packet_index, &packet_offset,
+                                    now, deadline)) {
+      if (!queue->head) {
+        queue->packet_index = packet_index;
+        queue->packet_offset = packet_offset;
+      }
+
+      tcp2_input_queue_push(queue, buffer);
+      tcp2_thread_events->buffers_in[index] = NULL;
+    }
+  }
+}
+
+/*
+ * Write the output of a context to the output buffers of the call, taking a
+ * new buffer whenever the last one is full.
+ *
+ * Returns:
+ * 0 when the context has no output left that can be written now, -1 when
+ * the output buffers are exhausted or the deadline passed.
+ */
+static int tcp2_thread_write_output(
+    struct tcp2_thread_context *tcp2_thread_context,
+    struct tcp2_thread_events *tcp2_thread_events,
+    struct tcp2_context *tcp2_context,
+    struct tcp2_deadline *deadline) {
+  struct tcp2_events tcp2_events;
+
+  tcp2_events_init(&tcp2_events);
+  tcp2_events.max_segments_out = tcp2_thread_events->max_segments_out;
+
+  while (tcp2_context_has_output(tcp2_context)) {
+    if (deadline->passed)
+      return -1;
+
+    uint32_t count = tcp2_thread_events->buffer_out_count;
+
+    if (count > 0) {
+      struct tcp2_buffer *last = tcp2_thread_events->buffers_out[count - 1];
+      size_t length = tcp2_buffer_length(last);
+
+      tcp2_events.buffer_out = last;
+      tcp2_context_write_output(tcp2_context, &tcp2_events, deadline);
+
+      if (tcp2_buffer_length(last) != length)
+        continue;
+    }
+
+    /*
+     * The last buffer is full, or there is none yet.
+     */
+    if (count == TCP2_THREAD_MAX_BUFFERS_OUT)
+      return -1;
+
+    struct tcp2_buffer *buffer =
+      tcp2_thread_context_get_buffer(tcp2_thread_context);
+    if (!buffer)
+      return -1;
+
+    tcp2_thread_events->buffers_out[tcp2_thread_events->buffer_out_count++] =
+      buffer;
+
+    tcp2_events.buffer_out = buffer;
+    tcp2_context_write_output(tcp2_context, &tcp2_events, deadline);
+
+    /*
+     * Nothing fits even an empty buffer, the connection is waiting for
+     * something other than room, such as its pacer.  Give the buffer back
+     * and leave the context, rather than taking more buffers and returning
+     * incomplete for ever.
+     */
+    if (tcp2_buffer_empty(buffer)) {
+      tcp2_thread_events->buffer_out_count--;
+      tcp2_destroy_buffer(buffer);
+      break;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Report the timeout of the thread, with the contract of events_in_out_4.c,
+ * in TCP2_TIMEOUT_ON_CHANGE mode: moves earlier are reported, moves later
+ * only beyond TCP2_TIMEOUT_LATER_REPORT or when nothing is left scheduled.
+ * The wakeup times of the contexts are coalesced already.
+ */
+static void tcp2_thread_report_timeout(
+    struct tcp2_thread_context *tcp2_thread_context,
+    struct tcp2_thread_events *tcp2_thread_events,
+    uint64_t now) {
+  uint64_t next =
+    tcp2_timer_wheel_next_expiry(&tcp2_thread_context->context_timers);
+  uint64_t reported = tcp2_thread_context->timeout_reported;
+  int armed = (reported != TCP2_TIMEOUT_NONE) &&
+              (reported > (now >> TCP2_TIMER_TICK_SHIFT));
+
+  if (armed && (next != TCP2_TIMEOUT_NONE) && (next >= reported) &&
+      (next - reported <=
+         (TCP2_TIMEOUT_LATER_REPORT >> TCP2_TIMER_TICK_SHIFT)))
+    return;
+
+  if (!armed && (next == TCP2_TIMEOUT_NONE) &&
+      (reported == TCP2_TIMEOUT_NONE))
+    return;
+
+  tcp2_thread_events->flags_out |= TCP2_EVENTS_TIMEOUT_CHANGED;
+  tcp2_thread_context->timeout_reported = next;
+
+  if (next == TCP2_TIMEOUT_NONE)
+    tcp2_thread_events->timeout_out = (struct timeval){0, 0};
+  else
+    tcp2_timeout_to_timeval(next, now, &tcp2_thread_events->timeout_out);
+}
+
+
+
+/*
+ * tcp2_thread_process
+ *
+ * Process a batch of input and all expired timers of the contexts of a
+ * thread context.  Called on the thread of the thread context only.
+ */
+void tcp2_thread_process(struct tcp2_thread_context *tcp2_thread_context,
+                         struct tcp2_thread_events *tcp2_thread_events) {
+  uint64_t now = tcp2_thread_events->now_in;
+  struct tcp2_deadline deadline;
+
+  tcp2_deadline_init(&deadline, now, &tcp2_thread_events->deadline_in);
+  tcp2_thread_events->flags_out = 0;
+
+  tcp2_thread_context_housekeeping(tcp2_thread_context);
+
+  tcp2_thread_process_input(tcp2_thread_context, tcp2_thread_events,
+                            now, &deadline);
+
+  tcp2_deadline_start_phase(&deadline);
+
+  while (!deadline.passed &&
+         tcp2_timer_wheel_run_one(&tcp2_thread_context->context_timers, now))
+    tcp2_deadline_step(&deadline);
+
+  for (int visit = 0; tcp2_thread_context->active_head; ++visit) {
+    struct tcp2_context *tcp2_context = tcp2_thread_context->active_head;
+
+    if (visit == 0)
+      tcp2_deadline_start_phase(&deadline);
+    else
+    if (deadline.passed)
+      break;
+
+    while (!deadline.passed &&
+           tcp2_context_run_expired_timer(tcp2_context, now))
+      tcp2_deadline_step(&deadline);
+
+    if (visit == 0)
+      tcp2_deadline_start_phase(&deadline);
+
+    if (deadline.passed ||
+        (tcp2_thread_write_output(tcp2_thread_context, tcp2_thread_events,
+                                  tcp2_context, &deadline) != 0)) {
+      tcp2_thread_context_deactivate_head(tcp2_thread_context);
+      tcp2_thread_context_activate(tcp2_thread_context, tcp2_context);
+      break;
+    }
+
+    tcp2_thread_context_deactivate_head(tcp2_thread_context);
+    tcp2_thread_context_reschedule(tcp2_thread_context, tcp2_context);
+  }
+
+  if (tcp2_thread_context->active_head ||
+      tcp2_thread_context->input_queue.head)
+    tcp2_thread_events->flags_out |= TCP2_EVENTS_INCOMPLETE;
+
+  tcp2_thread_report_timeout(tcp2_thread_context, tcp2_thread_events, now);
+}
+
+
+
+
+
+
+/*
+ * The application, with one tcp2_thread_events structure and one timer per
+ * thread, in place of the per context handling of events_in_out_4.c.
+ */
+static void app_after_tcp2_thread_process(
+    struct app_thread_context *app_thread_context) {
+  struct tcp2_thread_events *tcp2_thread_events =
+    &app_thread_context->tcp2_thread_events;
+
+  if (tcp2_thread_events->flags_out & TCP2_EVENTS_TIMEOUT_CHANGED) {
+    if ((tcp2_thread_events->timeout_out.tv_sec == 0) &&
+        (tcp2_thread_events->timeout_out.tv_usec == 0))
+      app_thread_timer_cancel(app_thread_context);
+    else
+      app_thread_timer_schedule(app_thread_context,
+                                &tcp2_thread_events->timeout_out,
+                                &app_thread_on_timeout);
+  }
+
+  /*
+   * Every output buffer is sent with a single sendmmsg call, see
+   * app_network_write_udp in buffers_5.c, which destroys it.
+   */
+  for (uint32_t index = 0;
+       index < tcp2_thread_events->buffer_out_count;
+       ++index) {
+    app_thread_network_write_udp(app_thread_context,
+                                 tcp2_thread_events->buffers_out[index]);
+  }
+
+  tcp2_thread_events->buffer_out_count = 0;
+
+  if (tcp2_thread_events->flags_out & TCP2_EVENTS_INCOMPLETE)
+    app_loop_defer(app_thread_context, &app_thread_on_tcp2_resume);
+
+  /*
+   * Handled, so that nothing is acted upon twice.
+   */
+  tcp2_thread_events->flags_out = 0;
+  tcp2_thread_events->timeout_out = (struct timeval){0, 0};
+}
+
+/*
+ * app_thread_network_on_readable
+ *
+ * A batch of trains is read with the helpers of buffers_6.c, and handed to
+ * tcp2 as a whole.
+ */
+void app_thread_network_on_readable(
+    struct app_thread_context *app_thread_context) {
+  struct tcp2_thread_context *tcp2_thread_context =
+    app_thread_context->tcp2_thread_context;
+  struct tcp2_thread_events *tcp2_thread_events =
+    &app_thread_context->tcp2_thread_events;
+  struct tcp2_recv_gro_batch batch;
+
+  unsigned batch_size = app_thread_context->options.gro_batch_size;
+  if (batch_size > TCP2_RECV_GRO_MAX_BATCH)
+    batch_size = TCP2_RECV_GRO_MAX_BATCH;
+  if (batch_size > TCP2_THREAD_MAX_BUFFERS_IN)
+    batch_size = TCP2_THREAD_MAX_BUFFERS_IN;
+
+  for (batch.count = 0; batch.count < batch_size; ++batch.count) {
+    batch.buffers[batch.count] =
+      tcp2_thread_context_get_buffer(tcp2_thread_context);
+    if (!batch.buffers[batch.count])
+      break;
+  }
+
+  if (batch.count == 0)
+    return;
+
+  tcp2_prepare_recvmmsg_gro(&batch);
+
+  int received = recvmmsg(app_thread_context->udp_socket, batch.msgs,
+                          batch.count, MSG_DONTWAIT, NULL);
+
+  tcp2_thread_events->now_in = app_clock_monotonic_ns();
+  tcp2_thread_events->buffer_in_count = 0;
+
+  if (received > 0) {
+    tcp2_complete_recvmmsg_gro(&batch, (unsigned)received,
+                               app_clock_realtime_ns());
+
+    for (int index = 0; index < received; ++index) {
+      tcp2_thread_events->buffers_in[index] = batch.buffers[index];
+      batch.buffers[index] = NULL;
+    }
+    tcp2_thread_events->buffer_in_count = (uint32_t)received;
+
+    tcp2_thread_process(tcp2_thread_context, tcp2_thread_events);
+  }
+
+  /*
+   * Buffers that tcp2 kept are NULL, the rest go back to the pool.
+   */
+  for (uint32_t index = 0;
+       index < tcp2_thread_events->buffer_in_count;
+       ++index) {
+    if (tcp2_thread_events->buffers_in[index])
+      tcp2_destroy_buffer(tcp2_thread_events->buffers_in[index]);
+  }
+  tcp2_thread_events->buffer_in_count = 0;
+
+  for (unsigned index = 0; index < batch.count; ++index) {
+    if (batch.buffers[index])
+      tcp2_destroy_buffer(batch.buffers[index]);
+  }
+
+  app_after_tcp2_thread_process(app_thread_context);
+}
+
+/*
+ * app_thread_on_timeout, and app_thread_on_tcp2_resume, which is the same:
+ * no input, only timers and pending work.
+ */
+void app_thread_on_timeout(struct app_thread_context *app_thread_context) {
+  struct tcp2_thread_events *tcp2_thread_events =
+    &app_thread_context->tcp2_thread_events;
+
+  tcp2_thread_events->now_in = app_clock_monotonic_ns();
+  tcp2_thread_events->buffer_in_count = 0;
+
+  tcp2_thread_process(app_thread_context->tcp2_thread_context,
+                      tcp2_thread_events);
+
+  app_after_tcp2_thread_process(app_thread_context);
+}
+
+void app_thread_on_tcp2_resume(
+    struct app_thread_context *app_thread_context) {
+  app_thread_on_timeout(app_thread_context);
+}
@@ -173,9 +173,13 @@ void app_on_thread_start() {
    * referred to by the thread context for times when global variables need to
    * be accessed (in a thread safe way)  An example of such state includes the
    * master registry of all connection ids.
+   *
+   * No allocator is provided, so the thread context creates its own
+   * per-thread magazines of pre-allocated memory blocks, refilled from a
+   * depot held by the system context.  See allocators_3.c.
    */
   struct tcp2_thread_context *tcp2_thread_context =
-    tcp2_create_thread_context(tcp2_system_context);
+    tcp2_create_thread_context(tcp2_system_context, NULL);
 
   /*
    * Store the tcp2 thread context in a thread local store.  As many runtime
@@ -0,0 +1,572 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+/*
+ * This case study gives shape to the 'internal chain of time differentiated
+ * events' that events_in_out_1.c gives every tcp2_context, and makes it a
+ * hierarchical timing wheel.
+ *
+ * A server context may hold 100k connections, each with several timers: loss
+ * detection, ack delay, pacing, idle timeout, and more.  Timers are set and
+ * moved constantly, the idle timeout with every packet received, and most of
+ * them are cancelled or moved before they ever fire.  A sorted chain makes
+ * every one of these operations O(n), which quickly becomes the dominant
+ * cost of a thread serving mostly idle long-poll connections.
+ *
+ * The wheel gives:
+ * - O(1) insert and cancel: a timer is linked into the slot of the wheel
+ *   that covers its expiry, with a doubly linked list
+ * - batched expiry: all timers of a slot are moved to the expired list at
+ *   once, and run one by one from there, which also lets the deadline of
+ *   events_in_out_3.c stop in the middle of a batch
+ * - coarse timers: timers such as the idle timeout are rounded up to coarse
+ *   buckets, and moving such a timer later, which is nearly always what
+ *   happens, only stores the new deadline.  The timer is moved to the right
+ *   slot lazily, if it is still pending when its old slot expires.
+ *
+ * The wheel has four levels.  Level 0 has 256 slots of one tick, levels 1
+ * to 3 have 64 slots each, each slot covering all slots of the level below.
+ * A timer is linked in the lowest level that spans its expiry, and moved
+ * down a level, 'cascaded', when the level below wraps around to its slot.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - A tick is 2^16ns, about 65us.  Timers are rounded up to a tick, so they
+ *   never fire early, and fire at most a tick late.  Level 0 spans 16.7ms,
+ *   level 1 1.07s, level 2 68.7s and level 3 73 minutes.  Later timers are
+ *   parked in the last slot of level 3 and re-linked when it expires.
+ * - Coarse timers are rounded up to 2^10 ticks, about 67ms, which is fine
+ *   for idle timeouts of seconds, and means that connections that go idle
+ *   at about the same time share a slot and expire in one batch.
+ * - Time is the CLOCK_MONOTONIC time in nanoseconds, as read by
+ *   tcp2_process on entry.
+ * - Timers are embedded in the structures they belong to, the connection
+ *   for example, so that scheduling never allocates.
+ * - The wheel belongs to a tcp2_context and, like the context, is only used
+ *   on the thread of its thread context, without locking.
+ * ----END DISCUSSION----
+ */
+
+
+
+#define TCP2_TIMER_TICK_SHIFT       16
+#define TCP2_TIMER_COARSE_TICKS     1024
+
+#define TCP2_TIMER_LEVELS           4
+#define TCP2_TIMER_LEVEL0_BITS      8
+#define TCP2_TIMER_LEVEL_BITS       6
+#define TCP2_TIMER_LEVEL0_SLOTS     (1 << TCP2_TIMER_LEVEL0_BITS)
+#define TCP2_TIMER_LEVEL_SLOTS      (1 << TCP2_TIMER_LEVEL_BITS)
+
+/*
+ * The slots of all levels are kept in one array, level 0 first.  The
+ * expired list follows, and TCP2_TIMER_NONE marks a timer that is not
+ * pending.
+ */
+#define TCP2_TIMER_SLOTS \
+  (TCP2_TIMER_LEVEL0_SLOTS + \
+   (TCP2_TIMER_LEVELS - 1) * TCP2_TIMER_LEVEL_SLOTS)
+#define TCP2_TIMER_EXPIRED          TCP2_TIMER_SLOTS
+#define TCP2_TIMER_NONE             (TCP2_TIMER_SLOTS + 1)
+
+/*
+ * The furthest a timer can be linked from the current tick.
+ */
+#define TCP2_TIMER_MAX_TICKS \
+  ((uint64_t)1 << (TCP2_TIMER_LEVEL0_BITS + \
+                   (TCP2_TIMER_LEVELS - 1) * TCP2_TIMER_LEVEL_BITS))
+
+
+
+struct tcp2_timer;
+
+typedef void (*tcp2_timer_callback)(struct tcp2_timer *timer, uint64_t now);
+
+/*
+ * Timer.
+ *
+ * expires: the tick of the slot the timer is linked in
+ * deadline: the tick the timer is due, later than 'expires' for a coarse
+ *           timer that was moved, or a timer beyond the reach of the wheel
+ * slot: the slot the timer is linked in, TCP2_TIMER_EXPIRED or
+ *       TCP2_TIMER_NONE
+ */
+struct tcp2_timer {
+  struct tcp2_timer *next;
+  struct tcp2_timer **pprev;
+
+  uint64_t expires;
+  uint64_t deadline;
+  uint16_t slot;
+  uint8_t coarse;
+
+  tcp2_timer_callback callback;
+};
+
+/*
+ * Timing wheel.
+ *
+ * current: the next tick to be processed
+ * count: the number of pending timers, including those on the expired list
+ * occupied: a bit per slot, set while the slot is not empty
+ */
+struct tcp2_timer_wheel {
+  uint64_t current;
+  uint32_t count;
+  uint64_t occupied[(TCP2_TIMER_SLOTS + 63) / 64];
+  struct tcp2_timer *slots[TCP2_TIMER_SLOTS + 1];
+};
+
+
+
+void tcp2_timer_init(struct tcp2_timer *timer,
+                     tcp2_timer_callback callback,
+                     int coarse) {
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->expires = 0;
+  timer->deadline = 0;
+  timer->slot = TCP2_TIMER_NONE;
+  timer->coarse = coarse ? 1 : 0;
+  timer->callback = callback;
+}
+
+int tcp2_timer_pending(const struct tcp2_timer *timer) {
+  return timer->slot != TCP2_TIMER_NONE;
+}
+
+void tcp2_timer_wheel_init(struct tcp2_timer_wheel *wheel, uint64_t now) {
+  memset(wheel, 0, sizeof(*wheel));
+  wheel->current = now >> TCP2_TIMER_TICK_SHIFT;
+}
+
+
+
+static unsigned tcp2_timer_level_shift(unsigned level) {
+  return TCP2_TIMER_LEVEL0_BITS + (level - 1) * TCP2_TIMER_LEVEL_BITS;
+}
+
+static unsigned tcp2_timer_level_base(unsigned level) {
+  return TCP2_TIMER_LEVEL0_SLOTS + (level - 1) * TCP2_TIMER_LEVEL_SLOTS;
+}
+
+/*
+ * Find the first occupied slot in [from, to).
+ *
+ * Returns:
+ * The slot, or -1 if there is none.
+ */
+static int tcp2_timer_wheel_find(const struct tcp2_timer_wheel *wheel,
+                                 unsigned from, unsigned to) {
+  while (from < to) {
+    uint64_t word = wheel->occupied[from / 64] >> (from % 64);
+
+    if (word) {
+      unsigned found = from + (unsigned)__builtin_ctzll(word);
+      return (found < to) ? (int)found : -1;
+    }
+
+    from = (from | 63) + 1;
+  }
+
+  return -1;
+}
+
+static void tcp2_timer_wheel_push(struct tcp2_timer_wheel *wheel,
+                                  struct tcp2_timer *timer,
+                                  unsigned slot) {
+  struct tcp2_timer **head = &wheel->slots[slot];
+
+  timer->next = *head;
+  if (timer->next)
+    timer->next->pprev = &timer->next;
+  timer->pprev = head;
+  *head = timer;
+
+  timer->slot = (uint16_t)slot;
+  if (slot < TCP2_TIMER_SLOTS)
+    wheel->occupied[slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+static void tcp2_timer_wheel_unlink(struct tcp2_timer_wheel *wheel,
+                                    struct tcp2_timer *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next)
+    timer->next->pprev = timer->pprev;
+
+  if ((timer->slot < TCP2_TIMER_SLOTS) && !wheel->slots[timer->slot])
+    wheel->occupied[timer->slot / 64] &= ~((uint64_t)1 << (timer->slot % 64));
+
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+/*
+ * Link a timer into the slot that covers its deadline, relative to the
+ * current tick.
+ */
+static void tcp2_timer_wheel_link(struct tcp2_timer_wheel *wheel,
+                                  struct tcp2_timer *timer) {
+  uint64_t expires = timer->deadline;
+
+  if (expires < wheel->current)
+    expires = wheel->current;
+  if (expires - wheel->current >= TCP2_TIMER_MAX_TICKS)
+    expires = wheel->current + TCP2_TIMER_MAX_TICKS - 1;
+
+  timer->expires = expires;
+
+  uint64_t delta = expires - wheel->current;
+  if (delta < TCP2_TIMER_LEVEL0_SLOTS) {
+    tcp2_timer_wheel_push(wheel, timer,
+                          expires & (TCP2_TIMER_LEVEL0_SLOTS - 1));
+    return;
+  }
+
+  unsigned level = 1;
+  while (delta >= ((uint64_t)1 << tcp2_timer_level_shift(level + 1)))
+    ++level;
+
+  tcp2_timer_wheel_push(wheel, timer,
+                        tcp2_timer_level_base(level) +
+                          ((expires >> tcp2_timer_level_shift(level)) &
+                           (TCP2_TIMER_LEVEL_SLOTS - 1)));
+}
+
+
+
+/*
+ * Schedule a timer at 'when', in nanoseconds, or move it there if it is
+ * pending.
+ */
+void tcp2_timer_wheel_schedule(struct tcp2_timer_wheel *wheel,
+                               struct tcp2_timer *timer,
+                               uint64_t when) {
+  uint64_t deadline = (when + ((1 << TCP2_TIMER_TICK_SHIFT) - 1)) >>
+                      TCP2_TIMER_TICK_SHIFT;
+
+  if (timer->coarse) {
+    deadline = (deadline + TCP2_TIMER_COARSE_TICKS - 1) &
+               ~(uint64_t)(TCP2_TIMER_COARSE_TICKS - 1);
+
+    /*
+     * Moving a coarse timer later: only remember the new deadline.
+     */
+    if (tcp2_timer_pending(timer) && (deadline >= timer->expires)) {
+      timer->deadline = deadline;
+      return;
+    }
+  }
+
+  if (tcp2_timer_pending(timer))
+    tcp2_timer_wheel_unlink(wheel, timer);
+  else
+    ++wheel->count;
+
+  timer->deadline = deadline;
+  tcp2_timer_wheel_link(wheel, timer);
+}
+
+void tcp2_timer_wheel_cancel(struct tcp2_timer_wheel *wheel,
+                             struct tcp2_timer *timer) {
+  if (!tcp2_timer_pending(timer))
+    return;
+
+  tcp2_timer_wheel_unlink(wheel, timer);
+  timer->slot = TCP2_TIMER_NONE;
+  --wheel->count;
+}
+
+
+
+/*
+ * Move all timers of a slot of level 1 or above down, and continue with the
+ * level above when this one wraps around as well.
+ */
+static void tcp2_timer_wheel_cascade(struct tcp2_timer_wheel *wheel,
+                                     unsigned level) {
+  unsigned index = (wheel->current >> tcp2_timer_level_shift(level)) &
+                   (TCP2_TIMER_LEVEL_SLOTS - 1);
+  unsigned slot = tcp2_timer_level_base(level) + index;
+  struct tcp2_timer *timer = wheel->slots[slot];
+
+  wheel->slots[slot] = NULL;
+  wheel->occupied[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+
+  while (timer) {
+    struct tcp2_timer *next = timer->next;
+    tcp2_timer_wheel_link(wheel, timer);
+    timer = next;
+  }
+
+  if ((index == 0) && (level + 1 < TCP2_TIMER_LEVELS))
+    tcp2_timer_wheel_cascade(wheel, level + 1);
+}
+
+/*
+ * The next tick at or after the current one at which something happens: a
+ * level 0 slot to expire, or a wrap of level 0 and so a cascade.
+ */
+static uint64_t tcp2_timer_wheel_next_tick(
+    const struct tcp2_timer_wheel *wheel) {
+  unsigned index = wheel->current & (TCP2_TIMER_LEVEL0_SLOTS - 1);
+  int found = tcp2_timer_wheel_find(wheel, index, TCP2_TIMER_LEVEL0_SLOTS);
+
+  if (found >= 0)
+    return wheel->current - index + (unsigned)found;
+
+  return (wheel->current | (TCP2_TIMER_LEVEL0_SLOTS - 1)) + 1;
+}
+
+/*
+ * Advance the wheel to 'now', in nanoseconds, moving every timer that is
+ * due to the expired list.  Coarse timers that were moved later, and timers
+ * beyond the reach of the wheel, are linked again instead.  Ticks without
+ * any work are skipped, an idle wheel only stops at every wrap of level 0.
+ */
+void tcp2_timer_wheel_advance(struct tcp2_timer_wheel *wheel, uint64_t now) {
+  uint64_t now_tick = now >> TCP2_TIMER_TICK_SHIFT;
+
+  if (wheel->count == 0) {
+    if (wheel->current <= now_tick)
+      wheel->current = now_tick + 1;
+    return;
+  }
+
+  for (uint64_t tick = tcp2_timer_wheel_next_tick(wheel);
+       tick <= now_tick;
+       tick = tcp2_timer_wheel_next_tick(wheel)) {
+    wheel->current = tick;
+
+    if ((tick & (TCP2_TIMER_LEVEL0_SLOTS - 1)) == 0)
+      tcp2_timer_wheel_cascade(wheel, 1);
+
+    unsigned slot = tick & (TCP2_TIMER_LEVEL0_SLOTS - 1);
+    struct tcp2_timer *timer = wheel->slots[slot];
+
+    wheel->slots[slot] = NULL;
+    wheel->occupied[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+
+    while (timer) {
+      struct tcp2_timer *next = timer->next;
+
+      if (timer->deadline > now_tick)
+        tcp2_timer_wheel_link(wheel, timer);
+      else
+        tcp2_timer_wheel_push(wheel, timer, TCP2_TIMER_EXPIRED);
+
+      timer = next;
+    }
+
+    wheel->current = tick + 1;
+  }
+
+  if (wheel->current <= now_tick)
+    wheel->current = now_tick + 1;
+}
+
+/*
+ * Run one expired timer, advancing the wheel first if the expired list is
+ * empty.  A timer that its callback schedules again at 'now' or earlier is
+ * linked at the next tick, so this loop always ends.
+ *
+ * Returns:
+ * 1 if a timer was run, 0 if no timer is due.
+ */
+int tcp2_timer_wheel_run_one(struct tcp2_timer_wheel *wheel, uint64_t now) {
+  if (!wheel->slots[TCP2_TIMER_EXPIRED])
+    tcp2_timer_wheel_advance(wheel, now);
+
+  struct tcp2_timer *timer;
+  while ((timer = wheel->slots[TCP2_TIMER_EXPIRED]) != NULL) {
+    tcp2_timer_wheel_unlink(wheel, timer);
+
+    /*
+     * A coarse timer moved later while it waited on the expired list.
+     */
+    if (timer->deadline > (now >> TCP2_TIMER_TICK_SHIFT)) {
+      tcp2_timer_wheel_link(wheel, timer);
+      continue;
+    }
+
+    timer->slot = TCP2_TIMER_NONE;
+    --wheel->count;
+
+    timer->callback(timer, now);
+
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * The earliest tick at which a timer may be due.  For timers in levels 1 and
+ * above this is the tick at which their slot is cascaded, a lower bound of
+ * their deadline: waking up then costs a cascade and nothing more.
+ *
+ * Returns:
+ * The tick, or UINT64_MAX if no timer is pending.
+ */
+uint64_t tcp2_timer_wheel_next_expiry(const struct tcp2_timer_wheel *wheel) {
+  if (wheel->count == 0)
+    return UINT64_MAX;
+
+  if (wheel->slots[TCP2_TIMER_EXPIRED])
+    return wheel->current;
+
+  unsigned index = wheel->current & (TCP2_TIMER_LEVEL0_SLOTS - 1);
+  uint64_t round = wheel->current - index;
+  int found = tcp2_timer_wheel_find(wheel, index, TCP2_TIMER_LEVEL0_SLOTS);
+
+  if (found >= 0)
+    return round + (unsigned)found;
+
+  uint64_t next = UINT64_MAX;
+
+  found = tcp2_timer_wheel_find(wheel, 0, index);
+  if (found >= 0)
+    next = round + TCP2_TIMER_LEVEL0_SLOTS + (unsigned)found;
+
+  /*
+   * 'current' is the next tick to be processed, so when it sits on a wrap
+   * of level 0, the level 1 slot at its index has yet to be cascaded, and
+   * so on up while the index of the level below is 0 as well.  Such a slot
+   * is due now, at distance 0, rather than a full turn of its level later.
+   */
+  int cascade_pending = (index == 0);
+
+  for (unsigned level = 1; level < TCP2_TIMER_LEVELS; ++level) {
+    unsigned shift = tcp2_timer_level_shift(level);
+    unsigned base = tcp2_timer_level_base(level);
+    uint64_t period = wheel->current >> shift;
+    unsigned current_index = period & (TCP2_TIMER_LEVEL_SLOTS - 1);
+    unsigned first = cascade_pending ? 0 : 1;
+
+    for (unsigned distance = first;
+         distance < first + TCP2_TIMER_LEVEL_SLOTS;
+         ++distance) {
+      unsigned slot = base + ((current_index + distance) &
+                              (TCP2_TIMER_LEVEL_SLOTS - 1));
+
+      if (wheel->slots[slot]) {
+        uint64_t tick = (period + distance) << shift;
+        if (tick < next)
+          next = tick;
+        break;
+      }
+    }
+
+    cascade_pending = cascade_pending && (current_index == 0);
+  }
+
+  return next;
+}
+
+
+
+
+
+
+/*
+ * Inside tcp2, the context keeps its wheel, and the functions that
+ * events_in_out_3.c left undefined use it.
+ */
+int tcp2_context_run_expired_timer(struct tcp2_context *tcp2_context,
+                                   uint64_t now) {
+  return tcp2_timer_wheel_run_one(&tcp2_context->timers, now);
+}
+
+void tcp2_context_get_timeout(struct tcp2_context *tcp2_context,
+                              uint64_t now,
+                              struct timeval *timeout_out) {
+  uint64_t tick = tcp2_timer_wheel_next_expiry(&tcp2_context->timers);
+
+  if (tick == UINT64_MAX) {
+    *timeout_out = (struct timeval){0, 0};
+    return;
+  }
+
+  /*
+   * At least a microsecond, as {0, 0} means that no event is scheduled.
+   */
+  uint64_t when = tick << TCP2_TIMER_TICK_SHIFT;
+  uint64_t relative = (when > now) ? (when - now + 999) / 1000 : 1;
+
+  timeout_out->tv_sec = relative / 1000000;
+  timeout_out->tv_usec = relative % 1000000;
+}
+
+/*
+ * A connection embeds its timers.  The idle timer is coarse and pushed back
+ * with every packet received, which costs no more than a store.
+ */
+void tcp2_connection_init_timers(struct tcp2_connection *connection) {
+  tcp2_timer_init(&connection->loss_timer, &tcp2_connection_on_loss_timer, 0);
+  tcp2_timer_init(&connection->ack_timer, &tcp2_connection_on_ack_timer, 0);
+  tcp2_timer_init(&connection->pacing_timer,
+                  &tcp2_connection_on_pacing_timer, 0);
+  tcp2_timer_init(&connection->idle_timer, &tcp2_connection_on_idle_timer, 1);
+}
+
+void tcp2_connection_on_packet_received(struct tcp2_connection *connection,
+                                        uint64_t now) {
+  tcp2_timer_wheel_schedule(&connection->context->timers,
+                            &connection->idle_timer,
+                            now + connection->idle_timeout);
+}
+
+void tcp2_connection_on_idle_timer(struct tcp2_timer *timer, uint64_t now) {
+  struct tcp2_connection *connection =
+    (struct tcp2_connection *)((char *)timer -
+                               offsetof(struct tcp2_connection, idle_timer));
+
+  tcp2_connection_close_silently(connection, now);
+}
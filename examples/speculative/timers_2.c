@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2016 Nick Jones <nick.fa.jones@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * This case study serves as a demonstration of an application that makes use
+ * of the tcp2 library.  It is constructed with 'mostly' syntactically correct
+ * C code but with many dependencies left out and many functions, both of the
+ * application and the tcp2 library, left referred to yet undefined.
+ *
+ * The purpose is to demonstrate ideas about the form and function of the tcp2
+ * API, of what features it will provide, of what inputs it will receive, of
+ * what outputs it will produce, of the granularity the API functions will be
+ * and how they will be called from an application.
+ *
+ * The form and function of the application itself is also an important aspect
+ * of the case study, as it provides an example of a kind of application tcp2
+ * will be used in and the various situations and program runtime environments
+ * that tcp2 may need to support.
+ *
+ * Parts of the comments in the case study code may be marked with:
+ * ----BEGIN DISCUSSION----
+ * ----END DISCUSSION----
+ * These sections indicate areas where important design or philisophical
+ * decisions have been made for the tcp2 specific interfaces or behaviour in
+ * order to fit into the case study but are significant enough to warrant
+ * additional discussion.
+ *
+ * However, almost all parts of the case study should act as motivation for
+ * discussion.
+ */
+
+/*
+ * This case study builds on timers_1.c and events_in_out_4.c and adds a
+ * configurable timer slack to each tcp2_context, trading timer precision for
+ * fewer wakeups.
+ *
+ * Without slack, every call to tcp2_process may ask for a wakeup a few
+ * microseconds away: the pacing gap before the next datagram of one
+ * connection, followed by that of another connection a few microseconds
+ * later, and so on.  Each wakeup costs a timer interrupt, a context switch
+ * and a pass through the event loop, which on a CPU constrained edge node
+ * can cost more than the work it triggers.
+ *
+ * With a slack of S nanoseconds, the time reported in timeout_out is rounded
+ * up to the next multiple of S.  All events due before that time then run
+ * together, in the one batch of expired timers that the wakeup processes, at
+ * most S late.  The rounding is to multiples of S since an epoch shared by
+ * all contexts, not to S after the earliest event, so that contexts with the
+ * same slack ask for the same wakeup times, and an application that serves
+ * many contexts from one thread wakes up once for all of them.
+ *
+ * Assumptions:
+ * ----BEGIN DISCUSSION----
+ * - Timers fire late, never early.  Firing loss detection early would cause
+ *   spurious retransmissions, firing it late only delays recovery a little.
+ * - The slack applies to all timers of a context.  The pacer sends the
+ *   datagrams that became due during the slack as a burst, bounded by its
+ *   usual burst limit, and the ack delay is measured and reported to the
+ *   peer in the ack frame, so that late acks do not distort the RTT
+ *   estimate of the peer.
+ * - The slack is rounded up to whole ticks of the timing wheel, a slack of
+ *   0, the default, disables coalescing.
+ * - Calls to tcp2_process for other reasons, received datagrams for
+ *   example, still run every timer that is due at that moment, so a busy
+ *   context loses no precision at all.
+ * ----END DISCUSSION----
+ */
+
+
+
+/*
+ * Set the timer slack of a context, in nanoseconds.  Takes effect with the
+ * next call to tcp2_process.
+ */
+void tcp2_context_set_timer_slack(struct tcp2_context *tcp2_context,
+                                  uint64_t slack) {
+  tcp2_context->timer_slack_ticks =
+    (slack + ((1 << TCP2_TIMER_TICK_SHIFT) - 1)) >> TCP2_TIMER_TICK_SHIFT;
+
+  /*
+   * Make the next call report its rounded time.
+   */
+  tcp2_context_forget_timeout(tcp2_context);
+}
+
+/*
+ * Round a tick up to the slack grid of a context.
+ */
+static uint64_t tcp2_context_coalesce(const struct tcp2_context *tcp2_context,
+                                      uint64_t tick) {
+  uint64_t slack = tcp2_context->timer_slack_ticks;
+
+  if ((slack <= 1) || (tick == TCP2_TIMEOUT_NONE))
+    return tick;
+
+  return ((tick + slack - 1) / slack) * slack;
+}
+
+
+
+/*
+ * tcp2_context_report_timeout, as in events_in_out_4.c, comparing and
+ * reporting the coalesced time of the earliest event.  In
+ * TCP2_TIMEOUT_ON_CHANGE mode, slack also saves re-arms: events that move
+ * within one slack window leave the reported time where it is.
+ */
+void tcp2_context_report_timeout(struct tcp2_context *tcp2_context,
+                                 uint64_t now,
+                                 struct tcp2_events *tcp2_events) {
+  uint64_t next =
+    tcp2_context_coalesce(tcp2_context,
+                          tcp2_timer_wheel_next_expiry(&tcp2_context->timers));
+  uint64_t reported = tcp2_context->timeout_reported;
+  uint64_t now_tick = now >> TCP2_TIMER_TICK_SHIFT;
+
+  if (tcp2_context->timeout_mode == TCP2_TIMEOUT_ON_CHANGE) {
+    int armed = (reported != TCP2_TIMEOUT_NONE) && (reported > now_tick);
+
+    if (armed && (next != TCP2_TIMEOUT_NONE) && (next >= reported) &&
+        (next - reported <=
+           (TCP2_TIMEOUT_LATER_REPORT >> TCP2_TIMER_TICK_SHIFT)))
+      return;
+
+    if (!armed && (next == TCP2_TIMEOUT_NONE) &&
+        (reported == TCP2_TIMEOUT_NONE))
+      return;
+  }
+
+  tcp2_events->flags_out |= TCP2_EVENTS_TIMEOUT_CHANGED;
+  tcp2_context->timeout_reported = next;
+
+  if (next == TCP2_TIMEOUT_NONE)
+    tcp2_events->timeout_out = (struct timeval){0, 0};
+  else
+    tcp2_timeout_to_timeval(next, now, &tcp2_events->timeout_out);
+}
+
+
+
+
+
+
+/*
+ * The application configures the slack when it creates the context, from
+ * its options: for example 0 on a dedicated server, where pacing precision
+ * matters most, and 1ms on an edge node, where wakeups do.
+ */
+void app_on_tcp2_context_created(struct app_context *app_context,
+                                 struct tcp2_context *tcp2_context) {
+  tcp2_context_set_timeout_mode(tcp2_context, TCP2_TIMEOUT_ON_CHANGE);
+  tcp2_context_set_timer_slack(tcp2_context,
+                               app_context->options.tcp2_timer_slack);
+
+  tcp2_events_init(&app_context->tcp2_events);
+  app_context->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+}